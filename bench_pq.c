@@ -0,0 +1,1069 @@
+/*
+ * Pthread queues -- throughput benchmarks.
+ *
+ * Usage: bench_pq [benchmark [producers consumers [messages]]]
+ * Without a benchmark name, all benchmarks run with their defaults.
+ */
+
+#if defined(__linux__)
+/* For pinning the real-time benchmark to one CPU. */
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+#include "pq.h"
+
+/* Defaults for the number of threads and messages. */
+#define B_PRODUCERS 4
+#define B_CONSUMERS 4
+#define B_MESSAGES  400000u
+
+/* Capacity of the queue, or of each lane. */
+#define B_MAXMSG    256
+
+/* Largest priority of the priority queue benchmarks. */
+#define B_MAXPRIO   1023
+
+/* Message sent: a global sequence number. */
+struct bench_msg {
+    uint64_t seq;
+};
+
+/* Pause between sends of the receiver priority benchmark, in ns. */
+#define B_PACE_NS   20000
+
+/* Real-time benchmark: seconds per run, the queue's capacity kept nearly
+ * full so that inserts take long, and the SCHED_FIFO priorities of the
+ * low, medium and high priority threads, and the latency counted as
+ * blocked behind the medium priority thread, in seconds. */
+#define B_RT_SECONDS 2.0
+#define B_RT_MAXMSG  16384
+#define B_RT_LOW     10
+#define B_RT_MEDIUM  20
+#define B_RT_HIGH    30
+#define B_RT_BLOCKED 500e-6
+
+/* Cross-node benchmark: data bytes per message, and the highest node
+ * number looked for. */
+#define B_NUMA_PAYLOAD 4096
+#define B_NUMA_NODES   64
+
+/* Logged send or receive, for replaying rank errors. */
+struct bench_op {
+    msgprio_t prio;
+    uint8_t recv;
+};
+
+/* One benchmark run. */
+struct bench {
+    /* Queue under test; exactly one is set. */
+    struct pq_queue *queue;
+    struct pq_shard *shard;
+    /* Messages each producer sends and each consumer receives. */
+    uint32_t per_producer;
+    uint32_t per_consumer;
+    /* Next sequence number to send. */
+    uint64_t seq;
+    /* Receives of a lower sequence number than one received before by
+     * the same consumer: reordering seen by consumers. */
+    uint64_t inversions;
+    /* If nonzero, send random priorities up to maxprio. */
+    msgprio_t maxprio;
+    /* Random seeds handed out to producers. */
+    uint32_t seed;
+    /* If set, every operation in ticket order, 2 per message. */
+    struct bench_op *log;
+    uint64_t ticket;
+    /* Messages not received yet, for consumers that stop on their own. */
+    uint64_t remaining;
+};
+
+/* Consumer of a priority and how long it waited for messages. */
+struct bench_waiter {
+    struct bench *bench;
+    msgprio_t prio;
+    uint64_t count;
+    double  wait;
+    double  wait_max;
+};
+
+/* Message of the cross-node benchmark. */
+struct bench_numa_msg {
+    double  sent;
+    char    payload[B_NUMA_PAYLOAD];
+};
+
+/* Side of the cross-node benchmark: data queue, queue of acknowledgments,
+ * and the round trips of the producer. */
+struct bench_numa {
+    struct pq_queue *data;
+    struct pq_queue *ack;
+    uint32_t count;
+    double  round_trip;
+    double  round_trip_max;
+};
+
+/* Real-time thread and the latencies of its queue operations. */
+struct bench_rt {
+    struct pq_queue *queue;
+    /* Time to stop at. */
+    double  end;
+    uint64_t count;
+    uint64_t blocked;
+    double  latency;
+    double  latency_max;
+};
+
+/* A named benchmark. */
+struct bench_entry {
+    const char *name;
+    void    (*run)(unsigned aProducers, unsigned aConsumers, uint32_t aMessages);
+};
+
+void    bench_shard(unsigned aProducers, unsigned aConsumers, uint32_t aMessages);
+void    bench_multi(unsigned aProducers, unsigned aConsumers, uint32_t aMessages);
+void    bench_combine(unsigned aProducers, unsigned aConsumers, uint32_t aMessages);
+void    bench_rprio(unsigned aProducers, unsigned aConsumers, uint32_t aMessages);
+void    bench_mutex(unsigned aProducers, unsigned aConsumers, uint32_t aMessages);
+double  bench_pairs_run(struct bench *aBench, unsigned aThreads);
+void   *bench_pairs(void *aBench);
+void    bench_layout(unsigned aProducers, unsigned aConsumers, uint32_t aMessages);
+int     bench_perf_open(void);
+void    bench_numa(unsigned aProducers, unsigned aConsumers, uint32_t aMessages);
+int     bench_node_cpus(unsigned aNode, void *aCpus);
+void   *bench_numa_producer(void *aSide);
+void   *bench_numa_consumer(void *aSide);
+void    bench_pi(unsigned aProducers, unsigned aConsumers, uint32_t aMessages);
+pq_status_t bench_rt_start(pthread_t *aThread, int aPriority, void *(*aTask)(void *), struct bench_rt *aRt);
+void   *bench_rt_low(void *aRt);
+void   *bench_rt_medium(void *aRt);
+void   *bench_rt_high(void *aRt);
+void   *bench_paced_producer(void *aBench);
+void   *bench_waiting_consumer(void *aWaiter);
+void    bench_rank(const struct bench_op *aLog, uint64_t aCount, double *aMean, uint64_t *aMax);
+double  bench_run(struct bench *aBench, unsigned aProducers, unsigned aConsumers);
+void   *bench_producer(void *aBench);
+void   *bench_consumer(void *aBench);
+double  bench_now(void);
+void    bench_check(const char *aWhat, pq_status_t aStatus);
+
+static const struct bench_entry gBenchmarks[] = {
+    {"shard", bench_shard},
+    {"multi", bench_multi},
+    {"combine", bench_combine},
+    {"rprio", bench_rprio},
+    {"pi", bench_pi},
+    {"mutex", bench_mutex},
+    {"layout", bench_layout},
+    {"numa", bench_numa},
+};
+
+/******************************************************************************/
+/*!
+ * Get the time in seconds.
+ * @return  CLOCK_MONOTONIC time.
+ */
+double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + ((double) ts.tv_nsec * 1e-9);
+}
+
+/******************************************************************************/
+/*!
+ * Exit if a call failed.
+ * @param   aWhat       [in] What was called.
+ * @param   aStatus     Its status.
+ */
+void bench_check(const char *aWhat, pq_status_t aStatus) {
+    if (aStatus != 0) {
+        fprintf(stderr, "%s: %s\n", aWhat, strerror(aStatus));
+        exit(EXIT_FAILURE);
+    }
+}
+
+/******************************************************************************/
+/*!
+ * Send sequence numbers.
+ * @param   aBench      [in] Benchmark run.
+ * @return  NULL.
+ */
+void   *bench_producer(void *aBench) {
+    struct bench *const b = aBench;
+    struct bench_msg bm;
+    struct pq_msg m = {.msg = &bm,.size = sizeof bm };
+    uint32_t x = __atomic_add_fetch(&b->seed, 1u, __ATOMIC_RELAXED) * 0x9e3779b9u;
+    for (uint32_t i = 0; i < b->per_producer; ++i) {
+        bm.seq = __atomic_fetch_add(&b->seq, 1, __ATOMIC_RELAXED);
+        if (b->maxprio != 0) {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            m.prio = (msgprio_t) (x % (b->maxprio + 1u));
+        }
+        if (b->log != NULL) {
+            /* Ticket before the send, so that it precedes its receive. */
+            const uint64_t t = __atomic_fetch_add(&b->ticket, 1, __ATOMIC_RELAXED);
+            b->log[t] = (struct bench_op) {.prio = m.prio,.recv = 0 };
+        }
+        bench_check("send", (b->shard != NULL) ? pq_shard_send(b->shard, &m, PQ_TIMEOUT_INF)
+                    : pq_send_timed(b->queue, &m, PQ_TIMEOUT_INF));
+    }
+    return NULL;
+}
+
+/******************************************************************************/
+/*!
+ * Receive messages and count order inversions.
+ * @param   aBench      [in] Benchmark run.
+ * @return  NULL.
+ */
+void   *bench_consumer(void *aBench) {
+    struct bench *const b = aBench;
+    struct bench_msg bm;
+    struct pq_msg m = {.msg = &bm,.size = sizeof bm };
+    uint64_t highest = 0;
+    uint64_t inversions = 0;
+    for (uint32_t i = 0; i < b->per_consumer; ++i) {
+        bench_check("recv", (b->shard != NULL) ? pq_shard_recv(b->shard, &m, PQ_TIMEOUT_INF)
+                    : pq_recv_timed(b->queue, &m, PQ_TIMEOUT_INF));
+        if (b->log != NULL) {
+            const uint64_t t = __atomic_fetch_add(&b->ticket, 1, __ATOMIC_RELAXED);
+            b->log[t] = (struct bench_op) {.prio = m.prio,.recv = 1 };
+        }
+        if (bm.seq < highest) {
+            ++inversions;
+        }
+        else {
+            highest = bm.seq;
+        }
+    }
+    __atomic_add_fetch(&b->inversions, inversions, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+/******************************************************************************/
+/*!
+ * Run producers and consumers to completion.
+ * @param   aBench      [inout] Benchmark run with queue and counts set.
+ * @param   aProducers  Number of producer threads.
+ * @param   aConsumers  Number of consumer threads.
+ * @return  Elapsed time in seconds.
+ */
+double bench_run(struct bench *aBench, unsigned aProducers, unsigned aConsumers) {
+    pthread_t *const tid = malloc((aProducers + aConsumers) * sizeof *tid);
+    if (tid == NULL) {
+        bench_check("malloc", ENOMEM);
+    }
+    aBench->seq = 0;
+    aBench->inversions = 0;
+    aBench->seed = 0;
+    aBench->ticket = 0;
+    const double t0 = bench_now();
+    for (unsigned i = 0; i < aConsumers; ++i) {
+        bench_check("pthread_create", pthread_create(&tid[i], NULL, bench_consumer, aBench));
+    }
+    for (unsigned i = 0; i < aProducers; ++i) {
+        bench_check("pthread_create", pthread_create(&tid[aConsumers + i], NULL, bench_producer, aBench));
+    }
+    for (unsigned i = 0; i < (aProducers + aConsumers); ++i) {
+        bench_check("pthread_join", pthread_join(tid[i], NULL));
+    }
+    const double elapsed = bench_now() - t0;
+    free(tid);
+    return elapsed;
+}
+
+/******************************************************************************/
+/*!
+ * Compare one FIFO queue with a sharded queue of as many lanes as threads
+ * on either side.
+ * @param   aProducers  Number of producer threads.
+ * @param   aConsumers  Number of consumer threads.
+ * @param   aMessages   Number of messages in total.
+ */
+void bench_shard(unsigned aProducers, unsigned aConsumers, uint32_t aMessages) {
+    struct pq_attr attr = {.maxmsg = B_MAXMSG,.msgsize = sizeof(struct bench_msg),.order = PQ_ATTR_FIFO };
+    const msgindex_t lanes = (msgindex_t) ((aProducers > aConsumers) ? aProducers : aConsumers);
+    struct bench b = {.per_producer = aMessages / aProducers,.per_consumer = aMessages / aConsumers };
+
+    printf("shard: %u producers, %u consumers, %u messages, FIFO\n", aProducers, aConsumers, aMessages);
+    printf("%-24s %12s %10s %12s\n", "queue", "msgs/s", "ns/msg", "inversions");
+    for (int sharded = 0; sharded <= 1; ++sharded) {
+        char    name[32];
+        if (!sharded) {
+            bench_check("pq_create", pq_create(&b.queue, &attr));
+            snprintf(name, sizeof name, "single queue");
+        }
+        else {
+            bench_check("pq_shard_create", pq_shard_create(&b.shard, &attr, lanes));
+            snprintf(name, sizeof name, "shard of %u lanes", lanes);
+        }
+        const double s = bench_run(&b, aProducers, aConsumers);
+        printf("%-24s %12.0f %10.1f %11.3f%%\n", name, aMessages / s, s * 1e9 / aMessages,
+               100.0 * (double) b.inversions / aMessages);
+        if (!sharded) {
+            bench_check("pq_destroy", pq_destroy(b.queue));
+            b.queue = NULL;
+        }
+        else {
+            bench_check("pq_shard_destroy", pq_shard_destroy(b.shard));
+            b.shard = NULL;
+        }
+    }
+    printf("\n");
+}
+
+/******************************************************************************/
+/*!
+ * Replay logged operations and measure the rank error of receives.
+ * @param   aLog        [in] Operations in ticket order.
+ * @param   aCount      Number of operations.
+ * @param   aMean       [out] Mean rank error.
+ * @param   aMax        [out] Largest rank error.
+ *
+ * The rank error of a receive is the number of messages of higher priority
+ * in the queue at the time, 0 for a strict priority queue.  Tickets are
+ * taken outside the queue's locks, so this is an estimate: a send that
+ * overlaps a receive counts as before it.
+ */
+void bench_rank(const struct bench_op *aLog, uint64_t aCount, double *aMean, uint64_t *aMax) {
+    /* Fenwick tree of the number of messages of each priority. */
+    int64_t *const tree = calloc(B_MAXPRIO + 2u, sizeof *tree);
+    if (tree == NULL) {
+        bench_check("calloc", ENOMEM);
+    }
+    int64_t present = 0;
+    uint64_t sum = 0;
+    uint64_t receives = 0;
+    *aMax = 0;
+    for (uint64_t t = 0; t < aCount; ++t) {
+        const unsigned p = aLog[t].prio + 1u;
+        if (aLog[t].recv) {
+            int64_t below = 0;
+            for (unsigned i = p; i > 0; i -= i & -i) {
+                below += tree[i];
+            }
+            const uint64_t rank = (present > below) ? (uint64_t) (present - below) : 0;
+            sum += rank;
+            *aMax = (rank > *aMax) ? rank : *aMax;
+            ++receives;
+        }
+        const int64_t delta = aLog[t].recv ? -1 : 1;
+        for (unsigned i = p; i <= (B_MAXPRIO + 1u); i += i & -i) {
+            tree[i] += delta;
+        }
+        present += delta;
+    }
+    *aMean = (receives > 0) ? (double) sum / (double) receives : 0.0;
+    free(tree);
+}
+
+/******************************************************************************/
+/*!
+ * Compare one priority queue with a MultiQueue of two heaps per thread, for
+ * throughput and rank error.
+ * @param   aProducers  Number of producer threads.
+ * @param   aConsumers  Number of consumer threads.
+ * @param   aMessages   Number of messages in total.
+ */
+void bench_multi(unsigned aProducers, unsigned aConsumers, uint32_t aMessages) {
+    struct pq_attr attr = {.maxmsg = B_MAXMSG,.msgsize = sizeof(struct bench_msg),.order = PQ_ATTR_PRIOQ,
+        .maxprio = B_MAXPRIO
+    };
+    const msgindex_t heaps = (msgindex_t) (2 * ((aProducers > aConsumers) ? aProducers : aConsumers));
+    struct bench b = {.per_producer = aMessages / aProducers,.per_consumer = aMessages / aConsumers,
+        .maxprio = B_MAXPRIO
+    };
+    struct bench_op *const log = malloc(2 * (size_t) aMessages * sizeof *log);
+    if (log == NULL) {
+        bench_check("malloc", ENOMEM);
+    }
+
+    printf("multi: %u producers, %u consumers, %u messages, PRIOQ of %u priorities\n", aProducers, aConsumers,
+           aMessages, B_MAXPRIO + 1);
+    printf("%-24s %12s %10s %10s %10s\n", "queue", "msgs/s", "ns/msg", "mean rank", "max rank");
+    for (int relaxed = 0; relaxed <= 1; ++relaxed) {
+        char    name[32];
+        if (!relaxed) {
+            bench_check("pq_create", pq_create(&b.queue, &attr));
+            snprintf(name, sizeof name, "single queue");
+        }
+        else {
+            bench_check("pq_multi_create", pq_multi_create(&b.shard, &attr, heaps));
+            snprintf(name, sizeof name, "multi of %u heaps", heaps);
+        }
+        /* Time without the log, then log a second run for rank errors. */
+        b.log = NULL;
+        const double s = bench_run(&b, aProducers, aConsumers);
+        b.log = log;
+        bench_run(&b, aProducers, aConsumers);
+        double  mean;
+        uint64_t max;
+        bench_rank(log, b.ticket, &mean, &max);
+        printf("%-24s %12.0f %10.1f %10.2f %10llu\n", name, aMessages / s, s * 1e9 / aMessages, mean,
+               (unsigned long long) max);
+        if (!relaxed) {
+            bench_check("pq_destroy", pq_destroy(b.queue));
+            b.queue = NULL;
+        }
+        else {
+            bench_check("pq_shard_destroy", pq_shard_destroy(b.shard));
+            b.shard = NULL;
+        }
+    }
+    free(log);
+    printf("\n");
+}
+
+/******************************************************************************/
+/*!
+ * Compare a priority queue locked per operation with a flat-combining one.
+ * @param   aProducers  Number of producer threads.
+ * @param   aConsumers  Number of consumer threads.
+ * @param   aMessages   Number of messages in total.
+ */
+void bench_combine(unsigned aProducers, unsigned aConsumers, uint32_t aMessages) {
+    struct pq_attr attr = {.maxmsg = B_MAXMSG,.msgsize = sizeof(struct bench_msg),.order = PQ_ATTR_PRIOQ,
+        .maxprio = B_MAXPRIO
+    };
+    struct bench b = {.per_producer = aMessages / aProducers,.per_consumer = aMessages / aConsumers,
+        .maxprio = B_MAXPRIO
+    };
+
+    printf("combine: %u producers, %u consumers, %u messages, PRIOQ of %u priorities\n", aProducers, aConsumers,
+           aMessages, B_MAXPRIO + 1);
+    printf("%-24s %12s %10s %12s %12s\n", "queue", "msgs/s", "ns/msg", "combined", "handed off");
+    for (int combining = 0; combining <= 1; ++combining) {
+        char    name[32];
+        struct pq_stats st;
+        attr.combine = combining ? (uint16_t) (aProducers + aConsumers) : 0;
+        bench_check("pq_create", pq_create(&b.queue, &attr));
+        snprintf(name, sizeof name, combining ? "flat combining" : "lock per operation");
+        const double s = bench_run(&b, aProducers, aConsumers);
+        bench_check("pq_get_stats", pq_get_stats(b.queue, &st));
+        printf("%-24s %12.0f %10.1f %11.1f%% %11.1f%%\n", name, aMessages / s, s * 1e9 / aMessages,
+               100.0 * (double) st.combined / (2.0 * aMessages), 100.0 * (double) st.handed_off / aMessages);
+        bench_check("pq_destroy", pq_destroy(b.queue));
+        b.queue = NULL;
+    }
+    printf("\n");
+}
+
+/******************************************************************************/
+/*!
+ * Send messages slowly, so that consumers wait.
+ * @param   aBench      [in] Benchmark run.
+ * @return  NULL.
+ */
+void   *bench_paced_producer(void *aBench) {
+    struct bench *const b = aBench;
+    struct bench_msg bm = {.seq = 0 };
+    struct pq_msg m = {.msg = &bm,.size = sizeof bm };
+    const struct timespec pace = {.tv_sec = 0,.tv_nsec = B_PACE_NS };
+    for (uint32_t i = 0; i < b->per_producer; ++i) {
+        bench_check("send", pq_send_timed(b->queue, &m, PQ_TIMEOUT_INF));
+        nanosleep(&pace, NULL);
+    }
+    return NULL;
+}
+
+/******************************************************************************/
+/*!
+ * Receive messages as a receiver of a priority until all are received,
+ * timing each wait.
+ * @param   aWaiter     [inout] Consumer.
+ * @return  NULL.
+ */
+void   *bench_waiting_consumer(void *aWaiter) {
+    struct bench_waiter *const w = aWaiter;
+    struct bench *const b = w->bench;
+    struct bench_msg bm;
+    struct pq_msg m = {.msg = &bm,.size = sizeof bm };
+    while (__atomic_load_n(&b->remaining, __ATOMIC_RELAXED) > 0) {
+        const double t0 = bench_now();
+        const pq_status_t sc = pq_recv_prio(b->queue, &m, w->prio, 10);
+        if (sc == ETIMEDOUT) {
+            continue;
+        }
+        bench_check("recv", sc);
+        const double wait = bench_now() - t0;
+        w->wait += wait;
+        w->wait_max = (wait > w->wait_max) ? wait : w->wait_max;
+        ++w->count;
+        __atomic_sub_fetch(&b->remaining, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+/******************************************************************************/
+/*!
+ * Measure how long a critical consumer waits among more consumers than
+ * messages, with and without receiver priority.
+ * @param   aProducers  Number of producer threads.
+ * @param   aConsumers  Number of consumer threads, one of them critical.
+ * @param   aMessages   Number of messages in total, divided by 100 as
+ *                      sends are paced.
+ */
+void bench_rprio(unsigned aProducers, unsigned aConsumers, uint32_t aMessages) {
+    struct pq_attr attr = {.maxmsg = B_MAXMSG,.msgsize = sizeof(struct bench_msg),.order = PQ_ATTR_FIFO };
+    const unsigned consumers = (aConsumers < 2) ? 2 : aConsumers;
+    const uint32_t messages = (aMessages / 100 / aProducers) * aProducers;
+    struct bench b = {.per_producer = messages / aProducers };
+    struct bench_waiter *const w = calloc(consumers, sizeof *w);
+    pthread_t *const tid = malloc((aProducers + consumers) * sizeof *tid);
+    if ((w == NULL) || (tid == NULL)) {
+        bench_check("malloc", ENOMEM);
+    }
+
+    printf("rprio: %u producers, %u consumers, %u messages sent every %u us, FIFO\n", aProducers, consumers,
+           messages, B_PACE_NS / 1000);
+    printf("%-24s %10s %12s %12s %12s\n", "receivers", "critical", "crit mean us", "crit max us", "other mean us");
+    for (int ranked = 0; ranked <= 1; ++ranked) {
+        bench_check("pq_create", pq_create(&b.queue, &attr));
+        b.remaining = messages;
+        memset(w, 0, consumers * sizeof *w);
+        for (unsigned i = 0; i < consumers; ++i) {
+            w[i].bench = &b;
+            w[i].prio = (ranked && (i == 0)) ? 1 : 0;
+            bench_check("pthread_create", pthread_create(&tid[i], NULL, bench_waiting_consumer, &w[i]));
+        }
+        for (unsigned i = 0; i < aProducers; ++i) {
+            bench_check("pthread_create", pthread_create(&tid[consumers + i], NULL, bench_paced_producer, &b));
+        }
+        for (unsigned i = 0; i < (aProducers + consumers); ++i) {
+            bench_check("pthread_join", pthread_join(tid[i], NULL));
+        }
+        uint64_t others = 0;
+        double  other_wait = 0.0;
+        for (unsigned i = 1; i < consumers; ++i) {
+            others += w[i].count;
+            other_wait += w[i].wait;
+        }
+        printf("%-24s %9.1f%% %12.1f %12.1f %12.1f\n", ranked ? "critical first" : "arrival order",
+               100.0 * (double) w[0].count / messages, (w[0].count > 0) ? w[0].wait * 1e6 / w[0].count : 0.0,
+               w[0].wait_max * 1e6, (others > 0) ? other_wait * 1e6 / others : 0.0);
+        bench_check("pq_destroy", pq_destroy(b.queue));
+        b.queue = NULL;
+    }
+    free(tid);
+    free(w);
+    printf("\n");
+}
+
+/******************************************************************************/
+/*!
+ * Start a SCHED_FIFO thread.
+ * @param   aThread     [out] Thread.
+ * @param   aPriority   Real-time priority.
+ * @param   aTask       Function the thread runs.
+ * @param   aRt         [inout] Its argument.
+ * @return  0 on success, or error code of pthread_create().
+ */
+pq_status_t bench_rt_start(pthread_t *aThread, int aPriority, void *(*aTask)(void *), struct bench_rt *aRt) {
+    pthread_attr_t attr;
+    const struct sched_param param = {.sched_priority = aPriority };
+    bench_check("pthread_attr_init", pthread_attr_init(&attr));
+    bench_check("pthread_attr_setinheritsched", pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED));
+    bench_check("pthread_attr_setschedpolicy", pthread_attr_setschedpolicy(&attr, SCHED_FIFO));
+    bench_check("pthread_attr_setschedparam", pthread_attr_setschedparam(&attr, &param));
+    const pq_status_t sc = pthread_create(aThread, &attr, aTask, aRt);
+    pthread_attr_destroy(&attr);
+    return sc;
+}
+
+/******************************************************************************/
+/*!
+ * Low priority thread: bursts of sends and receives of the lowest
+ * priority, each one moving the whole queue, with pauses.
+ * @param   aRt         [inout] Thread.
+ * @return  NULL.
+ */
+void   *bench_rt_low(void *aRt) {
+    struct bench_rt *const rt = aRt;
+    struct bench_msg bm = {.seq = 0 };
+    struct pq_msg m = {.msg = &bm,.size = sizeof bm,.prio = 0 };
+    const struct timespec pause = {.tv_sec = 0,.tv_nsec = 1000000 };
+    while (bench_now() < rt->end) {
+        const double burst = bench_now() + 1e-3;
+        while (bench_now() < burst) {
+            bench_check("send", pq_send_nonbl(rt->queue, &m));
+            bench_check("recv", pq_recv_nonbl(rt->queue, &m));
+            m.prio = 0;
+        }
+        nanosleep(&pause, NULL);
+    }
+    return NULL;
+}
+
+/******************************************************************************/
+/*!
+ * Medium priority thread: busy for 2 ms every 10 ms, never touching the
+ * queue.
+ * @param   aRt         [inout] Thread.
+ * @return  NULL.
+ */
+void   *bench_rt_medium(void *aRt) {
+    struct bench_rt *const rt = aRt;
+    const struct timespec pause = {.tv_sec = 0,.tv_nsec = 8000000 };
+    while (bench_now() < rt->end) {
+        nanosleep(&pause, NULL);
+        const double busy = bench_now() + 2e-3;
+        while (bench_now() < busy) {
+        }
+    }
+    return NULL;
+}
+
+/******************************************************************************/
+/*!
+ * High priority thread: every millisecond, send and receive a message of
+ * the highest priority, timing both.
+ * @param   aRt         [inout] Thread.
+ * @return  NULL.
+ */
+void   *bench_rt_high(void *aRt) {
+    struct bench_rt *const rt = aRt;
+    struct bench_msg bm = {.seq = 0 };
+    struct pq_msg m = {.msg = &bm,.size = sizeof bm,.prio = B_MAXPRIO };
+    const struct timespec pause = {.tv_sec = 0,.tv_nsec = 1000000 };
+    while (bench_now() < rt->end) {
+        nanosleep(&pause, NULL);
+        const double t0 = bench_now();
+        bench_check("send", pq_send_nonbl(rt->queue, &m));
+        bench_check("recv", pq_recv_nonbl(rt->queue, &m));
+        const double latency = bench_now() - t0;
+        rt->latency += latency;
+        rt->latency_max = (latency > rt->latency_max) ? latency : rt->latency_max;
+        rt->blocked += (latency > B_RT_BLOCKED);
+        ++rt->count;
+    }
+    return NULL;
+}
+
+/******************************************************************************/
+/*!
+ * Measure priority inversion: how long a high priority thread blocks on
+ * a queue held by a low priority thread that a medium priority thread
+ * preempts, for each mutex protocol. All threads are SCHED_FIFO and
+ * share one CPU.
+ * @param   aProducers  Unused.
+ * @param   aConsumers  Unused.
+ * @param   aMessages   Unused.
+ */
+void bench_pi(unsigned aProducers, unsigned aConsumers, uint32_t aMessages) {
+    static const char *const names[] = { "none", "inherit", "protect" };
+    static void *(*const tasks[])(void *) = { bench_rt_low, bench_rt_medium, bench_rt_high };
+    static const int prios[] = { B_RT_LOW, B_RT_MEDIUM, B_RT_HIGH };
+    struct pq_attr attr = {.maxmsg = B_RT_MAXMSG,.msgsize = sizeof(struct bench_msg),.order = PQ_ATTR_PRIFO,
+        .maxprio = B_MAXPRIO,.ceiling = B_RT_HIGH
+    };
+    /* Filling the queue locks it too, which PQ_PROTO_PROTECT only allows
+     * real-time threads. */
+    int     policy;
+    struct sched_param param;
+    const struct sched_param high = {.sched_priority = B_RT_HIGH };
+    bench_check("pthread_getschedparam", pthread_getschedparam(pthread_self(), &policy, &param));
+    const pq_status_t sc = pthread_setschedparam(pthread_self(), SCHED_FIFO, &high);
+    if (sc == EPERM) {
+        printf("pi: skipped, real-time scheduling not permitted\n\n");
+        return;
+    }
+    bench_check("pthread_setschedparam", sc);
+#if defined(__linux__)
+    cpu_set_t cpus;
+    cpu_set_t one;
+    bench_check("sched_getaffinity", (sched_getaffinity(0, sizeof cpus, &cpus) == 0) ? 0 : errno);
+    CPU_ZERO(&one);
+    CPU_SET(sched_getcpu(), &one);
+    bench_check("sched_setaffinity", (sched_setaffinity(0, sizeof one, &one) == 0) ? 0 : errno);
+#endif
+
+    printf("pi: SCHED_FIFO %d/%d/%d threads on one CPU, PRIFO with %u messages, %.0f s each\n", B_RT_LOW,
+           B_RT_MEDIUM, B_RT_HIGH, B_RT_MAXMSG - 2, B_RT_SECONDS);
+    printf("%-24s %10s %12s %12s %10s\n", "protocol", "samples", "mean us", "max us", "> 500 us");
+    for (uint16_t protocol = PQ_PROTO_NONE; protocol <= PQ_PROTO_PROTECT; ++protocol) {
+        struct pq_queue *queue = NULL;
+        struct bench_rt rt[3];
+        pthread_t tid[3];
+        struct bench_msg bm = {.seq = 0 };
+        const struct pq_msg m = {.msg = &bm,.size = sizeof bm };
+
+        attr.protocol = protocol;
+        bench_check("pq_create", pq_create(&queue, &attr));
+        for (unsigned i = 0; i < (B_RT_MAXMSG - 2); ++i) {
+            bench_check("send", pq_send_nonbl(queue, &m));
+        }
+        const double end = bench_now() + B_RT_SECONDS;
+        for (unsigned i = 0; i < 3; ++i) {
+            rt[i] = (struct bench_rt) {.queue = queue,.end = end };
+            bench_check("pthread_create", bench_rt_start(&tid[i], prios[i], tasks[i], &rt[i]));
+        }
+        for (unsigned i = 0; i < 3; ++i) {
+            bench_check("pthread_join", pthread_join(tid[i], NULL));
+        }
+        bench_check("pq_destroy", pq_destroy(queue));
+        printf("%-24s %10llu %12.1f %12.1f %10llu\n", names[protocol], (unsigned long long) rt[2].count,
+               (rt[2].count > 0) ? rt[2].latency * 1e6 / rt[2].count : 0.0, rt[2].latency_max * 1e6,
+               (unsigned long long) rt[2].blocked);
+    }
+
+#if defined(__linux__)
+    bench_check("sched_setaffinity", (sched_setaffinity(0, sizeof cpus, &cpus) == 0) ? 0 : errno);
+#endif
+    bench_check("pthread_setschedparam", pthread_setschedparam(pthread_self(), policy, &param));
+    printf("\n");
+}
+
+/******************************************************************************/
+/*!
+ * Send and receive right away, without blocking.
+ * @param   aBench      [in] Benchmark run.
+ * @return  NULL.
+ */
+void   *bench_pairs(void *aBench) {
+    struct bench *const b = aBench;
+    struct bench_msg bm = {.seq = 0 };
+    struct pq_msg m = {.msg = &bm,.size = sizeof bm };
+    for (uint32_t i = 0; i < b->per_producer; ++i) {
+        bench_check("send", pq_send_nonbl(b->queue, &m));
+        const pq_status_t sc = pq_recv_nonbl(b->queue, &m);
+        /* Another thread may have taken the message. */
+        if (sc != EAGAIN) {
+            bench_check("recv", sc);
+        }
+    }
+    return NULL;
+}
+
+/******************************************************************************/
+/*!
+ * Run send and receive pairs on a queue in threads.
+ * @param   aBench      [inout] Benchmark run.
+ * @param   aThreads    Number of threads.
+ * @return  Elapsed time in seconds.
+ */
+double bench_pairs_run(struct bench *aBench, unsigned aThreads) {
+    pthread_t *const tid = malloc(aThreads * sizeof *tid);
+    if (tid == NULL) {
+        bench_check("malloc", ENOMEM);
+    }
+    const double t0 = bench_now();
+    for (unsigned i = 0; i < aThreads; ++i) {
+        bench_check("pthread_create", pthread_create(&tid[i], NULL, bench_pairs, aBench));
+    }
+    for (unsigned i = 0; i < aThreads; ++i) {
+        bench_check("pthread_join", pthread_join(tid[i], NULL));
+    }
+    const double t = bench_now() - t0;
+    free(tid);
+    return t;
+}
+
+/******************************************************************************/
+/*!
+ * Compare mutex types by the time of a pq_send_nonbl() and
+ * pq_recv_nonbl() pair, by one thread and by many.
+ * @param   aProducers  Number of threads of the contended runs.
+ * @param   aConsumers  Unused.
+ * @param   aMessages   Number of pairs in total.
+ */
+void bench_mutex(unsigned aProducers, unsigned aConsumers, uint32_t aMessages) {
+    static const char *const names[] = { "", "recursive", "normal", "adaptive" };
+    struct pq_attr attr = {.maxmsg = B_MAXMSG,.msgsize = sizeof(struct bench_msg),.order = PQ_ATTR_FIFO };
+    printf("mutex: %u pairs of pq_send_nonbl() and pq_recv_nonbl(), FIFO\n", aMessages);
+    char    contended[32];
+    snprintf(contended, sizeof contended, "%u threads ns", aProducers);
+    printf("%-24s %14s %14s\n", "type", "1 thread ns", contended);
+    for (uint16_t type = PQ_MUTEX_RECURSIVE; type <= PQ_MUTEX_ADAPTIVE; ++type) {
+        struct bench b = {.per_producer = aMessages };
+        attr.mutex = type;
+        bench_check("pq_create", pq_create(&b.queue, &attr));
+        const double alone = bench_pairs_run(&b, 1);
+        b.per_producer = aMessages / aProducers;
+        const double shared = bench_pairs_run(&b, aProducers);
+        bench_check("pq_destroy", pq_destroy(b.queue));
+        printf("%-24s %14.1f %14.1f\n", names[type], alone * 1e9 / aMessages, shared * 1e9 / aMessages);
+    }
+    printf("\n");
+}
+
+/******************************************************************************/
+/*!
+ * Open a disabled counter of cache misses of this process and the threads
+ * it creates afterwards.
+ * @return  File descriptor, or -1 with errno set if there is no counter.
+ */
+int bench_perf_open(void) {
+#if defined(__linux__)
+    struct perf_event_attr pe;
+    memset(&pe, 0, sizeof pe);
+    pe.size = sizeof pe;
+    pe.type = PERF_TYPE_HARDWARE;
+    pe.config = PERF_COUNT_HW_CACHE_MISSES;
+    pe.disabled = 1;
+    pe.inherit = 1;
+    pe.exclude_kernel = 1;
+    pe.exclude_hv = 1;
+    return (int) syscall(SYS_perf_event_open, &pe, 0, -1, -1, 0);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/******************************************************************************/
+/*!
+ * Show which lines of a queue descriptor the fields that different
+ * threads write fall on, and count cache misses of contended send and
+ * receive pairs.
+ * @param   aProducers  Number of threads.
+ * @param   aConsumers  Unused.
+ * @param   aMessages   Number of pairs in total.
+ */
+void bench_layout(unsigned aProducers, unsigned aConsumers, uint32_t aMessages) {
+    static const struct {
+        const char *name;
+        size_t  offset;
+    } fields[] = {
+        {"maxmsg", offsetof(struct pq_queue, maxmsg)},
+        {"combine", offsetof(struct pq_queue, combine)},
+        {"fill", offsetof(struct pq_queue, fill)},
+        {"top", offsetof(struct pq_queue, top)},
+        {"waiting_to_send", offsetof(struct pq_queue, waiting_to_send)},
+        {"waiting_to_recv", offsetof(struct pq_queue, waiting_to_recv)},
+        {"mtx", offsetof(struct pq_queue, mtx)},
+        {"head", offsetof(struct pq_queue, head)},
+        {"stats", offsetof(struct pq_queue, stats)},
+    };
+    const struct pq_attr attr = {.maxmsg = B_MAXMSG,.msgsize = sizeof(struct bench_msg),.order = PQ_ATTR_FIFO };
+    struct bench b = {.per_producer = aMessages / aProducers };
+
+    printf("layout: %zu byte descriptor\n", sizeof(struct pq_queue));
+    printf("  %-22s %6s %4s\n", "field", "offset", "line");
+    for (size_t i = 0; i < (sizeof fields / sizeof *fields); ++i) {
+        printf("  %-22s %6zu %4zu\n", fields[i].name, fields[i].offset, fields[i].offset / 64);
+    }
+    bench_check("pq_create", pq_create(&b.queue, &attr));
+    const int fd = bench_perf_open();
+    const pq_status_t perf = (fd < 0) ? errno : 0;
+#if defined(__linux__)
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+    const double t = bench_pairs_run(&b, aProducers);
+    uint64_t misses = 0;
+    if (fd >= 0) {
+#if defined(__linux__)
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+#endif
+        if (read(fd, &misses, sizeof misses) != (ssize_t) sizeof misses) {
+            misses = 0;
+        }
+        close(fd);
+    }
+    bench_check("pq_destroy", pq_destroy(b.queue));
+    printf("%u threads, %u pairs: %.1f ns per pair, ", aProducers, aMessages, t * 1e9 / aMessages);
+    if (perf == 0) {
+        printf("%.2f cache misses per pair\n\n", (double) misses / aMessages);
+    }
+    else {
+        printf("cache misses not counted: %s\n\n", strerror(perf));
+    }
+}
+
+/******************************************************************************/
+/*!
+ * Get the CPUs of a NUMA node.
+ * @param   aNode       Node number.
+ * @param   aCpus       [out] cpu_set_t of its CPUs.
+ * @return  Nonzero if the node exists and has CPUs.
+ */
+int bench_node_cpus(unsigned aNode, void *aCpus) {
+#if defined(__linux__)
+    cpu_set_t *const cpus = aCpus;
+    char    path[64];
+    snprintf(path, sizeof path, "/sys/devices/system/node/node%u/cpulist", aNode);
+    FILE   *const f = fopen(path, "r");
+    if (f == NULL) {
+        return 0;
+    }
+    /* A list of ranges such as 0-3,8-11. */
+    CPU_ZERO(cpus);
+    unsigned first;
+    unsigned last;
+    int     n;
+    while ((n = fscanf(f, "%u-%u", &first, &last)) >= 1) {
+        for (unsigned cpu = first; cpu <= ((n == 2) ? last : first); ++cpu) {
+            CPU_SET(cpu, cpus);
+        }
+        if (fgetc(f) != ',') {
+            break;
+        }
+    }
+    fclose(f);
+    return CPU_COUNT(cpus) > 0;
+#else
+    return 0;
+#endif
+}
+
+/******************************************************************************/
+/*!
+ * Send messages one at a time, each after the previous one was
+ * acknowledged, timing the round trips.
+ * @param   aSide       [inout] Benchmark side.
+ * @return  NULL.
+ */
+void   *bench_numa_producer(void *aSide) {
+    struct bench_numa *const n = aSide;
+    struct bench_numa_msg bm;
+    struct pq_msg m = {.msg = &bm,.size = sizeof bm };
+    char    ack;
+    struct pq_msg a = {.msg = &ack,.size = sizeof ack };
+    memset(bm.payload, 1, sizeof bm.payload);
+    for (uint32_t i = 0; i < n->count; ++i) {
+        bm.sent = bench_now();
+        bench_check("send", pq_send_timed(n->data, &m, PQ_TIMEOUT_INF));
+        bench_check("recv", pq_recv_timed(n->ack, &a, PQ_TIMEOUT_INF));
+        const double t = bench_now() - bm.sent;
+        n->round_trip += t;
+        n->round_trip_max = (t > n->round_trip_max) ? t : n->round_trip_max;
+    }
+    return NULL;
+}
+
+/******************************************************************************/
+/*!
+ * Receive messages, reading their data, and acknowledge each.
+ * @param   aSide       [inout] Benchmark side.
+ * @return  NULL.
+ */
+void   *bench_numa_consumer(void *aSide) {
+    struct bench_numa *const n = aSide;
+    struct bench_numa_msg bm;
+    struct pq_msg m = {.msg = &bm,.size = sizeof bm };
+    char    ack = 0;
+    const struct pq_msg a = {.msg = &ack,.size = sizeof ack };
+    for (uint32_t i = 0; i < n->count; ++i) {
+        bench_check("recv", pq_recv_timed(n->data, &m, PQ_TIMEOUT_INF));
+        ack = (char) (ack + bm.payload[i % sizeof bm.payload]);
+        bench_check("send", pq_send_timed(n->ack, &a, PQ_TIMEOUT_INF));
+    }
+    return NULL;
+}
+
+/******************************************************************************/
+/*!
+ * Measure round trips of large messages between a producer on the first
+ * NUMA node and a consumer on the last, for each placement of the data
+ * queue. The queue is created on the producer's node.
+ * @param   aProducers  Unused.
+ * @param   aConsumers  Unused.
+ * @param   aMessages   Number of messages, divided by 10 as each waits
+ *                      for the previous one.
+ */
+void bench_numa(unsigned aProducers, unsigned aConsumers, uint32_t aMessages) {
+#if defined(__linux__)
+    static const char *const names[] = { "none", "producer", "consumer", "interleave" };
+    static void *(*const tasks[])(void *) = { bench_numa_producer, bench_numa_consumer };
+    struct pq_attr attr = {.maxmsg = B_MAXMSG,.msgsize = sizeof(struct bench_numa_msg),.order = PQ_ATTR_FIFO };
+    const struct pq_attr ack_attr = {.maxmsg = 1,.msgsize = 1,.order = PQ_ATTR_FIFO };
+    cpu_set_t cpus;
+    cpu_set_t side[2];
+    unsigned node[2] = { 0, 0 };
+    unsigned nodes = 0;
+    for (unsigned i = 0; i < B_NUMA_NODES; ++i) {
+        if (bench_node_cpus(i, &side[nodes ? 1 : 0])) {
+            node[nodes ? 1 : 0] = i;
+            ++nodes;
+        }
+    }
+    if (nodes == 0) {
+        printf("numa: skipped, no NUMA nodes found\n\n");
+        return;
+    }
+    if (nodes == 1) {
+        side[1] = side[0];
+        node[1] = node[0];
+    }
+
+    printf("numa: %u nodes, producer on node %u, consumer on node %u, %u %zu-byte round trips\n", nodes, node[0],
+           node[1], aMessages / 10, sizeof(struct bench_numa_msg));
+    printf("%-24s %12s %12s\n", "placement", "mean us", "max us");
+    bench_check("sched_getaffinity", (sched_getaffinity(0, sizeof cpus, &cpus) == 0) ? 0 : errno);
+    for (uint16_t numa = PQ_NUMA_NONE; numa <= PQ_NUMA_INTERLEAVE; ++numa) {
+        struct bench_numa n = {.count = aMessages / 10 };
+        pthread_t tid[2];
+        attr.numa = numa;
+        bench_check("sched_setaffinity", (sched_setaffinity(0, sizeof side[0], &side[0]) == 0) ? 0 : errno);
+        bench_check("pq_create", pq_create(&n.data, &attr));
+        bench_check("pq_create", pq_create(&n.ack, &ack_attr));
+        for (unsigned i = 0; i < 2; ++i) {
+            pthread_attr_t pa;
+            bench_check("pthread_attr_init", pthread_attr_init(&pa));
+            bench_check("pthread_attr_setaffinity_np", pthread_attr_setaffinity_np(&pa, sizeof side[i], &side[i]));
+            bench_check("pthread_create", pthread_create(&tid[i], &pa, tasks[i], &n));
+            pthread_attr_destroy(&pa);
+        }
+        for (unsigned i = 0; i < 2; ++i) {
+            bench_check("pthread_join", pthread_join(tid[i], NULL));
+        }
+        bench_check("pq_destroy", pq_destroy(n.ack));
+        bench_check("pq_destroy", pq_destroy(n.data));
+        printf("%-24s %12.1f %12.1f\n", names[numa], (n.count > 0) ? n.round_trip * 1e6 / n.count : 0.0,
+               n.round_trip_max * 1e6);
+    }
+    bench_check("sched_setaffinity", (sched_setaffinity(0, sizeof cpus, &cpus) == 0) ? 0 : errno);
+    printf("\n");
+#else
+    printf("numa: skipped, Linux only\n\n");
+#endif
+}
+
+/******************************************************************************/
+
+int main(int argc, char **argv) {
+    unsigned producers = B_PRODUCERS;
+    unsigned consumers = B_CONSUMERS;
+    uint32_t messages = B_MESSAGES;
+    if (argc > 3) {
+        producers = (unsigned) strtoul(argv[2], NULL, 0);
+        consumers = (unsigned) strtoul(argv[3], NULL, 0);
+    }
+    if (argc > 4) {
+        messages = (uint32_t) strtoul(argv[4], NULL, 0);
+    }
+    if ((producers == 0) || (consumers == 0) || (messages % producers != 0) || (messages % consumers != 0)) {
+        fprintf(stderr, "usage: %s [benchmark [producers consumers [messages]]]\n"
+                "messages must be a multiple of producers and consumers\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    int found = 0;
+    for (size_t i = 0; i < (sizeof gBenchmarks / sizeof *gBenchmarks); ++i) {
+        if ((argc < 2) || (strcmp(argv[1], gBenchmarks[i].name) == 0)) {
+            gBenchmarks[i].run(producers, consumers, messages);
+            found = 1;
+        }
+    }
+    if (!found) {
+        fprintf(stderr, "%s: unknown benchmark %s\n", argv[0], argv[1]);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/* vim: set syntax=c tabstop=4 shiftwidth=4 expandtab fileformat=unix: */
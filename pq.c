@@ -2,14 +2,44 @@
  * Pthread queues -- priority queues and then some.
  */
 
+/* Robust process-shared mutexes need POSIX.1-2008. */
+#if !defined(_XOPEN_SOURCE) || (_XOPEN_SOURCE < 700)
+#undef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 700
+#endif
+
+/* Adaptive mutexes are a GNU extension. */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <limits.h>
 #include <string.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <linux/mempolicy.h>
+#endif
 
 #include "pq.h"
 
+/* Mutex type of PQ_MUTEX_ADAPTIVE. */
+#if defined(__GLIBC__)
+#define PQ_ADAPTIVE_TYPE PTHREAD_MUTEX_ADAPTIVE_NP
+#else
+#define PQ_ADAPTIVE_TYPE PTHREAD_MUTEX_NORMAL
+#endif
+
 /******************************************************************************/
 /*!
  * Allocate a queue.
@@ -18,24 +48,111 @@
  * @return  0           Success; *aQueue was assigned a handle.
  * @return  EINVAL      Invalid argument.
  * @return  ENOMEM      Out of memory.
- * @return  Otherwise status code of failed pthread call.
+ * @return  ENAMETOOLONG Shared memory object name is too long.
+ * @return  EBUSY       Persistent queue file is in use by another process.
+ * @return  Otherwise status code of failed pthread or system call.
+ *
+ * If aAttributes->name is not NULL, the queue is created in a new POSIX
+ * shared memory object of that name, with a robust process-shared mutex
+ * and process-shared condition variables. Other processes attach to it
+ * with pq_open().
+ *
+ * If aAttributes->path is not NULL, the queue is persistent and kept in a
+ * memory-mapped file. Messages left in an existing file are recovered.
+ * See pq_journal_recover().
  */
 pq_status_t pq_create(struct pq_queue **aQueue, const struct pq_attr *aAttributes) {
     if ((aQueue == NULL) || (aAttributes == NULL)) {
         return EINVAL;
     }
+    if (((aAttributes->name != NULL) && (aAttributes->path != NULL)) || (aAttributes->sync > PQ_SYNC_TIME)) {
+        return EINVAL;
+    }
+    if (pq_full_policy_invalid(aAttributes)) {
+        return EINVAL;
+    }
+    /* Conflation replaces in place, keeping first-arrival FIFO order. */
+    if (aAttributes->conflate && ((aAttributes->order != PQ_ATTR_FIFO) || (aAttributes->path != NULL))) {
+        return EINVAL;
+    }
+    /* Handles track data blocks through the moves of the heap. */
+    if (aAttributes->handles && ((aAttributes->order != PQ_ATTR_PRIOQ) || (aAttributes->path != NULL))) {
+        return EINVAL;
+    }
+    /* Aging keys are CLOCK_MONOTONIC times too. */
+    if (aAttributes->aging && (((aAttributes->order != PQ_ATTR_PRIOQ) && (aAttributes->order != PQ_ATTR_PRIFO))
+                               || (aAttributes->path != NULL))) {
+        return EINVAL;
+    }
+    /* They add up to maxprio aging intervals to the clock, see
+     * pq_aged_due(), which must leave half the range of uint64_t to it. */
+    if ((((uint64_t) aAttributes->aging * 1000000000u) / PQ_TIMEOUT_RESOLUTION)
+        > ((UINT64_MAX / 2u) / ((uint64_t) aAttributes->maxprio + 1u))) {
+        return EINVAL;
+    }
+    /* Due times are CLOCK_MONOTONIC, which does not survive a reboot. */
+    if ((aAttributes->order > PQ_ATTR_WFQ) || ((aAttributes->order == PQ_ATTR_DELAY) && (aAttributes->path != NULL))) {
+        return EINVAL;
+    }
+    if ((aAttributes->order == PQ_ATTR_WFQ) && pq_wfq_invalid(aAttributes)) {
+        return EINVAL;
+    }
+    /* A rendezvous queue only hands messages over, see pq_handoff(). */
+    if ((aAttributes->maxmsg == 0) && (!pq_handoff_possible(aAttributes) || (aAttributes->full != PQ_FULL_REJECT)
+                                       || aAttributes->conflate || aAttributes->combine)) {
+        return EINVAL;
+    }
+    /* Requests point to messages in the sending or receiving process. */
+    if (aAttributes->combine && (((aAttributes->order != PQ_ATTR_PRIOQ) && (aAttributes->order != PQ_ATTR_PRIFO))
+                                 || (aAttributes->name != NULL) || (aAttributes->path != NULL))) {
+        return EINVAL;
+    }
+    if ((aAttributes->mutex > PQ_MUTEX_ADAPTIVE) || (aAttributes->protocol > PQ_PROTO_PROTECT)) {
+        return EINVAL;
+    }
+    /* Page cache pages of a file ignore memory policies. */
+    if ((aAttributes->numa > PQ_NUMA_INTERLEAVE) || (aAttributes->numa && (aAttributes->path != NULL))) {
+        return EINVAL;
+    }
+#ifndef __linux__
+    if (aAttributes->numa) {
+        return ENOTSUP;
+    }
+#endif
+    for (unsigned b = 0; b < PQ_BANDS; ++b) {
+        if ((aAttributes->bands[b].percent > 100) || (aAttributes->bands[b].prio > aAttributes->maxprio)) {
+            return EINVAL;
+        }
+    }
 
-    struct pq_queue *const q = malloc(sizeof *q);
-    if (q == NULL) {
-        return ENOMEM;
+    struct pq_queue *q = NULL;
+    pq_status_t sc = pq_alloc(&q, aAttributes);
+    if (sc != 0) {
+        return sc;
     }
+    const int shared = (q->memory == PQ_MEM_SHM);
 
-    pq_status_t sc = pthread_mutexattr_init(&q->attr);
+    sc = pthread_mutexattr_init(&q->attr);
     if (sc != 0) {
         return pq_cleanup(q, 1, sc);
     }
 
-    sc = pthread_mutexattr_settype(&q->attr, PTHREAD_MUTEX_RECURSIVE);
+    sc = pthread_mutexattr_settype(&q->attr, (aAttributes->mutex == PQ_MUTEX_RECURSIVE) ? PTHREAD_MUTEX_RECURSIVE
+                                   : (aAttributes->mutex == PQ_MUTEX_NORMAL) ? PTHREAD_MUTEX_NORMAL
+                                   : PQ_ADAPTIVE_TYPE);
+    if ((sc == 0) && (aAttributes->protocol != PQ_PROTO_NONE)) {
+        sc = pthread_mutexattr_setprotocol(&q->attr, (aAttributes->protocol == PQ_PROTO_INHERIT)
+                                           ? PTHREAD_PRIO_INHERIT : PTHREAD_PRIO_PROTECT);
+    }
+    if ((sc == 0) && (aAttributes->protocol == PQ_PROTO_PROTECT)) {
+        sc = pthread_mutexattr_setprioceiling(&q->attr, aAttributes->ceiling);
+    }
+    if ((sc == 0) && shared) {
+        sc = pthread_mutexattr_setpshared(&q->attr, PTHREAD_PROCESS_SHARED);
+    }
+    if ((sc == 0) && shared) {
+        sc = pthread_mutexattr_setrobust(&q->attr, PTHREAD_MUTEX_ROBUST);
+    }
     if (sc != 0) {
         return pq_cleanup(q, 2, sc);
     }
@@ -45,12 +162,12 @@ pq_status_t pq_create(struct pq_queue **aQueue, const struct pq_attr *aAttribute
         return pq_cleanup(q, 2, sc);
     }
 
-    sc = pthread_cond_init(&q->ready_to_send, NULL);
+    sc = pq_cond_init(&q->ready_to_send, shared);
     if (sc != 0) {
         return pq_cleanup(q, 3, sc);
     }
 
-    sc = pthread_cond_init(&q->ready_to_recv, NULL);
+    sc = pq_cond_init(&q->ready_to_recv, shared);
     if (sc != 0) {
         return pq_cleanup(q, 4, sc);
     }
@@ -60,493 +177,4316 @@ pq_status_t pq_create(struct pq_queue **aQueue, const struct pq_attr *aAttribute
     q->tail = 0;
     q->waiting_to_send = 0;
     q->waiting_to_recv = 0;
+    q->set = NULL;
+    q->set_index = 0;
+    q->eventfd[PQ_EVENT_RECV] = -1;
+    q->eventfd[PQ_EVENT_SEND] = -1;
     q->maxmsg = aAttributes->maxmsg;
     q->msgsize = aAttributes->msgsize;
     q->order = aAttributes->order;
     q->maxprio = aAttributes->maxprio;
-    q->message = calloc(q->maxmsg, sizeof *q->message);
-    if (q->message == NULL) {
-        return pq_cleanup(q, 5, ENOMEM);
-    }
+    q->full = aAttributes->full;
+    q->ttl = aAttributes->ttl;
+    q->meta = (aAttributes->order == PQ_ATTR_DELAY) || aAttributes->ttl || aAttributes->conflate || aAttributes->handles;
+    q->top = 0;
+    q->publish_top = 0;
+    pq_bands_init(q, aAttributes);
+#ifdef PQ_PROFILE
+    memset(&q->profile, 0, sizeof q->profile);
+    q->profile.order = q->order;
+    q->prof_op = PQ_OP_OTHER;
+    q->prof_t0 = 0;
+#endif
+    q->seq = 1;
+    q->sync = aAttributes->sync;
+    q->sync_every = aAttributes->sync_every;
+    q->unsynced = 0;
+    q->synced_ns = pq_now_ns();
+    const size_t stride = pq_stride(aAttributes);
+    const size_t header = (q->memory == PQ_MEM_FILE) ? sizeof(struct pq_record) : 0;
     for (msgindex_t i = 0; i < q->maxmsg; ++i) {
-        q->message[i].msg = malloc(q->msgsize);
-        if (q->message[i].msg == NULL) {
-            return pq_cleanup(q, 6, ENOMEM);
+        q->message[i].offset = (msgoffset_t) ((i * stride) + header);
+        q->message[i].size = 0;
+        q->message[i].prio = 0;
+        q->message[i].due = 0;
+        q->message[i].expires = 0;
+    }
+    memset(&q->stats, 0, sizeof q->stats);
+    q->purge = 0;
+    q->index_offset = (uint32_t) pq_index_offset(aAttributes);
+    q->index_mask = 0;
+    q->handles = aAttributes->handles;
+    /* No overflow: aging has 32 bits. */
+    q->aging_ns = ((uint64_t) aAttributes->aging * 1000000000u) / PQ_TIMEOUT_RESOLUTION;
+    q->wait_offset = (uint32_t) pq_wait_offset(aAttributes);
+    if (aAttributes->aging) {
+        memset(pq_waits(q), 0, ((size_t) q->maxprio + 1) * sizeof(struct pq_wait));
+    }
+    q->class_offset = (uint32_t) pq_class_offset(aAttributes);
+    q->wfq_bytes = aAttributes->wfq_bytes;
+    q->free = 0;
+    q->active_head = PQ_INDEX_NIL;
+    q->active_tail = PQ_INDEX_NIL;
+    if (q->order == PQ_ATTR_WFQ) {
+        for (msgindex_t i = 0; i < q->maxmsg; ++i) {
+            pq_index(q)[i] = (i + 1u < q->maxmsg) ? (msgindex_t) (i + 1u) : PQ_INDEX_NIL;
+        }
+        for (size_t p = 0; p <= q->maxprio; ++p) {
+            struct pq_class *const cls = &pq_classes(q)[p];
+            const uint32_t weight = (aAttributes->weights != NULL) ? aAttributes->weights[p] : (uint32_t) (p + 1);
+            cls->head = PQ_INDEX_NIL;
+            cls->tail = PQ_INDEX_NIL;
+            cls->next = PQ_INDEX_NIL;
+            cls->quantum = q->wfq_bytes ? (weight * q->msgsize) : weight;
+            cls->deficit = 0;
+        }
+    }
+    q->wait_lists = !shared;
+    q->waiter_head[PQ_OP_SEND] = NULL;
+    q->waiter_tail[PQ_OP_SEND] = NULL;
+    q->waiter_head[PQ_OP_RECV] = NULL;
+    q->waiter_tail[PQ_OP_RECV] = NULL;
+    q->handoff = (uint16_t) pq_handoff_possible(aAttributes);
+    q->combine = aAttributes->combine;
+    q->request_offset = (uint32_t) pq_request_offset(aAttributes);
+    for (uint16_t i = 0; i < q->combine; ++i) {
+        pq_requests(q)[i].state = PQ_REQ_FREE;
+    }
+    q->numa_side = (aAttributes->numa == PQ_NUMA_PRODUCER) ? (PQ_OP_SEND + 1)
+        : (aAttributes->numa == PQ_NUMA_CONSUMER) ? (PQ_OP_RECV + 1) : 0;
+    if (q->handles) {
+        /* Slot i starts out with data block i, generation 0. */
+        for (msgindex_t i = 0; i < q->maxmsg; ++i) {
+            q->message[i].key = i;
+            pq_index(q)[i] = i;
+        }
+    }
+    if (aAttributes->conflate) {
+        const size_t cap = pq_index_capacity(aAttributes);
+        q->index_mask = (uint32_t) (cap - 1);
+        for (size_t i = 0; i < cap; ++i) {
+            pq_index(q)[i] = PQ_INDEX_NIL;
         }
     }
+    if (q->memory == PQ_MEM_FILE) {
+        sc = pq_journal_recover(q);
+        if (sc != 0) {
+            return pq_cleanup(q, 6, sc);
+        }
+    }
+    if (aAttributes->numa == PQ_NUMA_INTERLEAVE) {
+        sc = pq_numa_interleave(q);
+        if (sc != 0) {
+            return pq_cleanup(q, 6, sc);
+        }
+    }
+    /* Openers in other processes may use the queue from now on. */
+    __atomic_store_n(&q->magic, PQ_MAGIC, __ATOMIC_RELEASE);
     *aQueue = q;
     return 0;
 }
 
 /******************************************************************************/
 /*!
- * Destroy a queue, deallocating all resources.
- * @param   aQueue    [in] Queue handle.
- * @return  0         Success.
- * @return  EINVAL    Invalid argument.
+ * Attach to a queue created in POSIX shared memory by another process.
+ * @param   aQueue      [out] Pointer to queue handle.
+ * @param   aName       [in] Name of shared memory object.
+ * @return  0           Success; *aQueue was assigned a handle.
+ * @return  EINVAL      Invalid argument, or object is not a queue.
+ * @return  Otherwise error of failed system call.
+ *
+ * Detach with pq_close(). Queue sets and event file descriptors are
+ * process-local and not available for shared queues.
  */
-pq_status_t pq_destroy(struct pq_queue *aQueue) {
-    if (aQueue == NULL) {
+pq_status_t pq_open(struct pq_queue **aQueue, const char *aName) {
+    if ((aQueue == NULL) || (aName == NULL)) {
         return EINVAL;
     }
-    return pq_cleanup(aQueue, ~0, 0);
-}
-
-/******************************************************************************/
-/*!
- * Try to send a message to a queue. Does not block.
- * @param   aQueue       [in] Queue handle.
- * @param   aMessage     [in] Message to send.
- * @return  0            Success.
- * @return  EAGAIN       Queue is full.
- * @return  EINVAL       Invalid argument.
- * @return  EMSGSIZE     Message too big for queue.
- */
-pq_status_t pq_send_nonbl(struct pq_queue *aQueue, const struct pq_msg *aMessage) {
-    if ((aQueue == NULL) || (aMessage == NULL)) {
-        return EINVAL;
+    const int fd = shm_open(aName, O_RDWR, 0);
+    if (fd < 0) {
+        return errno;
     }
-    if ((aMessage->prio > aQueue->maxprio) || (aMessage->msg == NULL)) {
-        return EINVAL;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        const pq_status_t sc = errno;
+        close(fd);
+        return sc;
     }
-    if (aMessage->size > aQueue->msgsize) {
-        return EMSGSIZE;
+    if ((size_t) st.st_size < sizeof(struct pq_queue)) {
+        close(fd);
+        return EINVAL;
     }
-
-    pq_status_t sc = pthread_mutex_lock(&aQueue->mtx);
-    pq_unlock_and_return_if_unsuccessful(sc);
-    if (aQueue->fill == aQueue->maxmsg) {
-        sc = pthread_mutex_unlock(&aQueue->mtx);
-        return (sc != 0) ? sc : EAGAIN;
+    void   *const mem = mmap(NULL, (size_t) st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    const pq_status_t sc = errno;
+    close(fd);
+    if (mem == MAP_FAILED) {
+        return sc;
     }
-    pq_insert(aQueue, aMessage);
-    if (aQueue->waiting_to_recv > 0) {
-        sc = pthread_cond_signal(&aQueue->ready_to_recv);
-        pq_unlock_and_return_if_unsuccessful(sc);
+    struct pq_queue *const q = mem;
+    if ((__atomic_load_n(&q->magic, __ATOMIC_ACQUIRE) != PQ_MAGIC) || (q->mapsize != (size_t) st.st_size)) {
+        munmap(mem, (size_t) st.st_size);
+        return EINVAL;
     }
-    sc = pthread_mutex_unlock(&aQueue->mtx);
-    return sc;
+    *aQueue = q;
+    return 0;
 }
 
 /******************************************************************************/
 /*!
- * Try to receive a message from a queue. Does not block.
+ * Detach from a queue in shared memory without destroying it.
  * @param   aQueue    [in] Queue handle.
- * @param   aMessage  [out] Message retrieved from queue's head.
- * @return  0 on success.
- * @return  EAGAIN       Queue is empty.
- * @return  EINVAL       Invalid argument.
- * @return  Error code otherwise.
- *
- * The buffer pointed to by aMessage->msg must be large enough to hold all data,
- * which is at most aQueue->maxmsg bytes.
+ * @return  0         Success.
+ * @return  EINVAL    Invalid argument, or queue is not shared.
+ * @return  Otherwise error of failed munmap().
  */
-pq_status_t pq_recv_nonbl(struct pq_queue *aQueue, struct pq_msg *aMessage) {
-    if ((aQueue == NULL) || (aMessage == NULL) || (aMessage->msg == NULL)) {
+pq_status_t pq_close(struct pq_queue *aQueue) {
+    if ((aQueue == NULL) || (aQueue->memory != PQ_MEM_SHM)) {
         return EINVAL;
     }
+    return (munmap(aQueue, aQueue->mapsize) == 0) ? 0 : errno;
+}
 
-    pq_status_t sc = pthread_mutex_lock(&aQueue->mtx);
-    pq_unlock_and_return_if_unsuccessful(sc);
-    if (aQueue->fill == 0) {
-        sc = pthread_mutex_unlock(&aQueue->mtx);
-        return (sc != 0) ? sc : EAGAIN;
+/******************************************************************************/
+/*!
+ * Allocate memory for a queue descriptor, its slots and message data.
+ * @param   aQueue      [out] Queue descriptor.
+ * @param   aAttributes [in] Queue attributes.
+ * @return  0           Success.
+ * @return  ENOMEM      Out of memory.
+ * @return  ENAMETOOLONG Shared memory object name is too long.
+ * @return  Otherwise error of failed system call.
+ *
+ * Everything lives in one block without pointers into it, so the same
+ * layout works in shared memory mapped at different addresses, and in a
+ * file mapped again after a restart.
+ */
+pq_status_t pq_alloc(struct pq_queue **aQueue, const struct pq_attr *aAttributes) {
+    const size_t size = pq_request_offset(aAttributes) + (aAttributes->combine * sizeof(struct pq_request));
+    struct pq_queue *q;
+    if (aAttributes->path != NULL) {
+        return pq_alloc_file(aQueue, aAttributes, size);
     }
-    pq_remove(aQueue, aMessage);
-    if (aQueue->waiting_to_send > 0) {
-        sc = pthread_cond_signal(&aQueue->ready_to_send);
-        pq_unlock_and_return_if_unsuccessful(sc);
+    if (aAttributes->name == NULL) {
+        /* Aligned for the regions of the descriptor; mappings are. Placed
+         * queues get whole pages of their own, as memory policies apply
+         * to pages. */
+        const size_t align = aAttributes->numa ? (size_t) sysconf(_SC_PAGESIZE) : PQ_CACHELINE;
+        void   *mem;
+        if (posix_memalign(&mem, align, (size + align - 1) / align * align) != 0) {
+            return ENOMEM;
+        }
+        q = mem;
+        q->memory = PQ_MEM_HEAP;
+        q->name[0] = '\0';
     }
-    sc = pthread_mutex_unlock(&aQueue->mtx);
-    return sc;
+    else {
+        if (strlen(aAttributes->name) >= sizeof q->name) {
+            return ENAMETOOLONG;
+        }
+        const int fd = shm_open(aAttributes->name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0) {
+            return errno;
+        }
+        void   *mem = MAP_FAILED;
+        if (ftruncate(fd, (off_t) size) == 0) {
+            mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        const pq_status_t sc = errno;
+        close(fd);
+        if (mem == MAP_FAILED) {
+            shm_unlink(aAttributes->name);
+            return sc;
+        }
+        q = mem;
+        q->memory = PQ_MEM_SHM;
+        strcpy(q->name, aAttributes->name);
+    }
+    q->magic = 0;
+    q->mapsize = size;
+    q->fd = -1;
+    *aQueue = q;
+    return 0;
 }
 
 /******************************************************************************/
 /*!
- * Send message, with timeout.
- * @param   aQueue      [in] Queue handle.
- * @param   aMessage    [in] Message to send.
- * @param   aTimeout    How long to wait on a full queue until timeout.
+ * Map the file of a persistent queue, creating it if needed.
+ * @param   aQueue      [out] Queue descriptor.
+ * @param   aAttributes [in] Queue attributes.
+ * @param   aSize       Size of queue in bytes.
  * @return  0           Success.
- * @return  EINVAL      Invalid argument.
- * @return  EAGAIN      Queue is full and PQ_TIMEOUT_ZERO was specified.
- * @return  ETIMEDOUT   Queue is full after timeout expired.
- * @return  Error code otherwise.
+ * @return  EBUSY       File is locked by another process.
+ * @return  EINVAL      File holds a queue with different attributes, or
+ *                      of another layout version.
+ * @return  Otherwise error of failed system call.
+ *
+ * The file stays open and write-locked while the queue exists, so two
+ * processes can't use it at the same time. A file with a zero magic was
+ * being set up or recovered when its process died, and is recovered.
  */
-pq_status_t pq_send_timed(struct pq_queue *aQueue, const struct pq_msg *aMessage, pq_time_t aTimeout) {
-    if (aTimeout == PQ_TIMEOUT_ZERO) {
-        return pq_send_nonbl(aQueue, aMessage);
+pq_status_t pq_alloc_file(struct pq_queue **aQueue, const struct pq_attr *aAttributes, size_t aSize) {
+    const int fd = open(aAttributes->path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        return errno;
     }
-    if ((aQueue == NULL) || (aMessage == NULL)) {
-        return EINVAL;
+    struct flock lock;
+    memset(&lock, 0, sizeof lock);
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    if (fcntl(fd, F_SETLK, &lock) != 0) {
+        const pq_status_t sc = ((errno == EACCES) || (errno == EAGAIN)) ? EBUSY : errno;
+        close(fd);
+        return sc;
     }
-    if ((aMessage->prio > aQueue->maxprio) || (aMessage->msg == NULL)) {
+    struct stat st;
+    pq_status_t sc = 0;
+    if (fstat(fd, &st) != 0) {
+        sc = errno;
+    }
+    else if ((st.st_size != 0) && ((size_t) st.st_size != aSize)) {
+        sc = EINVAL;
+    }
+    else if ((st.st_size == 0) && (ftruncate(fd, (off_t) aSize) != 0)) {
+        sc = errno;
+    }
+    void   *mem = MAP_FAILED;
+    if (sc == 0) {
+        mem = mmap(NULL, aSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mem == MAP_FAILED) {
+            sc = errno;
+        }
+    }
+    if (sc != 0) {
+        close(fd);
+        return sc;
+    }
+    struct pq_queue *const q = mem;
+    if (((q->magic != PQ_MAGIC) && (q->magic != 0)) ||
+        ((q->magic == PQ_MAGIC) &&
+         ((q->maxmsg != aAttributes->maxmsg) || (q->msgsize != aAttributes->msgsize) ||
+          (q->order != aAttributes->order) || (q->maxprio != aAttributes->maxprio)))) {
+        munmap(mem, aSize);
+        close(fd);
         return EINVAL;
     }
+    q->magic = 0;
+    q->memory = PQ_MEM_FILE;
+    q->mapsize = aSize;
+    q->fd = fd;
+    q->name[0] = '\0';
+    *aQueue = q;
+    return 0;
+}
 
-    pq_status_t sc = pthread_mutex_lock(&aQueue->mtx);
-    pq_unlock_and_return_if_unsuccessful(sc);
+/******************************************************************************/
+/*!
+ * Get the offset of a conflating queue's key index from the queue's start.
+ * @param   aAttributes [in] Queue attributes.
+ * @return  Offset in bytes, after slots and data, aligned.
+ */
+size_t pq_index_offset(const struct pq_attr *aAttributes) {
+    const size_t end = sizeof(struct pq_queue)
+        + ((size_t) aAttributes->maxmsg * (sizeof(struct pq_slot) + pq_stride(aAttributes)));
+    const size_t align = sizeof(uint64_t);
+    return (end + align - 1) / align * align;
+}
 
-    while (aQueue->fill == aQueue->maxmsg) {
-        ++aQueue->waiting_to_send;
-        if (aTimeout == PQ_TIMEOUT_INF) {
-            sc = pthread_cond_wait(&aQueue->ready_to_send, &aQueue->mtx);
-        }
-        else {
-            sc = pq_cond_timedwait(&aQueue->ready_to_send, &aQueue->mtx, aTimeout);
-        }
-        --aQueue->waiting_to_send;
-        pq_unlock_and_return_if_unsuccessful(sc);
+/******************************************************************************/
+/*!
+ * Get distance between message data blocks of a queue.
+ * @param   aAttributes [in] Queue attributes.
+ * @return  Stride in bytes.
+ *
+ * Blocks of persistent queues start with a record header, aligned for it.
+ */
+size_t pq_stride(const struct pq_attr *aAttributes) {
+    if (aAttributes->path == NULL) {
+        return aAttributes->msgsize;
     }
+    const size_t align = sizeof(uint64_t);
+    return (sizeof(struct pq_record) + aAttributes->msgsize + align - 1) / align * align;
+}
 
-    pq_insert(aQueue, aMessage);
+/******************************************************************************/
+/*!
+ * Get the record header of a message data block in a persistent queue.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aOffset     Offset of data, as in pq_slot.offset.
+ * @return  Record header.
+ */
+struct pq_record *pq_record(const struct pq_queue *aQueue, msgoffset_t aOffset) {
+    const uint8_t *const data = (const uint8_t *) &aQueue->message[aQueue->maxmsg];
+    return (struct pq_record *) (data + aOffset - sizeof(struct pq_record));
+}
 
-    if (aQueue->waiting_to_recv > 0) {
-        sc = pthread_cond_signal(&aQueue->ready_to_recv);
-        pq_unlock_and_return_if_unsuccessful(sc);
+/******************************************************************************/
+/*!
+ * Compute the checksum of a journal record and its data (FNV-1a).
+ * @param   aRecord     [in] Record header; data follow it.
+ * @return  Checksum.
+ */
+uint32_t pq_checksum(const struct pq_record *aRecord) {
+    const uint64_t seq = __atomic_load_n(&aRecord->seq, __ATOMIC_RELAXED);
+    const uint8_t *const data = (const uint8_t *) (aRecord + 1);
+    uint32_t h = 2166136261u;
+    for (unsigned i = 0; i < 64; i += 8) {
+        h = (h ^ (uint8_t) (seq >> i)) * 16777619u;
+    }
+    h = (h ^ (uint8_t) aRecord->size) * 16777619u;
+    h = (h ^ (uint8_t) (aRecord->size >> 8)) * 16777619u;
+    h = (h ^ (uint8_t) aRecord->prio) * 16777619u;
+    h = (h ^ (uint8_t) (aRecord->prio >> 8)) * 16777619u;
+    for (msgsize_t i = 0; i < aRecord->size; ++i) {
+        h = (h ^ data[i]) * 16777619u;
     }
+    return h;
+}
 
-    sc = pthread_mutex_unlock(&aQueue->mtx);
-    return sc;
+/******************************************************************************/
+/*!
+ * Journal a message just inserted into a persistent queue.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aOffset     Offset of the message's data.
+ * @param   aMessage    [in] Message.
+ * @note    Assumes mutex held by caller.
+ *
+ * The sequence number is stored last; a record torn by a crash fails
+ * its checksum and is dropped by pq_journal_recover().
+ */
+void pq_journal_write(struct pq_queue *aQueue, msgoffset_t aOffset, const struct pq_msg *aMessage) {
+    struct pq_record *const r = pq_record(aQueue, aOffset);
+    const uint64_t seq = aQueue->seq++;
+    __atomic_store_n(&r->seq, seq, __ATOMIC_RELAXED);
+    r->size = aMessage->size;
+    r->prio = aMessage->prio;
+    r->check = pq_checksum(r);
+    ++aQueue->unsynced;
 }
 
 /******************************************************************************/
 /*!
- * Version of pthread_cond_wait() that computes deadline and waits.
- * @param   aCond       [in] Condition variable.
- * @param   aMutex      [in] Associated mutex.
- * @param   aTimeout    How long to wait.
- * @return  0           Success.
- * @return  ETIMEDOUT   Operation timed out.
- * @return  Error code otherwise.
+ * Journal a message just removed from a persistent queue.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aOffset     Offset of the message's data.
+ * @note    Assumes mutex held by caller.
  */
-pq_status_t pq_cond_timedwait(pthread_cond_t *aCond, pthread_mutex_t *aMutex, pq_time_t aTimeout) {
-    struct timespec ts;
-    pq_status_t sc = clock_gettime(CLOCK_REALTIME, &ts);
-    if (sc == 0) {
-        pq_add_time(&ts, aTimeout);
-        sc = pthread_cond_timedwait(aCond, aMutex, &ts);
+void pq_journal_clear(struct pq_queue *aQueue, msgoffset_t aOffset) {
+    struct pq_record *const r = pq_record(aQueue, aOffset);
+    __atomic_store_n(&r->seq, 0, __ATOMIC_RELAXED);
+    ++aQueue->unsynced;
+}
+
+/******************************************************************************/
+/*!
+ * Order recovered messages by sequence number.
+ */
+int pq_recovered_by_seq(const void *aLeft, const void *aRight) {
+    const struct pq_recovered *const l = aLeft;
+    const struct pq_recovered *const r = aRight;
+    return (l->seq > r->seq) - (l->seq < r->seq);
+}
+
+/******************************************************************************/
+/*!
+ * Order recovered messages by descending priority, then sequence number.
+ */
+int pq_recovered_by_prio(const void *aLeft, const void *aRight) {
+    const struct pq_recovered *const l = aLeft;
+    const struct pq_recovered *const r = aRight;
+    if (l->slot.prio != r->slot.prio) {
+        return (l->slot.prio < r->slot.prio) ? 1 : -1;
     }
-    return sc;
+    return pq_recovered_by_seq(aLeft, aRight);
 }
 
 /******************************************************************************/
 /*!
- * Receive message, with timeout.
- * @param   aQueue      [in] Queue handle.
- * @param   aMessage    [out] Message removed from queue.
- * @param   aTimeout    How long to wait on an empty queue until timeout.
+ * Rebuild a persistent queue from the records in its file.
+ * @param   aQueue      [in] Queue handle with slots freshly initialized.
  * @return  0           Success.
- * @return  EINVAL      Invalid argument.
- * @return  EAGAIN      Queue is empty and PQ_TIMEOUT_ZERO was specified.
- * @return  ETIMEDOUT   Queue is empty after timeout expired.
- * @return  Error code otherwise.
+ * @return  ENOMEM      Out of memory.
+ *
+ * Scans every data block once. Blocks with a valid checksum hold messages,
+ * which are put back in send order: sorted by sequence number and, for
+ * priority orders, by priority first. A sorted array is a valid heap for
+ * PRIOQ and is the reverse of the PRIFO layout; a min-max heap is rebuilt
+ * by inserting the messages in turn. Message data stay where
+ * they are; only slots are rewritten, so a crash during recovery is
+ * harmless. Other blocks become free.
  */
-pq_status_t pq_recv_timed(struct pq_queue *aQueue, struct pq_msg *aMessage, pq_time_t aTimeout) {
-    if (aTimeout == PQ_TIMEOUT_ZERO) {
-        return pq_recv_nonbl(aQueue, aMessage);
-    }
-    if ((aQueue == NULL) || (aMessage == NULL) || (aMessage->msg == NULL)) {
-        return EINVAL;
+pq_status_t pq_journal_recover(struct pq_queue *aQueue) {
+    struct pq_slot *const message = aQueue->message;
+    struct pq_recovered *const found = malloc((aQueue->maxmsg + 1u) * sizeof *found);
+    if (found == NULL) {
+        return ENOMEM;
     }
-
-    pq_status_t sc = pthread_mutex_lock(&aQueue->mtx);
-    pq_unlock_and_return_if_unsuccessful(sc);
-
-    while (aQueue->fill == 0) {
-        ++aQueue->waiting_to_recv;
-        if (aTimeout == PQ_TIMEOUT_INF) {
-            sc = pthread_cond_wait(&aQueue->ready_to_recv, &aQueue->mtx);
+    msgindex_t n = 0;
+    msgindex_t spare = aQueue->maxmsg;
+    for (msgindex_t i = 0; i < aQueue->maxmsg; ++i) {
+        const msgoffset_t offset = message[i].offset;
+        struct pq_record *const r = pq_record(aQueue, offset);
+        if ((r->seq != 0) && (r->size <= aQueue->msgsize) && (r->prio <= aQueue->maxprio) &&
+            (r->check == pq_checksum(r))) {
+            found[n].seq = r->seq;
+            found[n].slot.offset = offset;
+            found[n].slot.size = r->size;
+            found[n].slot.prio = r->prio;
+            found[n].slot.due = 0;
+            found[n].slot.expires = 0;
+            if (r->seq >= aQueue->seq) {
+                aQueue->seq = r->seq + 1;
+            }
+            ++n;
         }
         else {
-            sc = pq_cond_timedwait(&aQueue->ready_to_recv, &aQueue->mtx, aTimeout);
+            r->seq = 0;
+            found[--spare].slot.offset = offset;
         }
-        --aQueue->waiting_to_recv;
-        pq_unlock_and_return_if_unsuccessful(sc);
     }
-
-    pq_remove(aQueue, aMessage);
-
-    if (aQueue->waiting_to_send > 0) {
-        sc = pthread_cond_signal(&aQueue->ready_to_send);
-        pq_unlock_and_return_if_unsuccessful(sc);
+    const int prio = (aQueue->order == PQ_ATTR_PRIFO) || (aQueue->order == PQ_ATTR_PRIOQ);
+    qsort(found, n, sizeof *found, prio ? pq_recovered_by_prio : pq_recovered_by_seq);
+    for (msgindex_t i = 0; i < n; ++i) {
+        message[(aQueue->order == PQ_ATTR_PRIFO) ? (n - 1u - i) : i] = found[i].slot;
     }
-
-    sc = pthread_mutex_unlock(&aQueue->mtx);
-    return sc;
+    for (msgindex_t i = n; i < aQueue->maxmsg; ++i) {
+        message[i].offset = found[i].slot.offset;
+    }
+    free(found);
+    if (pq_minmax(aQueue)) {
+        for (msgindex_t i = 0; i < n; ++i) {
+            pq_set_fill(aQueue, i + 1u);
+            pq_minmax_fix(aQueue, i);
+        }
+    }
+    aQueue->head = 0;
+    aQueue->tail = (n == aQueue->maxmsg) ? 0 : n;
+    pq_set_fill(aQueue, n);
+    return pq_sync(aQueue);
 }
 
 /******************************************************************************/
 /*!
- * Remove message depending on order.
- * @param   aQueue    [in] Queue handle.
- * @param   aMessage  [out] Message with highest priority.
+ * Check whether a persistent queue is due for msync() by its sync policy.
+ * @param   aQueue      [in] Queue handle.
+ * @return  Nonzero if due; the sync is then considered done.
+ * @note    Assumes mutex held by caller.
  */
-void pq_remove(struct pq_queue *aQueue, struct pq_msg *aMessage) {
-    switch (aQueue->order) {
-    case PQ_ATTR_PRIFO:
-        pq_remove_prifo(aQueue, aMessage);
+int pq_sync_due(struct pq_queue *aQueue) {
+    if ((aQueue->memory != PQ_MEM_FILE) || (aQueue->unsynced == 0)) {
+        return 0;
+    }
+    int     due = 0;
+    switch (aQueue->sync) {
+    case PQ_SYNC_EACH:
+        due = 1;
         break;
-    case PQ_ATTR_PRIOQ:
-        pq_remove_prioq(aQueue, aMessage);
-        break;
-    case PQ_ATTR_FIFO:
-        pq_remove_fifo(aQueue, aMessage);
-        break;
-    case PQ_ATTR_LIFO:
-        pq_remove_lifo(aQueue, aMessage);
+    case PQ_SYNC_COUNT:
+        due = (aQueue->unsynced >= aQueue->sync_every);
         break;
+    case PQ_SYNC_TIME:{
+            const uint64_t now = pq_now_ns();
+            due = ((now - aQueue->synced_ns) * PQ_TIMEOUT_RESOLUTION >= aQueue->sync_every * 1000000000ull);
+            if (due) {
+                aQueue->synced_ns = now;
+            }
+            break;
+        }
     default:
         break;
     }
+    if (due) {
+        aQueue->unsynced = 0;
+    }
+    return due;
 }
 
 /******************************************************************************/
 /*!
- * Insert message depending on order.
- * @param   aQueue    [in] Queue handle.
- * @param   aMessage  [in] Message with highest priority.
+ * Write a persistent queue's file back to disk.
+ * @param   aQueue      [in] Queue handle.
+ * @return  0           Success, or queue is not persistent.
+ * @return  EINVAL      Invalid argument.
+ * @return  Otherwise error of failed msync().
+ *
+ * Sends and receives only touch memory; call this to make them durable
+ * independent of the sync policy.
  */
-void pq_insert(struct pq_queue *aQueue, const struct pq_msg *aMessage) {
-    switch (aQueue->order) {
-    case PQ_ATTR_PRIFO:
-        pq_insert_prifo(aQueue, aMessage);
-        break;
-    case PQ_ATTR_PRIOQ:
-        pq_insert_prioq(aQueue, aMessage);
-        break;
-    case PQ_ATTR_FIFO:
-        pq_insert_fifo(aQueue, aMessage);
-        break;
-    case PQ_ATTR_LIFO:
-        pq_insert_lifo(aQueue, aMessage);
-        break;
-    default:
-        break;
+pq_status_t pq_sync(struct pq_queue *aQueue) {
+    if (aQueue == NULL) {
+        return EINVAL;
+    }
+    if (aQueue->memory != PQ_MEM_FILE) {
+        return 0;
     }
+    return (msync(aQueue, aQueue->mapsize, MS_SYNC) == 0) ? 0 : errno;
 }
 
 /******************************************************************************/
 /*!
- * Remove message from message heap.
+ * Get address of a message slot's data.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aIndex      Slot index.
+ * @return  Address of data, valid in the calling process only.
+ */
+void   *pq_data(const struct pq_queue *aQueue, msgindex_t aIndex) {
+    const uint8_t *const data = (const uint8_t *) &aQueue->message[aQueue->maxmsg];
+    return (void *) (data + aQueue->message[aIndex].offset);
+}
+
+/******************************************************************************/
+/*!
+ * Destroy a queue, deallocating all resources.
  * @param   aQueue    [in] Queue handle.
- * @param   aMessage  [out] Message with highest priority.
- * @note    Assumes queue is not empty.
- * @note    Assumes mutex held by caller.
- * @note    Complexity: O(log N).
+ *
+ * A queue in shared memory is also unlinked. All other processes should
+ * have detached from it with pq_close() before.
+ * @return  0         Success.
+ * @return  EINVAL    Invalid argument.
+ * @return  EBUSY     Queue is still a member of a queue set.
  */
-void pq_remove_prioq(struct pq_queue *aQueue, struct pq_msg *const aMessage) {
-    assert(aQueue->fill > 0);
-    struct pq_msg *const message = aQueue->message;
+pq_status_t pq_destroy(struct pq_queue *aQueue) {
+    if (aQueue == NULL) {
+        return EINVAL;
+    }
+    if (aQueue->set != NULL) {
+        return EBUSY;
+    }
+    return pq_cleanup(aQueue, INT_MAX, 0);
+}
 
-    aMessage->size = message[0].size;
-    aMessage->prio = message[0].prio;
-    memcpy(aMessage->msg, message[0].msg, message[0].size);
+/******************************************************************************/
+/*!
+ * Try to send a message to a queue. Does not block.
+ * @param   aQueue       [in] Queue handle.
+ * @param   aMessage     [in] Message to send.
+ * @return  0            Success, or message dropped by the queue's full
+ *                       policy.
+ * @return  EAGAIN       Queue is full.
+ * @return  EINVAL       Invalid argument.
+ * @return  EMSGSIZE     Message too big for queue.
+ *
+ * A queue whose messages carry metadata gets it zeroed; see pq_send_ex().
+ */
+pq_status_t pq_send_nonbl(struct pq_queue *aQueue, const struct pq_msg *aMessage) {
+    if ((aQueue != NULL) && (aMessage != NULL) && aQueue->meta) {
+        const struct pq_msg_ex ex = {.base = *aMessage };
+        return pq_send_try(aQueue, &ex.base);
+    }
+    return pq_send_try(aQueue, aMessage);
+}
 
-    const msgindex_t last = --aQueue->fill;
-    if (last == 0) {
-        return;
+/******************************************************************************/
+/*!
+ * Try to send a message to a queue. Does not block.
+ * @param   aQueue       [in] Queue handle.
+ * @param   aMessage     [in] Message to send, the base of a pq_msg_ex if
+ *                       the queue's messages carry metadata.
+ * @return  0            Success, or message dropped by the queue's full
+ *                       policy.
+ * @return  EAGAIN       Queue is full.
+ * @return  EINVAL       Invalid argument.
+ * @return  EMSGSIZE     Message too big for queue.
+ */
+pq_status_t pq_send_try(struct pq_queue *aQueue, const struct pq_msg *aMessage) {
+    if ((aQueue == NULL) || (aMessage == NULL)) {
+        return EINVAL;
     }
-    pq_swap(message, 0, last);
-    message[last].prio = 0;
-    /* Restore heap order. */
-    msgindex_t i = 0;
-    while (((2 * i) + 1) < last) {
-        const msgindex_t l = (2 * i) + 1;
-        const msgindex_t r = (2 * i) + 2;
-        const msgindex_t j = (message[l].prio > message[r].prio) ? l : r;
-        if (message[i].prio >= message[j].prio) {
-            break;
+    if ((aMessage->prio > aQueue->maxprio) || (aMessage->msg == NULL)) {
+        return EINVAL;
+    }
+    if (aMessage->size > aQueue->msgsize) {
+        return EMSGSIZE;
+    }
+    if (aQueue->combine) {
+        return pq_combine(aQueue, aMessage, NULL);
+    }
+
+    pq_status_t sc = pq_lock(aQueue, PQ_OP_SEND);
+    pq_return_if_unsuccessful(sc);
+    if ((aQueue->index_mask != 0) && pq_conflate(aQueue, aMessage)) {
+        return pq_unlock(aQueue);
+    }
+    int     handed;
+    sc = pq_handoff(aQueue, aMessage, &handed);
+    if ((sc != 0) || handed) {
+        const pq_status_t su = pq_unlock(aQueue);
+        return (sc != 0) ? sc : su;
+    }
+    const unsigned admit = pq_admit(aQueue, aMessage);
+    if (admit != PQ_ADMIT_INSERT) {
+        if (admit == PQ_ADMIT_FULL) {
+            ++aQueue->stats.rejected;
         }
-        pq_swap(message, i, j);
-        i = j;
+        sc = pq_unlock(aQueue);
+        return ((sc != 0) || (admit == PQ_ADMIT_DROP)) ? sc : EAGAIN;
     }
+    pq_insert(aQueue, aMessage);
+    struct pq_post post;
+    sc = pq_notify_recv(aQueue, &post);
+    pq_unlock_and_return_if_unsuccessful(sc);
+    sc = pq_unlock(aQueue);
+    pq_after_unlock(aQueue, &post);
+    return sc;
 }
 
 /******************************************************************************/
 /*!
- * Insert message into message heap.
+ * Try to receive a message from a queue. Does not block.
+ * @param   aQueue    [in] Queue handle.
+ * @param   aMessage  [out] Message retrieved from queue's head.
+ * @return  0 on success.
+ * @return  EAGAIN       Queue is empty.
+ * @return  EINVAL       Invalid argument.
+ * @return  Error code otherwise.
+ *
+ * The buffer pointed to by aMessage->msg must be large enough to hold all data,
+ * which is at most aQueue->maxmsg bytes. Metadata is not received; see
+ * pq_recv_ex().
+ */
+pq_status_t pq_recv_nonbl(struct pq_queue *aQueue, struct pq_msg *aMessage) {
+    if ((aQueue != NULL) && (aMessage != NULL) && aQueue->meta) {
+        struct pq_msg_ex ex = {.base = *aMessage };
+        const pq_status_t sc = pq_recv_try(aQueue, &ex.base);
+        *aMessage = ex.base;
+        return sc;
+    }
+    return pq_recv_try(aQueue, aMessage);
+}
+
+/******************************************************************************/
+/*!
+ * Try to receive a message from a queue. Does not block.
+ * @param   aQueue    [in] Queue handle.
+ * @param   aMessage  [out] Message retrieved from queue's head, the base of
+ *                    a pq_msg_ex if the queue's messages carry metadata.
+ * @return  0 on success.
+ * @return  EAGAIN       Queue is empty.
+ * @return  EINVAL       Invalid argument.
+ * @return  Error code otherwise.
+ */
+pq_status_t pq_recv_try(struct pq_queue *aQueue, struct pq_msg *aMessage) {
+    if ((aQueue == NULL) || (aMessage == NULL) || (aMessage->msg == NULL)) {
+        return EINVAL;
+    }
+    /* Fast path for pollers: an empty queue needs no mutex. A rendezvous
+     * queue is always empty, but may have senders waiting. */
+    if ((__atomic_load_n(&aQueue->fill, __ATOMIC_ACQUIRE) == 0) && (aQueue->maxmsg != 0)) {
+        return EAGAIN;
+    }
+    if (aQueue->combine) {
+        return pq_combine(aQueue, NULL, aMessage);
+    }
+
+    pq_status_t sc = pq_lock(aQueue, PQ_OP_RECV);
+    pq_return_if_unsuccessful(sc);
+    int     taken;
+    sc = pq_take(aQueue, aMessage, &taken);
+    if ((sc != 0) || taken) {
+        const pq_status_t su = pq_unlock(aQueue);
+        return (sc != 0) ? sc : su;
+    }
+    uint64_t due;
+    if (!pq_receivable(aQueue, &due)) {
+        sc = pq_unlock(aQueue);
+        return (sc != 0) ? sc : EAGAIN;
+    }
+    pq_remove(aQueue, aMessage);
+    struct pq_post post;
+    sc = pq_notify_send(aQueue, &post);
+    pq_unlock_and_return_if_unsuccessful(sc);
+    sc = pq_unlock(aQueue);
+    pq_after_unlock(aQueue, &post);
+    return sc;
+}
+
+/******************************************************************************/
+/*!
+ * Send message, with timeout.
  * @param   aQueue      [in] Queue handle.
- * @param   aMessage    [in] Message to insert.
- * @note    Assumes queue is not full.
- * @note    Assumes mutex held by caller.
- * @note    Complexity: O(log N).
+ * @param   aMessage    [in] Message to send.
+ * @param   aTimeout    How long to wait on a full queue until timeout.
+ * @return  0           Success.
+ * @return  EINVAL      Invalid argument.
+ * @return  EAGAIN      Queue is full and PQ_TIMEOUT_ZERO was specified.
+ * @return  EMSGSIZE    Message too big for queue.
+ * @return  ETIMEDOUT   Queue is full after timeout expired.
+ * @return  Error code otherwise.
+ *
+ * The deadline is computed once, so spurious or lost wakeups don't extend
+ * the total time spent waiting.
  */
-void pq_insert_prioq(struct pq_queue *aQueue, const struct pq_msg *aMessage) {
-    assert(aQueue->fill < aQueue->maxmsg);
-    struct pq_msg *const message = aQueue->message;
+pq_status_t pq_send_timed(struct pq_queue *aQueue, const struct pq_msg *aMessage, pq_time_t aTimeout) {
+    if (aTimeout == PQ_TIMEOUT_ZERO) {
+        return pq_send_nonbl(aQueue, aMessage);
+    }
+    if (aTimeout == PQ_TIMEOUT_INF) {
+        return pq_send_until(aQueue, aMessage, NULL);
+    }
+    struct timespec deadline;
+    const pq_status_t sc = pq_deadline(&deadline, aTimeout);
+    return (sc != 0) ? sc : pq_send_until(aQueue, aMessage, &deadline);
+}
 
-    msgindex_t i = aQueue->fill;
-    message[i].size = aMessage->size;
-    message[i].prio = aMessage->prio;
-    memcpy(message[i].msg, aMessage->msg, aMessage->size);
-    ++aQueue->fill;
-    while ((i > 0) && (message[(i - 1) / 2].prio < message[i].prio)) {
-        const msgindex_t j = (i - 1) / 2;
-        pq_swap(message, i, j);
-        i = j;
+/******************************************************************************/
+/*!
+ * Send message, waiting on a full queue until an absolute deadline.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aMessage    [in] Message to send.
+ * @param   aDeadline   [in] CLOCK_MONOTONIC time when to give up, or NULL
+ *                      to wait forever.
+ * @return  0           Success, or message dropped by the queue's full
+ *                      policy.
+ * @return  EINVAL      Invalid argument.
+ * @return  EMSGSIZE    Message too big for queue.
+ * @return  ETIMEDOUT   Queue is full at the deadline.
+ * @return  Error code otherwise.
+ */
+pq_status_t pq_send_until(struct pq_queue *aQueue, const struct pq_msg *aMessage, const struct timespec *aDeadline) {
+    if ((aQueue != NULL) && (aMessage != NULL) && aQueue->meta) {
+        const struct pq_msg_ex ex = {.base = *aMessage };
+        return pq_send_wait(aQueue, &ex.base, aDeadline);
+    }
+    return pq_send_wait(aQueue, aMessage, aDeadline);
+}
+
+/******************************************************************************/
+/*!
+ * Send message, waiting on a full queue until an absolute deadline.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aMessage    [in] Message to send, the base of a pq_msg_ex if the
+ *                      queue's messages carry metadata.
+ * @param   aDeadline   [in] CLOCK_MONOTONIC time when to give up, or NULL
+ *                      to wait forever.
+ * @return  0           Success, or message dropped by the queue's full
+ *                      policy.
+ * @return  EINVAL      Invalid argument.
+ * @return  EMSGSIZE    Message too big for queue.
+ * @return  ETIMEDOUT   Queue is full at the deadline.
+ * @return  Error code otherwise.
+ */
+pq_status_t pq_send_wait(struct pq_queue *aQueue, const struct pq_msg *aMessage, const struct timespec *aDeadline) {
+    if ((aQueue == NULL) || (aMessage == NULL)) {
+        return EINVAL;
+    }
+    if ((aMessage->prio > aQueue->maxprio) || (aMessage->msg == NULL)) {
+        return EINVAL;
+    }
+    if (aMessage->size > aQueue->msgsize) {
+        return EMSGSIZE;
+    }
+    /* Combine, and only wait the usual way on a full queue. */
+    pq_status_t sc;
+    if (aQueue->combine && ((sc = pq_combine(aQueue, aMessage, NULL)) != EAGAIN)) {
+        return sc;
+    }
+
+    sc = pq_lock(aQueue, PQ_OP_SEND);
+    pq_return_if_unsuccessful(sc);
+
+    if ((aQueue->index_mask != 0) && pq_conflate(aQueue, aMessage)) {
+        return pq_unlock(aQueue);
+    }
+    int     handed;
+    int     woken = 0;
+    unsigned admit = PQ_ADMIT_DROP;
+    while (((sc = pq_handoff(aQueue, aMessage, &handed)) == 0) && !handed
+           && ((admit = pq_admit(aQueue, aMessage)) == PQ_ADMIT_FULL)) {
+        /* Sleep until the first queued message expires, unless the deadline
+         * is earlier. Nobody else would free its slot. */
+        struct timespec ts;
+        const struct timespec *wake = aDeadline;
+        const uint64_t expires = aQueue->ttl ? pq_first_expiry(aQueue) : 0;
+        if ((expires != 0) && ((aDeadline == NULL) || (pq_ns(aDeadline) > expires))) {
+            pq_timespec(&ts, expires);
+            wake = &ts;
+        }
+        /* Woken for a slot another thread took, wait at the front again.
+         * A receiver may take the message of a rendezvous queue. */
+        if (aQueue->wait_lists) {
+            int     released;
+            sc = pq_park(aQueue, PQ_OP_SEND, (aQueue->maxmsg == 0) ? aMessage : NULL, NULL, aMessage->prio, wake,
+                         &woken, &released);
+            if (released) {
+                return sc;
+            }
+        }
+        else {
+            ++aQueue->waiting_to_send;
+            sc = pq_wait(aQueue, &aQueue->ready_to_send, wake);
+            --aQueue->waiting_to_send;
+        }
+        if ((sc == ETIMEDOUT) && (wake == &ts)) {
+            pq_purge(aQueue, aQueue->maxmsg);
+            sc = 0;
+        }
+        if (sc == ETIMEDOUT) {
+            ++aQueue->stats.rejected;
+        }
+        pq_unlock_and_return_if_unsuccessful(sc);
+        /* Another sender may have queued the key while we waited. */
+        if ((aQueue->index_mask != 0) && pq_conflate(aQueue, aMessage)) {
+            return pq_unlock(aQueue);
+        }
+    }
+    pq_unlock_and_return_if_unsuccessful(sc);
+    if (handed || (admit == PQ_ADMIT_DROP)) {
+        return pq_unlock(aQueue);
+    }
+
+    pq_insert(aQueue, aMessage);
+    struct pq_post post;
+    sc = pq_notify_recv(aQueue, &post);
+    pq_unlock_and_return_if_unsuccessful(sc);
+    sc = pq_unlock(aQueue);
+    pq_after_unlock(aQueue, &post);
+    return sc;
+}
+
+/******************************************************************************/
+/*!
+ * Version of pthread_cond_wait() that computes deadline and waits.
+ * @param   aCond       [in] Condition variable initialized by pq_cond_init().
+ * @param   aMutex      [in] Associated mutex.
+ * @param   aTimeout    How long to wait.
+ * @return  0           Success.
+ * @return  ETIMEDOUT   Operation timed out.
+ * @return  Error code otherwise.
+ */
+pq_status_t pq_cond_timedwait(pthread_cond_t *aCond, pthread_mutex_t *aMutex, pq_time_t aTimeout) {
+    struct timespec ts;
+    pq_status_t sc = pq_deadline(&ts, aTimeout);
+    if (sc == 0) {
+        sc = pthread_cond_timedwait(aCond, aMutex, &ts);
+    }
+    return sc;
+}
+
+/******************************************************************************/
+/*!
+ * Initialize a condition variable whose timed waits use CLOCK_MONOTONIC.
+ * @param   aCond       [out] Condition variable.
+ * @param   aShared     Nonzero for a process-shared condition variable.
+ * @return  0           Success.
+ * @return  Otherwise status code of failed pthread call.
+ */
+pq_status_t pq_cond_init(pthread_cond_t *aCond, int aShared) {
+    pthread_condattr_t attr;
+    pq_status_t sc = pthread_condattr_init(&attr);
+    if (sc != 0) {
+        return sc;
+    }
+    sc = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    if ((sc == 0) && aShared) {
+        sc = pthread_condattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    }
+    if (sc == 0) {
+        sc = pthread_cond_init(aCond, &attr);
+    }
+    pthread_condattr_destroy(&attr);
+    return sc;
+}
+
+/******************************************************************************/
+/*!
+ * Compute an absolute CLOCK_MONOTONIC deadline from a timeout.
+ * @param   aDeadline   [out] Deadline.
+ * @param   aTimeout    Timeout relative to now.
+ * @return  0           Success.
+ * @return  Otherwise error of failed clock_gettime().
+ */
+pq_status_t pq_deadline(struct timespec *aDeadline, pq_time_t aTimeout) {
+    if (clock_gettime(CLOCK_MONOTONIC, aDeadline) != 0) {
+        return errno;
+    }
+    pq_add_time(aDeadline, aTimeout);
+    return 0;
+}
+
+/******************************************************************************/
+/*!
+ * Wait on one of the queue's conditions.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aCond       [in] Condition to wait on.
+ * @param   aDeadline   [in] CLOCK_MONOTONIC time when to give up, or NULL
+ *                      to wait forever.
+ * @return  0           Success.
+ * @return  ETIMEDOUT   Operation timed out.
+ * @return  Error code otherwise.
+ * @note    Assumes mutex held by caller.
+ *
+ * The mutex is released while waiting, so it does not count as hold time.
+ * Other threads lock it meanwhile, so the operation type of the hold is
+ * restored after the wait.
+ */
+pq_status_t pq_wait(struct pq_queue *aQueue, pthread_cond_t *aCond, const struct timespec *aDeadline) {
+    pq_status_t sc;
+#ifdef PQ_PROFILE
+    const unsigned op = aQueue->prof_op;
+    struct pq_lock_profile *const p = &aQueue->profile.op[op];
+    pq_profile_record(p->hold_hist, &p->hold_ns, &p->hold_max_ns, pq_now_ns() - aQueue->prof_t0);
+#endif
+    if (aDeadline == NULL) {
+        sc = pthread_cond_wait(aCond, &aQueue->mtx);
+    }
+    else {
+        sc = pthread_cond_timedwait(aCond, &aQueue->mtx, aDeadline);
+    }
+    if (sc == EOWNERDEAD) {
+        sc = pthread_mutex_consistent(&aQueue->mtx);
+    }
+#ifdef PQ_PROFILE
+    aQueue->prof_op = op;
+    aQueue->prof_t0 = pq_now_ns();
+#endif
+    return sc;
+}
+
+/******************************************************************************/
+/*!
+ * Receive message, with timeout.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aMessage    [out] Message removed from queue.
+ * @param   aTimeout    How long to wait on an empty queue until timeout.
+ * @return  0           Success.
+ * @return  EINVAL      Invalid argument.
+ * @return  EAGAIN      Queue is empty and PQ_TIMEOUT_ZERO was specified.
+ * @return  ETIMEDOUT   Queue is empty after timeout expired.
+ * @return  Error code otherwise.
+ *
+ * The deadline is computed once, so spurious or lost wakeups don't extend
+ * the total time spent waiting.
+ */
+pq_status_t pq_recv_timed(struct pq_queue *aQueue, struct pq_msg *aMessage, pq_time_t aTimeout) {
+    return pq_recv_prio(aQueue, aMessage, 0, aTimeout);
+}
+
+/******************************************************************************/
+/*!
+ * Receive message, with timeout, ahead of receivers of lower priority.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aMessage    [out] Message removed from queue.
+ * @param   aPrio       Priority of the receiving thread.
+ * @param   aTimeout    How long to wait on an empty queue until timeout.
+ * @return  0           Success.
+ * @return  EINVAL      Invalid argument.
+ * @return  EAGAIN      Queue is empty and PQ_TIMEOUT_ZERO was specified.
+ * @return  ETIMEDOUT   Queue is empty after timeout expired.
+ * @return  Error code otherwise.
+ *
+ * Of the receivers waiting on an empty queue, the first of the highest
+ * priority gets the next message. Shared queues ignore aPrio.
+ */
+pq_status_t pq_recv_prio(struct pq_queue *aQueue, struct pq_msg *aMessage, msgprio_t aPrio, pq_time_t aTimeout) {
+    if (aTimeout == PQ_TIMEOUT_ZERO) {
+        return pq_recv_nonbl(aQueue, aMessage);
+    }
+    if (aTimeout == PQ_TIMEOUT_INF) {
+        return pq_recv_plain(aQueue, aMessage, aPrio, NULL);
+    }
+    struct timespec deadline;
+    const pq_status_t sc = pq_deadline(&deadline, aTimeout);
+    return (sc != 0) ? sc : pq_recv_plain(aQueue, aMessage, aPrio, &deadline);
+}
+
+/******************************************************************************/
+/*!
+ * Receive message, waiting on an empty queue until an absolute deadline.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aMessage    [out] Message removed from queue.
+ * @param   aDeadline   [in] CLOCK_MONOTONIC time when to give up, or NULL
+ *                      to wait forever.
+ * @return  0           Success.
+ * @return  EINVAL      Invalid argument.
+ * @return  ETIMEDOUT   Queue is empty at the deadline.
+ * @return  Error code otherwise.
+ */
+pq_status_t pq_recv_until(struct pq_queue *aQueue, struct pq_msg *aMessage, const struct timespec *aDeadline) {
+    return pq_recv_plain(aQueue, aMessage, 0, aDeadline);
+}
+
+/******************************************************************************/
+/*!
+ * Receive a message without metadata, waiting on an empty queue until an
+ * absolute deadline.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aMessage    [out] Message removed from queue.
+ * @param   aPrio       Priority of the receiving thread.
+ * @param   aDeadline   [in] CLOCK_MONOTONIC time when to give up, or NULL
+ *                      to wait forever.
+ * @return  See pq_recv_ranked().
+ */
+pq_status_t pq_recv_plain(struct pq_queue *aQueue, struct pq_msg *aMessage, msgprio_t aPrio,
+                          const struct timespec *aDeadline) {
+    if ((aQueue != NULL) && (aMessage != NULL) && aQueue->meta) {
+        struct pq_msg_ex ex = {.base = *aMessage };
+        const pq_status_t sc = pq_recv_ranked(aQueue, &ex.base, aPrio, aDeadline);
+        *aMessage = ex.base;
+        return sc;
+    }
+    return pq_recv_ranked(aQueue, aMessage, aPrio, aDeadline);
+}
+
+/******************************************************************************/
+/*!
+ * Receive a message with its metadata, with timeout.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aMessage    [out] Message removed from queue.
+ * @param   aTimeout    How long to wait on an empty queue until timeout.
+ * @return  0           Success.
+ * @return  EINVAL      Invalid argument.
+ * @return  EAGAIN      Queue is empty and PQ_TIMEOUT_ZERO was specified.
+ * @return  ETIMEDOUT   Queue is empty after timeout expired.
+ * @return  Error code otherwise.
+ *
+ * Fills in due for PQ_ATTR_DELAY and key for a conflating queue.
+ */
+pq_status_t pq_recv_ex(struct pq_queue *aQueue, struct pq_msg_ex *aMessage, pq_time_t aTimeout) {
+    if (aMessage == NULL) {
+        return EINVAL;
+    }
+    if (aTimeout == PQ_TIMEOUT_ZERO) {
+        return pq_recv_try(aQueue, &aMessage->base);
+    }
+    if (aTimeout == PQ_TIMEOUT_INF) {
+        return pq_recv_ranked(aQueue, &aMessage->base, 0, NULL);
+    }
+    struct timespec deadline;
+    const pq_status_t sc = pq_deadline(&deadline, aTimeout);
+    return (sc != 0) ? sc : pq_recv_ranked(aQueue, &aMessage->base, 0, &deadline);
+}
+
+/******************************************************************************/
+/*!
+ * Send a message with its metadata, with timeout.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aMessage    [in] Message to send.
+ * @param   aTimeout    How long to wait on a full queue until timeout.
+ * @return  0           Success, or message dropped by the queue's full
+ *                      policy.
+ * @return  EINVAL      Invalid argument.
+ * @return  EAGAIN      Queue is full and PQ_TIMEOUT_ZERO was specified.
+ * @return  EMSGSIZE    Message too big for queue.
+ * @return  ETIMEDOUT   Queue is full after timeout expired.
+ * @return  Error code otherwise.
+ *
+ * Only queues that use a member of the metadata read it: due for
+ * PQ_ATTR_DELAY, ttl with the ttl attribute, key when conflating and
+ * handle with handles.
+ */
+pq_status_t pq_send_ex(struct pq_queue *aQueue, const struct pq_msg_ex *aMessage, pq_time_t aTimeout) {
+    if (aMessage == NULL) {
+        return EINVAL;
+    }
+    if (aTimeout == PQ_TIMEOUT_ZERO) {
+        return pq_send_try(aQueue, &aMessage->base);
+    }
+    if (aTimeout == PQ_TIMEOUT_INF) {
+        return pq_send_wait(aQueue, &aMessage->base, NULL);
+    }
+    struct timespec deadline;
+    const pq_status_t sc = pq_deadline(&deadline, aTimeout);
+    return (sc != 0) ? sc : pq_send_wait(aQueue, &aMessage->base, &deadline);
+}
+
+/******************************************************************************/
+/*!
+ * Receive message as a receiver of a priority, waiting on an empty queue
+ * until an absolute deadline.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aMessage    [out] Message removed from queue.
+ * @param   aPrio       Priority of the receiving thread.
+ * @param   aDeadline   [in] CLOCK_MONOTONIC time when to give up, or NULL
+ *                      to wait forever.
+ * @return  0           Success.
+ * @return  EINVAL      Invalid argument.
+ * @return  ETIMEDOUT   Queue is empty at the deadline.
+ * @return  Error code otherwise.
+ */
+pq_status_t pq_recv_ranked(struct pq_queue *aQueue, struct pq_msg *aMessage, msgprio_t aPrio,
+                           const struct timespec *aDeadline) {
+    if ((aQueue == NULL) || (aMessage == NULL) || (aMessage->msg == NULL)) {
+        return EINVAL;
+    }
+    /* Combine, and only wait the usual way on an empty queue. */
+    pq_status_t sc;
+    if (aQueue->combine && ((sc = pq_combine(aQueue, NULL, aMessage)) != EAGAIN)) {
+        return sc;
+    }
+
+    sc = pq_lock(aQueue, PQ_OP_RECV);
+    pq_return_if_unsuccessful(sc);
+
+    uint64_t due;
+    int     woken = 0;
+    while (!pq_receivable(aQueue, &due)) {
+        int     taken;
+        sc = pq_take(aQueue, aMessage, &taken);
+        if ((sc != 0) || taken) {
+            const pq_status_t su = pq_unlock(aQueue);
+            return (sc != 0) ? sc : su;
+        }
+        /* Sleep until the earliest due time, unless the deadline is earlier.
+         * Sending an earlier message wakes us up to look again. */
+        struct timespec ts;
+        const struct timespec *wake = aDeadline;
+        if ((due != 0) && ((aDeadline == NULL) || (pq_ns(aDeadline) > due))) {
+            pq_timespec(&ts, due);
+            wake = &ts;
+        }
+        if (aQueue->wait_lists) {
+            int     released;
+            sc = pq_park(aQueue, PQ_OP_RECV, NULL, aQueue->handoff ? aMessage : NULL, aPrio, wake, &woken, &released);
+            if (released) {
+                return sc;
+            }
+        }
+        else {
+            ++aQueue->waiting_to_recv;
+            sc = pq_wait(aQueue, &aQueue->ready_to_recv, wake);
+            --aQueue->waiting_to_recv;
+        }
+        if ((sc == ETIMEDOUT) && (wake == &ts)) {
+            sc = 0;
+        }
+        pq_unlock_and_return_if_unsuccessful(sc);
+    }
+
+    pq_remove(aQueue, aMessage);
+    struct pq_post post;
+    sc = pq_notify_send(aQueue, &post);
+    pq_unlock_and_return_if_unsuccessful(sc);
+    sc = pq_unlock(aQueue);
+    pq_after_unlock(aQueue, &post);
+    return sc;
+}
+
+/******************************************************************************/
+/*!
+ * Hand a message directly to the first receiver waiting on an empty queue.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aMessage    [in] Message to send.
+ * @param   aHanded     [out] Nonzero if the message was handed over.
+ * @return  0           Success.
+ * @return  Otherwise status code of failed pthread call.
+ * @note    Assumes mutex held by caller.
+ *
+ * The message is copied once, into the receiver's buffer, and neither
+ * takes a slot nor needs the receiver to look at the queue again.
+ */
+pq_status_t pq_handoff(struct pq_queue *aQueue, const struct pq_msg *aMessage, int *aHanded) {
+    *aHanded = 0;
+    if (!aQueue->handoff || (aQueue->waiter_head[PQ_OP_RECV] == NULL) || (aQueue->fill != 0)) {
+        return 0;
+    }
+    struct pq_waiter *const w = pq_waiter_pop(aQueue, PQ_OP_RECV);
+    struct pq_msg *const out = w->recv;
+    memcpy(out->msg, aMessage->msg, aMessage->size);
+    out->size = aMessage->size;
+    out->prio = aMessage->prio;
+    if (aQueue->index_mask != 0) {
+        ((struct pq_msg_ex *) out)->key = ((const struct pq_msg_ex *) aMessage)->key;
+    }
+    ++aQueue->stats.handed_off;
+    w->handed = 1;
+    *aHanded = 1;
+    return pq_waiter_wake(w);
+}
+
+/******************************************************************************/
+/*!
+ * Take the message of the first sender waiting on a rendezvous queue.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aMessage    [out] Message received.
+ * @param   aTaken      [out] Nonzero if a message was taken.
+ * @return  0           Success.
+ * @return  Otherwise status code of failed wakeup.
+ * @note    Assumes mutex held by caller.
+ *
+ * The counterpart of pq_handoff() for a receiver that comes after the
+ * sender, so that a receive that does not wait can succeed too.
+ */
+pq_status_t pq_take(struct pq_queue *aQueue, struct pq_msg *aMessage, int *aTaken) {
+    *aTaken = 0;
+    if ((aQueue->maxmsg != 0) || (aQueue->waiter_head[PQ_OP_SEND] == NULL)) {
+        return 0;
+    }
+    struct pq_waiter *const w = pq_waiter_pop(aQueue, PQ_OP_SEND);
+    const struct pq_msg *const in = w->send;
+    memcpy(aMessage->msg, in->msg, in->size);
+    aMessage->size = in->size;
+    aMessage->prio = in->prio;
+    ++aQueue->stats.handed_off;
+    w->handed = 1;
+    *aTaken = 1;
+    return pq_waiter_wake(w);
+}
+
+/******************************************************************************/
+/*!
+ * Wait in line on a full or empty queue.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aOp         PQ_OP_SEND or PQ_OP_RECV.
+ * @param   aSend       [in] For a sender to a rendezvous queue, message a
+ *                      receiver may take, or NULL.
+ * @param   aRecv       [out] Buffer for a message handed over, or NULL.
+ * @param   aPrio       Priority of the message to send, or of the receiver.
+ * @param   aDeadline   [in] CLOCK_MONOTONIC time when to give up, or NULL
+ *                      to wait forever.
+ * @param   aFront      [in,out] Nonzero to wait at the front of the line,
+ *                      for a thread that was woken but found its slot or
+ *                      message taken. Set to nonzero if this wait was ended
+ *                      by a waker, zero after a timeout or spurious wakeup.
+ * @param   aReleased   [out] Nonzero if the message was handed over or
+ *                      taken; the mutex is no longer held then.
+ * @return  0           Success.
+ * @return  ETIMEDOUT   Operation timed out.
+ * @return  Error code otherwise.
+ * @note    Assumes mutex held by caller.
+ *
+ * The waiter lives on the stack of the waiting thread and is linked into
+ * the queue's list for aOp, so a thread that frees a slot or inserts a
+ * message wakes exactly the first in line. Receivers line up by priority,
+ * then arrival.
+ *
+ * On Linux the waiter sleeps on a futex of its own with the mutex
+ * released, so one whose wait was ended by a handover returns without
+ * locking the queue again.
+ */
+pq_status_t pq_park(struct pq_queue *aQueue, unsigned aOp, const struct pq_msg *aSend, struct pq_msg *aRecv,
+                    msgprio_t aPrio, const struct timespec *aDeadline, int *aFront, int *aReleased) {
+    struct pq_waiter w = {.next = NULL,.send = aSend,.recv = aRecv,.prio = aPrio,.linked = 0,.handed = 0,.state = 0 };
+    *aReleased = 0;
+#ifdef __linux__
+    pq_waiter_push(aQueue, aOp, &w, *aFront);
+    pq_status_t sc = pq_unlock(aQueue);
+    if (sc != 0) {
+        pq_waiter_unlink(aQueue, aOp, &w);
+        return sc;
+    }
+    sc = pq_futex_wait(&w.state, aDeadline);
+    if ((__atomic_load_n(&w.state, __ATOMIC_ACQUIRE) != 0) && w.handed) {
+        *aFront = 1;
+        *aReleased = 1;
+        return 0;
+    }
+    /* The waiter may still be in the list, so the mutex must be had back
+     * before the waiter goes away with this stack frame. */
+    while (pq_lock(aQueue, aOp) != 0) {
+        sched_yield();
+    }
+#else
+    pq_status_t sc = pq_cond_init(&w.cond, 0);
+    if (sc != 0) {
+        return sc;
+    }
+    pq_waiter_push(aQueue, aOp, &w, *aFront);
+    sc = pq_wait(aQueue, &w.cond, aDeadline);
+    pthread_cond_destroy(&w.cond);
+#endif
+    /* Only a thread taken off the line by a waker keeps its place. */
+    *aFront = !w.linked;
+    if (w.linked) {
+        pq_waiter_unlink(aQueue, aOp, &w);
+    }
+    else if (sc == ETIMEDOUT) {
+        /* Woken as the deadline passed: look once more rather than drop
+         * the wakeup meant for this waiter. */
+        sc = 0;
+    }
+    if (w.handed) {
+        *aReleased = 1;
+        return pq_unlock(aQueue);
+    }
+    return sc;
+}
+
+/******************************************************************************/
+/*!
+ * Wake up a waiter taken off a queue's list.
+ * @param   aWaiter     [in] Waiter.
+ * @return  0           Success.
+ * @return  Otherwise status code of failed wakeup.
+ * @note    Assumes mutex held by caller.
+ */
+pq_status_t pq_waiter_wake(struct pq_waiter *aWaiter) {
+#ifdef __linux__
+    /* The waiter may return as soon as it sees the store, so only the
+     * address of its state is used after that. */
+    uint32_t *const state = &aWaiter->state;
+    __atomic_store_n(state, 1u, __ATOMIC_RELEASE);
+    return (syscall(SYS_futex, state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0) < 0) ? errno : 0;
+#else
+    return pthread_cond_signal(&aWaiter->cond);
+#endif
+}
+
+/******************************************************************************/
+/*!
+ * Wait until a futex word of a waiter is set.
+ * @param   aWord       [in] Futex word, 0 until woken.
+ * @param   aDeadline   [in] CLOCK_MONOTONIC time when to give up, or NULL
+ *                      to wait forever.
+ * @return  0           Success.
+ * @return  ETIMEDOUT   Operation timed out.
+ * @return  ENOSYS      Not on Linux.
+ * @return  Error code otherwise.
+ */
+pq_status_t pq_futex_wait(uint32_t *aWord, const struct timespec *aDeadline) {
+#ifdef __linux__
+    while (__atomic_load_n(aWord, __ATOMIC_ACQUIRE) == 0) {
+        /* The bitset variant takes an absolute CLOCK_MONOTONIC deadline. */
+        if ((syscall(SYS_futex, aWord, FUTEX_WAIT_BITSET_PRIVATE, 0u, aDeadline, NULL, FUTEX_BITSET_MATCH_ANY) != 0)
+            && (errno != EAGAIN) && (errno != EINTR)) {
+            return errno;
+        }
+    }
+    return 0;
+#else
+    (void) aWord;
+    (void) aDeadline;
+    return ENOSYS;
+#endif
+}
+
+/******************************************************************************/
+/*!
+ * Wake up senders waiting for a free slot.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aCount      Number of slots freed.
+ * @return  0           Success.
+ * @return  Otherwise status code of failed pthread call.
+ * @note    Assumes mutex held by caller.
+ *
+ * With wait lists, senders are woken in line as long as their messages
+ * fit, counting the slots the ones woken before will take; with bands, a
+ * sender whose message does not fit yet keeps its place.
+ */
+pq_status_t pq_wake_senders(struct pq_queue *aQueue, msgindex_t aCount) {
+    if (!aQueue->wait_lists) {
+        if (aQueue->waiting_to_send == 0) {
+            return 0;
+        }
+        /* With bands, the one woken might still not fit. */
+        return ((aCount > 1) || (aQueue->bands > 0)) ? pthread_cond_broadcast(&aQueue->ready_to_send)
+            : pthread_cond_signal(&aQueue->ready_to_send);
+    }
+    pq_status_t sc = 0;
+    msgindex_t woken = 0;
+    struct pq_waiter *w = aQueue->waiter_head[PQ_OP_SEND];
+    while ((w != NULL) && (woken < aCount) && (sc == 0)) {
+        struct pq_waiter *const next = w->next;
+        if ((aQueue->maxmsg == 0) || (aQueue->fill + woken < pq_limit(aQueue, w->prio))) {
+            pq_waiter_unlink(aQueue, PQ_OP_SEND, w);
+            sc = pq_waiter_wake(w);
+            ++woken;
+        }
+        w = next;
+    }
+    return sc;
+}
+
+/******************************************************************************/
+/*!
+ * Add a waiter to a queue's list.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aOp         PQ_OP_SEND or PQ_OP_RECV.
+ * @param   aWaiter     [in] Waiter.
+ * @param   aFront      Nonzero to add at the front, else at the back.
+ * @note    Assumes mutex held by caller.
+ * @note    Complexity: O(1) for senders and for receivers of the lowest
+ *          priority waiting, O(N) for others.
+ *
+ * Receivers are kept sorted by priority, so the front and back are those
+ * of the waiter's priority. With few waiters, a sorted list beats a heap:
+ * it keeps arrival order within a priority and pops in O(1).
+ */
+void pq_waiter_push(struct pq_queue *aQueue, unsigned aOp, struct pq_waiter *aWaiter, int aFront) {
+    struct pq_waiter *prev = NULL;
+    if (aOp == PQ_OP_RECV) {
+        const msgprio_t tail = (aQueue->waiter_tail[aOp] != NULL) ? aQueue->waiter_tail[aOp]->prio : 0;
+        if ((aQueue->waiter_tail[aOp] != NULL) && (aFront || (aWaiter->prio > tail))) {
+            for (struct pq_waiter *w = aQueue->waiter_head[aOp];
+                 (w != NULL) && (aFront ? (w->prio > aWaiter->prio) : (w->prio >= aWaiter->prio)); w = w->next) {
+                prev = w;
+            }
+        }
+        else {
+            prev = aQueue->waiter_tail[aOp];
+        }
+    }
+    else {
+        prev = aFront ? NULL : aQueue->waiter_tail[aOp];
+    }
+    aWaiter->next = (prev == NULL) ? aQueue->waiter_head[aOp] : prev->next;
+    if (prev == NULL) {
+        aQueue->waiter_head[aOp] = aWaiter;
+    }
+    else {
+        prev->next = aWaiter;
+    }
+    if (aWaiter->next == NULL) {
+        aQueue->waiter_tail[aOp] = aWaiter;
+    }
+    aWaiter->linked = 1;
+    ++*((aOp == PQ_OP_RECV) ? &aQueue->waiting_to_recv : &aQueue->waiting_to_send);
+}
+
+/******************************************************************************/
+/*!
+ * Remove the first waiter from a queue's list.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aOp         PQ_OP_SEND or PQ_OP_RECV.
+ * @return  Waiter removed.
+ * @note    Assumes mutex held by caller and list not empty.
+ */
+struct pq_waiter *pq_waiter_pop(struct pq_queue *aQueue, unsigned aOp) {
+    struct pq_waiter *const w = aQueue->waiter_head[aOp];
+    aQueue->waiter_head[aOp] = w->next;
+    if (aQueue->waiter_head[aOp] == NULL) {
+        aQueue->waiter_tail[aOp] = NULL;
+    }
+    w->next = NULL;
+    w->linked = 0;
+    --*((aOp == PQ_OP_RECV) ? &aQueue->waiting_to_recv : &aQueue->waiting_to_send);
+    return w;
+}
+
+/******************************************************************************/
+/*!
+ * Remove any waiter from a queue's list.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aOp         PQ_OP_SEND or PQ_OP_RECV.
+ * @param   aWaiter     [in] Waiter in list.
+ * @note    Assumes mutex held by caller.
+ * @note    Complexity: O(N) in the number of waiters before it.
+ */
+void pq_waiter_unlink(struct pq_queue *aQueue, unsigned aOp, struct pq_waiter *aWaiter) {
+    struct pq_waiter *prev = NULL;
+    for (struct pq_waiter *w = aQueue->waiter_head[aOp]; w != aWaiter; w = w->next) {
+        prev = w;
+    }
+    if (prev == NULL) {
+        aQueue->waiter_head[aOp] = aWaiter->next;
+    }
+    else {
+        prev->next = aWaiter->next;
+    }
+    if (aQueue->waiter_tail[aOp] == aWaiter) {
+        aQueue->waiter_tail[aOp] = prev;
+    }
+    aWaiter->next = NULL;
+    aWaiter->linked = 0;
+    --*((aOp == PQ_OP_RECV) ? &aQueue->waiting_to_recv : &aQueue->waiting_to_send);
+}
+
+/******************************************************************************/
+/*!
+ * Wake up whoever waits for a message, after a message was inserted.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aPost       [out] Work for pq_after_unlock().
+ * @return  0           Success.
+ * @return  Otherwise status code of failed pthread call.
+ * @note    Assumes mutex held by caller.
+ *
+ * Sets and event file descriptors are only notified when the queue was
+ * empty, so a busy queue does not pay for them per message.
+ */
+pq_status_t pq_notify_recv(struct pq_queue *aQueue, struct pq_post *aPost) {
+    pq_status_t sc = 0;
+    aPost->eventfd = -1;
+    aPost->sync = pq_sync_due(aQueue);
+    if (aQueue->fill == 1) {
+        aPost->eventfd = aQueue->eventfd[PQ_EVENT_RECV];
+        if (aQueue->set != NULL) {
+            sc = pq_set_notify(aQueue);
+        }
+    }
+    if ((sc == 0) && (aQueue->waiter_head[PQ_OP_RECV] != NULL)) {
+        /* The receiver woken leaves the list, so that the next message
+         * wakes the next one. */
+        sc = pq_waiter_wake(pq_waiter_pop(aQueue, PQ_OP_RECV));
+    }
+    else if ((sc == 0) && (aQueue->waiting_to_recv > 0)) {
+        sc = pthread_cond_signal(&aQueue->ready_to_recv);
+    }
+    return sc;
+}
+
+/******************************************************************************/
+/*!
+ * Wake up whoever waits for a free slot, after a message was removed.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aPost       [out] Work for pq_after_unlock().
+ * @return  0           Success.
+ * @return  Otherwise status code of failed pthread call.
+ * @note    Assumes mutex held by caller.
+ */
+pq_status_t pq_notify_send(struct pq_queue *aQueue, struct pq_post *aPost) {
+    aPost->eventfd = -1;
+    aPost->sync = pq_sync_due(aQueue);
+    if (aQueue->fill == (aQueue->maxmsg - 1)) {
+        aPost->eventfd = aQueue->eventfd[PQ_EVENT_SEND];
+    }
+    return pq_wake_senders(aQueue, 1);
+}
+
+/******************************************************************************/
+/*!
+ * Get an event file descriptor that becomes readable on queue events.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aEvent      PQ_EVENT_RECV: signalled when the queue was empty
+ *                      and a message arrives. PQ_EVENT_SEND: signalled when
+ *                      the queue was full and a message is removed.
+ * @param   aFd         [out] Event file descriptor.
+ * @return  0           Success.
+ * @return  EINVAL      Invalid argument.
+ * @return  ENOTSUP     Event file descriptors are not supported, or the
+ *                      queue is in shared memory or of order PQ_ATTR_DELAY.
+ * @return  Otherwise error of failed eventfd() or pthread call.
+ *
+ * The descriptor is created on first use, is non-blocking and is owned
+ * by the queue; pq_destroy() closes it. Signalling is edge-triggered: after
+ * reading the descriptor, drain the queue with pq_recv_nonbl() until EAGAIN
+ * (or fill it with pq_send_nonbl() until EAGAIN) before polling again.
+ */
+pq_status_t pq_get_eventfd(struct pq_queue *aQueue, unsigned aEvent, int *aFd) {
+    if ((aQueue == NULL) || (aEvent > PQ_EVENT_SEND) || (aFd == NULL)) {
+        return EINVAL;
+    }
+#ifdef __linux__
+    if ((aQueue->memory == PQ_MEM_SHM) || (aQueue->order == PQ_ATTR_DELAY)) {
+        return ENOTSUP;
+    }
+    pq_status_t sc = pq_lock(aQueue, PQ_OP_OTHER);
+    pq_return_if_unsuccessful(sc);
+    if (aQueue->eventfd[aEvent] < 0) {
+        aQueue->eventfd[aEvent] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (aQueue->eventfd[aEvent] < 0) {
+            sc = errno;
+            pq_unlock(aQueue);
+            return sc;
+        }
+    }
+    *aFd = aQueue->eventfd[aEvent];
+    sc = pq_unlock(aQueue);
+    return sc;
+#else
+    return ENOTSUP;
+#endif
+}
+
+/******************************************************************************/
+/*!
+ * Do the work pq_notify_recv() or pq_notify_send() left for after unlocking,
+ * so other threads need not wait for system calls.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aPost       [in] Work to do.
+ */
+void pq_after_unlock(struct pq_queue *aQueue, const struct pq_post *aPost) {
+    pq_eventfd_signal(aPost->eventfd);
+    if (aPost->sync) {
+        pq_sync(aQueue);
+    }
+}
+
+/******************************************************************************/
+/*!
+ * Signal an event file descriptor.
+ * @param   aFd     Event file descriptor, or -1 for none.
+ */
+void pq_eventfd_signal(int aFd) {
+#ifdef __linux__
+    if (aFd >= 0) {
+        const uint64_t one = 1;
+        if (write(aFd, &one, sizeof one) < 0) {
+            /* Counter saturated; the reader has plenty to do already. */
+        }
+    }
+#endif
+}
+
+/******************************************************************************/
+/*!
+ * Allocate a queue set.
+ * @param   aSet        [out] Pointer to set handle.
+ * @param   aMaxQueues  Max number of member queues.
+ * @return  0           Success; *aSet was assigned a handle.
+ * @return  EINVAL      Invalid argument.
+ * @return  ENOMEM      Out of memory.
+ * @return  Otherwise status code of failed pthread call.
+ *
+ * A receiver can block on all members of a set at once with pq_recv_any()
+ * or pq_select(). Members with messages are kept in per-priority ready
+ * lists, so a wakeup costs O(1) regardless of the number of members.
+ */
+pq_status_t pq_set_create(struct pq_set **aSet, msgindex_t aMaxQueues) {
+    if ((aSet == NULL) || (aMaxQueues == 0) || (aMaxQueues == PQ_SET_NIL)) {
+        return EINVAL;
+    }
+
+    struct pq_set *const s = malloc(sizeof *s);
+    if (s == NULL) {
+        return ENOMEM;
+    }
+    s->member = calloc(aMaxQueues, sizeof *s->member);
+    if (s->member == NULL) {
+        free(s);
+        return ENOMEM;
+    }
+    pq_status_t sc = pthread_mutex_init(&s->mtx, NULL);
+    if (sc == 0) {
+        sc = pq_cond_init(&s->ready, 0);
+        if (sc != 0) {
+            pthread_mutex_destroy(&s->mtx);
+        }
+    }
+    if (sc != 0) {
+        free(s->member);
+        free(s);
+        return sc;
+    }
+    s->maxqueues = aMaxQueues;
+    s->count = 0;
+    s->readymask = 0;
+    s->waiting = 0;
+    for (msgprio_t p = 0; p <= PQ_SET_MAXPRIO; ++p) {
+        s->head[p] = PQ_SET_NIL;
+        s->tail[p] = PQ_SET_NIL;
+    }
+    *aSet = s;
+    return 0;
+}
+
+/******************************************************************************/
+/*!
+ * Destroy a queue set. Member queues are detached but not destroyed.
+ * @param   aSet      [in] Set handle.
+ * @return  0         Success.
+ * @return  EINVAL    Invalid argument.
+ * @return  Otherwise status code of failed pthread call; the set is left
+ *          as it was.
+ */
+pq_status_t pq_set_destroy(struct pq_set *aSet) {
+    if (aSet == NULL) {
+        return EINVAL;
+    }
+    /* Lock every member before detaching any, so that a failure leaves
+     * the set as it was. */
+    msgindex_t locked = 0;
+    pq_status_t sc = 0;
+    while ((locked < aSet->count) && ((sc = pq_lock(aSet->member[locked].queue, PQ_OP_OTHER)) == 0)) {
+        ++locked;
+    }
+    for (msgindex_t i = 0; i < locked; ++i) {
+        struct pq_queue *const q = aSet->member[i].queue;
+        if (sc == 0) {
+            q->set = NULL;
+        }
+        pq_unlock(q);
+    }
+    if (sc != 0) {
+        return sc;
+    }
+    pthread_cond_destroy(&aSet->ready);
+    pthread_mutex_destroy(&aSet->mtx);
+    free(aSet->member);
+    free(aSet);
+    return 0;
+}
+
+/******************************************************************************/
+/*!
+ * Add a queue to a queue set.
+ * @param   aSet        [in] Set handle.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aPrio       Member priority, at most PQ_SET_MAXPRIO.
+ * @param   aWeight     Messages received from this member before moving on
+ *                      to the next ready member of the same priority; 0 is 1.
+ * @param   aIndex      [out] Member index as returned by pq_recv_any(); may
+ *                      be NULL.
+ * @return  0           Success.
+ * @return  EINVAL      Invalid argument, or queue is in shared memory or
+ *                      of order PQ_ATTR_DELAY.
+ * @return  EBUSY       Queue is already a member of a set.
+ * @return  ENOSPC      Set is full.
+ * @return  Otherwise status code of failed pthread call.
+ */
+pq_status_t pq_set_add(struct pq_set *aSet, struct pq_queue *aQueue, msgprio_t aPrio, msgindex_t aWeight, msgindex_t *aIndex) {
+    if ((aSet == NULL) || (aQueue == NULL) || (aPrio > PQ_SET_MAXPRIO)) {
+        return EINVAL;
+    }
+    if ((aQueue->memory == PQ_MEM_SHM) || (aQueue->order == PQ_ATTR_DELAY)) {
+        return EINVAL;
+    }
+
+    pq_status_t sc = pq_lock(aQueue, PQ_OP_OTHER);
+    pq_return_if_unsuccessful(sc);
+    if (aQueue->set != NULL) {
+        sc = pq_unlock(aQueue);
+        return (sc != 0) ? sc : EBUSY;
+    }
+    sc = pthread_mutex_lock(&aSet->mtx);
+    pq_unlock_and_return_if_unsuccessful(sc);
+    if (aSet->count == aSet->maxqueues) {
+        pthread_mutex_unlock(&aSet->mtx);
+        sc = pq_unlock(aQueue);
+        return (sc != 0) ? sc : ENOSPC;
+    }
+    const msgindex_t i = aSet->count++;
+    struct pq_set_member *const m = &aSet->member[i];
+    m->queue = aQueue;
+    m->prio = aPrio;
+    m->weight = (aWeight == 0) ? 1 : aWeight;
+    m->credit = m->weight;
+    m->ready = 0;
+    m->next = PQ_SET_NIL;
+    aQueue->set = aSet;
+    aQueue->set_index = i;
+    if (aQueue->fill > 0) {
+        m->ready = 1;
+        pq_set_push(aSet, i, 0);
+    }
+    pthread_mutex_unlock(&aSet->mtx);
+    if (aIndex != NULL) {
+        *aIndex = i;
+    }
+    sc = pq_unlock(aQueue);
+    return sc;
+}
+
+/******************************************************************************/
+/*!
+ * Receive a message from any member of a queue set, with timeout.
+ * @param   aSet        [in] Set handle.
+ * @param   aMessage    [out] Message removed from a member queue.
+ * @param   aIndex      [out] Index of member the message came from; may be
+ *                      NULL.
+ * @param   aTimeout    How long to wait for a message until timeout.
+ * @return  0           Success.
+ * @return  EINVAL      Invalid argument.
+ * @return  EAGAIN      All members are empty and PQ_TIMEOUT_ZERO was
+ *                      specified.
+ * @return  ETIMEDOUT   All members are empty after timeout expired.
+ * @return  Error code otherwise.
+ *
+ * Members are served highest set priority first, and round robin with
+ * their weights among members of the same priority.
+ */
+pq_status_t pq_recv_any(struct pq_set *aSet, struct pq_msg *aMessage, msgindex_t *aIndex, pq_time_t aTimeout) {
+    if ((aSet == NULL) || (aMessage == NULL) || (aMessage->msg == NULL)) {
+        return EINVAL;
+    }
+    struct timespec ts = { 0, 0 };
+    const struct timespec *const deadline = (aTimeout == PQ_TIMEOUT_INF) ? NULL : &ts;
+    if ((aTimeout != PQ_TIMEOUT_ZERO) && (aTimeout != PQ_TIMEOUT_INF)) {
+        const pq_status_t sc = pq_deadline(&ts, aTimeout);
+        if (sc != 0) {
+            return sc;
+        }
+    }
+
+    for (;;) {
+        msgindex_t i;
+        pq_status_t sc = pq_set_claim(aSet, &i, deadline);
+        if (sc != 0) {
+            return sc;
+        }
+        struct pq_set_member *const m = &aSet->member[i];
+        struct pq_queue *const q = m->queue;
+        sc = pq_lock(q, PQ_OP_RECV);
+        if (sc != 0) {
+            pq_set_unclaim(aSet, i);
+            return sc;
+        }
+        uint64_t due;
+        const msgindex_t fill = pq_receivable(q, &due) ? q->fill : 0;
+        struct pq_post post = { -1, 0 };
+        if (fill > 0) {
+            if (q->meta) {
+                struct pq_msg_ex ex = {.base = *aMessage };
+                pq_remove(q, &ex.base);
+                *aMessage = ex.base;
+            }
+            else {
+                pq_remove(q, aMessage);
+            }
+            sc = pq_notify_send(q, &post);
+        }
+        /* Settle the claim while the queue can't change. */
+        pthread_mutex_lock(&aSet->mtx);
+        if (q->fill == 0) {
+            m->ready = 0;
+        }
+        else if (--m->credit > 0) {
+            pq_set_push(aSet, i, 1);
+        }
+        else {
+            m->credit = m->weight;
+            pq_set_push(aSet, i, 0);
+        }
+        if ((aSet->readymask != 0) && (aSet->waiting > 0)) {
+            pthread_cond_signal(&aSet->ready);
+        }
+        pthread_mutex_unlock(&aSet->mtx);
+        const pq_status_t usc = pq_unlock(q);
+        pq_after_unlock(q, &post);
+        if (sc == 0) {
+            sc = usc;
+        }
+        if ((sc != 0) || (fill > 0)) {
+            if ((sc == 0) && (aIndex != NULL)) {
+                *aIndex = i;
+            }
+            return sc;
+        }
+    }
+}
+
+/******************************************************************************/
+/*!
+ * Wait until any member of a queue set is ready to receive, with timeout.
+ * @param   aSet        [in] Set handle.
+ * @param   aIndex      [out] Index of a member that has messages.
+ * @param   aTimeout    How long to wait until timeout.
+ * @return  0           Success.
+ * @return  EINVAL      Invalid argument.
+ * @return  EAGAIN      All members are empty and PQ_TIMEOUT_ZERO was
+ *                      specified.
+ * @return  ETIMEDOUT   All members are empty after timeout expired.
+ * @return  Error code otherwise.
+ *
+ * The member stays ready. Unless there is a single receiver, a subsequent
+ * pq_recv_nonbl() on it may still find it empty.
+ */
+pq_status_t pq_select(struct pq_set *aSet, msgindex_t *aIndex, pq_time_t aTimeout) {
+    if ((aSet == NULL) || (aIndex == NULL)) {
+        return EINVAL;
+    }
+    struct timespec ts = { 0, 0 };
+    const struct timespec *const deadline = (aTimeout == PQ_TIMEOUT_INF) ? NULL : &ts;
+    if ((aTimeout != PQ_TIMEOUT_ZERO) && (aTimeout != PQ_TIMEOUT_INF)) {
+        const pq_status_t sc = pq_deadline(&ts, aTimeout);
+        if (sc != 0) {
+            return sc;
+        }
+    }
+
+    for (;;) {
+        msgindex_t i;
+        pq_status_t sc = pq_set_claim(aSet, &i, deadline);
+        if (sc != 0) {
+            return sc;
+        }
+        struct pq_set_member *const m = &aSet->member[i];
+        struct pq_queue *const q = m->queue;
+        sc = pq_lock(q, PQ_OP_OTHER);
+        if (sc != 0) {
+            pq_set_unclaim(aSet, i);
+            return sc;
+        }
+        uint64_t due;
+        const msgindex_t fill = pq_receivable(q, &due) ? q->fill : 0;
+        pthread_mutex_lock(&aSet->mtx);
+        if (fill == 0) {
+            m->ready = 0;
+        }
+        else {
+            pq_set_push(aSet, i, 1);
+        }
+        pthread_mutex_unlock(&aSet->mtx);
+        sc = pq_unlock(q);
+        if ((sc != 0) || (fill > 0)) {
+            *aIndex = i;
+            return sc;
+        }
+    }
+}
+
+/******************************************************************************/
+/*!
+ * Take the first member off the highest priority ready list, with timeout.
+ * @param   aSet        [in] Set handle.
+ * @param   aIndex      [out] Index of claimed member.
+ * @param   aDeadline   [in] CLOCK_MONOTONIC time when to give up, NULL to
+ *                      wait forever, or zero not to wait at all.
+ * @return  0           Success.
+ * @return  EAGAIN      No member ready and aDeadline is zero.
+ * @return  ETIMEDOUT   No member ready at the deadline.
+ * @return  Error code otherwise.
+ *
+ * The claimed member keeps its ready flag, so senders don't list it again.
+ * The caller must settle the claim with the member queue's mutex held, by
+ * either pushing it back with pq_set_push() or clearing the ready flag, or
+ * hand it back with pq_set_unclaim() if it can't lock the queue.
+ */
+pq_status_t pq_set_claim(struct pq_set *aSet, msgindex_t *aIndex, const struct timespec *aDeadline) {
+    pq_status_t sc = pthread_mutex_lock(&aSet->mtx);
+    if (sc != 0) {
+        return sc;
+    }
+    while (aSet->readymask == 0) {
+        if ((aDeadline != NULL) && (aDeadline->tv_sec == 0) && (aDeadline->tv_nsec == 0)) {
+            pthread_mutex_unlock(&aSet->mtx);
+            return EAGAIN;
+        }
+        ++aSet->waiting;
+        if (aDeadline == NULL) {
+            sc = pthread_cond_wait(&aSet->ready, &aSet->mtx);
+        }
+        else {
+            sc = pthread_cond_timedwait(&aSet->ready, &aSet->mtx, aDeadline);
+        }
+        --aSet->waiting;
+        if (sc != 0) {
+            pthread_mutex_unlock(&aSet->mtx);
+            return sc;
+        }
+    }
+    const unsigned p = 31u - (unsigned) __builtin_clz(aSet->readymask);
+    const msgindex_t i = aSet->head[p];
+    aSet->head[p] = aSet->member[i].next;
+    if (aSet->head[p] == PQ_SET_NIL) {
+        aSet->tail[p] = PQ_SET_NIL;
+        aSet->readymask &= ~(1u << p);
+    }
+    *aIndex = i;
+    return pthread_mutex_unlock(&aSet->mtx);
+}
+
+/******************************************************************************/
+/*!
+ * Link a member into the ready list of its priority.
+ * @param   aSet      [in] Set handle.
+ * @param   aIndex    Member index.
+ * @param   aFront    Nonzero to serve this member next, zero to append.
+ * @note    Assumes set mutex held by caller.
+ * @note    Complexity: O(1).
+ */
+void pq_set_push(struct pq_set *aSet, msgindex_t aIndex, int aFront) {
+    struct pq_set_member *const m = &aSet->member[aIndex];
+    const msgprio_t p = m->prio;
+    if (aSet->head[p] == PQ_SET_NIL) {
+        m->next = PQ_SET_NIL;
+        aSet->head[p] = aIndex;
+        aSet->tail[p] = aIndex;
+        aSet->readymask |= 1u << p;
+    }
+    else if (aFront) {
+        m->next = aSet->head[p];
+        aSet->head[p] = aIndex;
+    }
+    else {
+        m->next = PQ_SET_NIL;
+        aSet->member[aSet->tail[p]].next = aIndex;
+        aSet->tail[p] = aIndex;
+    }
+}
+
+/******************************************************************************/
+/*!
+ * Put back a claimed member whose queue could not be locked.
+ * @param   aSet      [in] Set handle.
+ * @param   aIndex    Member index.
+ *
+ * The claim can't be settled without the queue, so the member keeps its
+ * ready flag and goes back to the front of its list, where the next
+ * receiver picks it up.
+ */
+void pq_set_unclaim(struct pq_set *aSet, msgindex_t aIndex) {
+    pthread_mutex_lock(&aSet->mtx);
+    pq_set_push(aSet, aIndex, 1);
+    if (aSet->waiting > 0) {
+        pthread_cond_signal(&aSet->ready);
+    }
+    pthread_mutex_unlock(&aSet->mtx);
+}
+
+/******************************************************************************/
+/*!
+ * Tell the queue's set that the queue is no longer empty.
+ * @param   aQueue      [in] Queue handle.
+ * @return  0           Success.
+ * @return  Otherwise status code of failed pthread call.
+ * @note    Assumes queue mutex held by caller.
+ *
+ * Wakes at most one receiver waiting on the set; that receiver passes the
+ * wakeup on if more members are ready.
+ */
+pq_status_t pq_set_notify(struct pq_queue *aQueue) {
+    struct pq_set *const s = aQueue->set;
+    pq_status_t sc = pthread_mutex_lock(&s->mtx);
+    if (sc != 0) {
+        return sc;
+    }
+    struct pq_set_member *const m = &s->member[aQueue->set_index];
+    if (m->ready == 0) {
+        m->ready = 1;
+        pq_set_push(s, aQueue->set_index, 0);
+        if (s->waiting > 0) {
+            sc = pthread_cond_signal(&s->ready);
+        }
+    }
+    pthread_mutex_unlock(&s->mtx);
+    return sc;
+}
+
+/******************************************************************************/
+/*!
+ * Create a sharded queue of independent lanes.
+ * @param   aShard      [out] Pointer to sharded queue handle.
+ * @param   aAttributes [in] Attributes of each lane.
+ * @param   aLanes      Number of lanes.
+ * @return  0           Success; *aShard was assigned a handle.
+ * @return  EINVAL      Invalid argument, or lanes would be named or
+ *                      persistent.
+ * @return  ENOMEM      Out of memory.
+ * @return  Otherwise error of failed pq_create() or pthread call.
+ *
+ * Each lane is a queue of its own with its own mutex, so threads
+ * working on different lanes do not contend.
+ */
+pq_status_t pq_shard_create(struct pq_shard **aShard, const struct pq_attr *aAttributes, msgindex_t aLanes) {
+    if ((aShard == NULL) || (aAttributes == NULL) || (aLanes == 0)) {
+        return EINVAL;
+    }
+    if ((aAttributes->name != NULL) || (aAttributes->path != NULL)) {
+        return EINVAL;
+    }
+
+    struct pq_shard *const s = malloc(sizeof *s + (aLanes * sizeof *s->lane));
+    if (s == NULL) {
+        return ENOMEM;
+    }
+    s->lanes = 0;
+    s->relaxed = 0;
+    s->next_home = 0;
+    s->waiting_to_send = 0;
+    s->waiting_to_recv = 0;
+    pq_status_t sc = pthread_key_create(&s->home, NULL);
+    if (sc != 0) {
+        free(s);
+        return sc;
+    }
+    sc = pthread_mutex_init(&s->mtx, NULL);
+    if (sc == 0) {
+        sc = pq_cond_init(&s->ready_to_send, 0);
+        if (sc == 0) {
+            sc = pq_cond_init(&s->ready_to_recv, 0);
+            if (sc != 0) {
+                pthread_cond_destroy(&s->ready_to_send);
+            }
+        }
+        if (sc != 0) {
+            pthread_mutex_destroy(&s->mtx);
+        }
+    }
+    if (sc != 0) {
+        pthread_key_delete(s->home);
+        free(s);
+        return sc;
+    }
+    for (; s->lanes < aLanes; ++s->lanes) {
+        sc = pq_create(&s->lane[s->lanes], aAttributes);
+        if (sc != 0) {
+            pq_shard_destroy(s);
+            return sc;
+        }
+    }
+    *aShard = s;
+    return 0;
+}
+
+/******************************************************************************/
+/*!
+ * Destroy a sharded queue and its lanes.
+ * @param   aShard      [in] Sharded queue handle.
+ * @return  0           Success.
+ * @return  EINVAL      Invalid argument.
+ * @return  Otherwise status code of failed pq_destroy() of a lane.
+ */
+pq_status_t pq_shard_destroy(struct pq_shard *aShard) {
+    if (aShard == NULL) {
+        return EINVAL;
+    }
+    pq_status_t sc = 0;
+    for (msgindex_t i = 0; i < aShard->lanes; ++i) {
+        const pq_status_t lane = pq_destroy(aShard->lane[i]);
+        if (sc == 0) {
+            sc = lane;
+        }
+    }
+    pthread_cond_destroy(&aShard->ready_to_recv);
+    pthread_cond_destroy(&aShard->ready_to_send);
+    pthread_mutex_destroy(&aShard->mtx);
+    pthread_key_delete(aShard->home);
+    free(aShard);
+    return sc;
+}
+
+/******************************************************************************/
+/*!
+ * Get the calling thread's home lane of a sharded queue.
+ * @param   aShard      [in] Sharded queue handle.
+ * @return  Lane index.
+ *
+ * Threads get home lanes round robin on first use, so as many threads
+ * as lanes each have a lane to themselves.
+ */
+msgindex_t pq_shard_home(struct pq_shard *aShard) {
+    const uintptr_t home = (uintptr_t) pthread_getspecific(aShard->home);
+    if (home != 0) {
+        return (msgindex_t) (home - 1);
+    }
+    const unsigned lane = __atomic_fetch_add(&aShard->next_home, 1u, __ATOMIC_RELAXED) % aShard->lanes;
+    pthread_setspecific(aShard->home, (void *) (uintptr_t) (lane + 1u));
+    return (msgindex_t) lane;
+}
+
+/******************************************************************************/
+/*!
+ * Send a message to a sharded queue, with timeout.
+ * @param   aShard      [in] Sharded queue handle.
+ * @param   aMessage    [in] Message to send.
+ * @param   aTimeout    How long to wait while all lanes are full.
+ * @return  0           Success.
+ * @return  EAGAIN      All lanes are full and aTimeout is PQ_TIMEOUT_ZERO.
+ * @return  ETIMEDOUT   Operation timed out.
+ * @return  Otherwise error of the lanes' pq_send_nonbl().
+ *
+ * The message goes to the caller's home lane, or if that is full to
+ * the next lane with room.
+ */
+pq_status_t pq_shard_send(struct pq_shard *aShard, const struct pq_msg *aMessage, pq_time_t aTimeout) {
+    if (aShard == NULL) {
+        return EINVAL;
+    }
+    /* Sending only reads the message. */
+    struct pq_msg *const m = (struct pq_msg *) aMessage;
+    pq_status_t sc = pq_shard_try(aShard, m, PQ_OP_SEND);
+    if ((sc == EAGAIN) && (aTimeout != PQ_TIMEOUT_ZERO)) {
+        sc = pq_shard_wait(aShard, m, PQ_OP_SEND, aTimeout);
+    }
+    if (sc == 0) {
+        pq_shard_wake(aShard, &aShard->waiting_to_recv, &aShard->ready_to_recv);
+    }
+    return sc;
+}
+
+/******************************************************************************/
+/*!
+ * Receive a message from a sharded queue, with timeout.
+ * @param   aShard      [in] Sharded queue handle.
+ * @param   aMessage    [out] Message received.
+ * @param   aTimeout    How long to wait while all lanes are empty.
+ * @return  0           Success.
+ * @return  EAGAIN      All lanes are empty and aTimeout is PQ_TIMEOUT_ZERO.
+ * @return  ETIMEDOUT   Operation timed out.
+ * @return  Otherwise error of the lanes' pq_recv_nonbl().
+ *
+ * The message comes from the caller's home lane, or if that is empty it
+ * is stolen from the next lane with messages. Order holds only within a
+ * lane.
+ */
+pq_status_t pq_shard_recv(struct pq_shard *aShard, struct pq_msg *aMessage, pq_time_t aTimeout) {
+    if (aShard == NULL) {
+        return EINVAL;
+    }
+    pq_status_t sc = pq_shard_try(aShard, aMessage, PQ_OP_RECV);
+    if ((sc == EAGAIN) && (aTimeout != PQ_TIMEOUT_ZERO)) {
+        sc = pq_shard_wait(aShard, aMessage, PQ_OP_RECV, aTimeout);
+    }
+    if (sc == 0) {
+        pq_shard_wake(aShard, &aShard->waiting_to_send, &aShard->ready_to_send);
+    }
+    return sc;
+}
+
+/******************************************************************************/
+/*!
+ * Create a relaxed priority queue of independent heaps (a MultiQueue).
+ * @param   aShard      [out] Pointer to sharded queue handle.
+ * @param   aAttributes [in] Attributes of each heap, of order PQ_ATTR_PRIOQ.
+ * @param   aHeaps      Number of heaps, a few per thread.
+ * @return  0           Success; *aShard was assigned a handle.
+ * @return  EINVAL      Invalid argument, or order is not PQ_ATTR_PRIOQ or
+ *                      messages age.
+ * @return  Otherwise error of pq_shard_create().
+ *
+ * Use with pq_shard_send(), pq_shard_recv() and pq_shard_destroy().
+ * Sends go to a random heap; receives compare the tops of two random
+ * heaps and take the higher.
+ */
+pq_status_t pq_multi_create(struct pq_shard **aShard, const struct pq_attr *aAttributes, msgindex_t aHeaps) {
+    if ((aAttributes == NULL) || (aAttributes->order != PQ_ATTR_PRIOQ) || (aAttributes->aging != 0)) {
+        return EINVAL;
+    }
+    pq_status_t sc = pq_shard_create(aShard, aAttributes, aHeaps);
+    if (sc != 0) {
+        return sc;
+    }
+    (*aShard)->relaxed = 1;
+    for (msgindex_t i = 0; i < aHeaps; ++i) {
+        (*aShard)->lane[i]->publish_top = 1;
+    }
+    return 0;
+}
+
+/******************************************************************************/
+/*!
+ * Get a random lane of a sharded queue.
+ * @param   aShard      [in] Sharded queue handle.
+ * @return  Lane index.
+ *
+ * Each thread keeps its xorshift state in the shard's thread-specific
+ * value, so picking lanes shares no cache line between threads.
+ */
+msgindex_t pq_shard_random(struct pq_shard *aShard) {
+    uint32_t x = (uint32_t) (uintptr_t) pthread_getspecific(aShard->home);
+    if (x == 0) {
+        x = (__atomic_add_fetch(&aShard->next_home, 1u, __ATOMIC_RELAXED)) * 0x9e3779b9u;
+    }
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    pthread_setspecific(aShard->home, (void *) (uintptr_t) x);
+    return (msgindex_t) (x % aShard->lanes);
+}
+
+/******************************************************************************/
+/*!
+ * Choose the lane of a sharded queue to try first.
+ * @param   aShard      [in] Sharded queue handle.
+ * @param   aOp         PQ_OP_SEND or PQ_OP_RECV.
+ * @return  Lane index.
+ */
+msgindex_t pq_shard_pick(struct pq_shard *aShard, unsigned aOp) {
+    if (!aShard->relaxed) {
+        return pq_shard_home(aShard);
+    }
+    const msgindex_t i = pq_shard_random(aShard);
+    if (aOp == PQ_OP_SEND) {
+        return i;
+    }
+    /* Two choices: the higher of two tops, read without locking. */
+    const msgindex_t j = pq_shard_random(aShard);
+    msgindex_t fill_i, fill_j;
+    pq_peek_fill(aShard->lane[i], &fill_i);
+    pq_peek_fill(aShard->lane[j], &fill_j);
+    if ((fill_i == 0) || (fill_j == 0)) {
+        return (fill_i == 0) ? j : i;
+    }
+    const msgprio_t top_i = __atomic_load_n(&aShard->lane[i]->top, __ATOMIC_RELAXED);
+    const msgprio_t top_j = __atomic_load_n(&aShard->lane[j]->top, __ATOMIC_RELAXED);
+    return (top_j > top_i) ? j : i;
+}
+
+/******************************************************************************/
+/*!
+ * Publish the priority of a queue's next message for lock-free readers.
+ * @param   aQueue      [in] Queue handle.
+ * @note    Assumes mutex held by caller.
+ */
+void pq_publish_top(struct pq_queue *aQueue) {
+    if (aQueue->publish_top) {
+        const msgprio_t top = (aQueue->fill > 0) ? aQueue->message[pq_next(aQueue)].prio : 0;
+        __atomic_store_n(&aQueue->top, top, __ATOMIC_RELAXED);
+    }
+}
+
+/******************************************************************************/
+/*!
+ * Try each lane of a sharded queue once, starting with pq_shard_pick().
+ * @param   aShard      [in] Sharded queue handle.
+ * @param   aMessage    [inout] Message to send or receive.
+ * @param   aOp         PQ_OP_SEND or PQ_OP_RECV.
+ * @return  0           Success.
+ * @return  EAGAIN      All lanes are full or empty.
+ * @return  Otherwise error of pq_send_nonbl() or pq_recv_nonbl().
+ */
+pq_status_t pq_shard_try(struct pq_shard *aShard, struct pq_msg *aMessage, unsigned aOp) {
+    const msgindex_t first = pq_shard_pick(aShard, aOp);
+    for (msgindex_t n = 0; n < aShard->lanes; ++n) {
+        const msgindex_t i = (msgindex_t) ((first + n) % aShard->lanes);
+        /* Skip lanes at a glance; a racy fill only costs a retry. */
+        msgindex_t fill;
+        pq_peek_fill(aShard->lane[i], &fill);
+        if ((aOp == PQ_OP_RECV) ? (fill == 0) : (fill == aShard->lane[i]->maxmsg)) {
+            continue;
+        }
+        const pq_status_t sc = (aOp == PQ_OP_RECV) ? pq_recv_nonbl(aShard->lane[i], aMessage)
+            : pq_send_nonbl(aShard->lane[i], aMessage);
+        if (sc != EAGAIN) {
+            return sc;
+        }
+    }
+    return EAGAIN;
+}
+
+/******************************************************************************/
+/*!
+ * Wait until some lane of a sharded queue takes or has a message.
+ * @param   aShard      [in] Sharded queue handle.
+ * @param   aMessage    [inout] Message to send or receive.
+ * @param   aOp         PQ_OP_SEND or PQ_OP_RECV.
+ * @param   aTimeout    How long to wait.
+ * @return  0           Success.
+ * @return  ETIMEDOUT   Operation timed out.
+ * @return  Otherwise error of pq_shard_try() or pthread call.
+ *
+ * A waiter counts itself before it tries the lanes again under the
+ * shard's mutex, and the other side reads the count after its lane
+ * operation, so either it sees the waiter or the waiter sees its
+ * message or room.
+ */
+pq_status_t pq_shard_wait(struct pq_shard *aShard, struct pq_msg *aMessage, unsigned aOp, pq_time_t aTimeout) {
+    thrcount_t *const waiting = (aOp == PQ_OP_RECV) ? &aShard->waiting_to_recv : &aShard->waiting_to_send;
+    pthread_cond_t *const cond = (aOp == PQ_OP_RECV) ? &aShard->ready_to_recv : &aShard->ready_to_send;
+    struct timespec deadline;
+    pq_status_t sc = 0;
+    if (aTimeout != PQ_TIMEOUT_INF) {
+        sc = pq_deadline(&deadline, aTimeout);
+        if (sc != 0) {
+            return sc;
+        }
+    }
+    sc = pthread_mutex_lock(&aShard->mtx);
+    if (sc != 0) {
+        return sc;
+    }
+    __atomic_add_fetch(waiting, 1, __ATOMIC_SEQ_CST);
+    while ((sc = pq_shard_try(aShard, aMessage, aOp)) == EAGAIN) {
+        sc = (aTimeout == PQ_TIMEOUT_INF) ? pthread_cond_wait(cond, &aShard->mtx)
+            : pthread_cond_timedwait(cond, &aShard->mtx, &deadline);
+        if (sc != 0) {
+            break;
+        }
+    }
+    __atomic_sub_fetch(waiting, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&aShard->mtx);
+    return sc;
+}
+
+/******************************************************************************/
+/*!
+ * Wake up a waiter of a sharded queue after a lane operation.
+ * @param   aShard      [in] Sharded queue handle.
+ * @param   aWaiting    [in] Count of waiters to wake.
+ * @param   aCond       [in] Condition they wait on.
+ *
+ * Costs one atomic load when nobody waits.
+ */
+void pq_shard_wake(struct pq_shard *aShard, thrcount_t *aWaiting, pthread_cond_t *aCond) {
+    if (__atomic_load_n(aWaiting, __ATOMIC_SEQ_CST) == 0) {
+        return;
+    }
+    pthread_mutex_lock(&aShard->mtx);
+    pthread_cond_signal(aCond);
+    pthread_mutex_unlock(&aShard->mtx);
+}
+
+/******************************************************************************/
+/*!
+ * Remove message depending on order.
+ * @param   aQueue    [in] Queue handle.
+ * @param   aMessage  [out] Message with highest priority.
+ */
+void pq_remove(struct pq_queue *aQueue, struct pq_msg *aMessage) {
+    const msgindex_t next = pq_next(aQueue);
+    const msgoffset_t offset = aQueue->message[next].offset;
+    if (aQueue->index_mask != 0) {
+        struct pq_msg_ex *const ex = (struct pq_msg_ex *) aMessage;
+        ex->key = aQueue->message[next].key;
+        pq_index_remove(aQueue, ex->key);
+    }
+    if (aQueue->aging_ns != 0) {
+        pq_aged(aQueue, next);
+    }
+    switch (aQueue->order) {
+    case PQ_ATTR_PRIFO:
+        pq_remove_prifo(aQueue, aMessage);
+        break;
+    case PQ_ATTR_PRIOQ:
+        if (aQueue->aging_ns != 0) {
+            pq_remove_delay(aQueue, aMessage);
+        }
+        else {
+            pq_remove_prioq(aQueue, aMessage);
+        }
+        break;
+    case PQ_ATTR_FIFO:
+        pq_remove_fifo(aQueue, aMessage);
+        break;
+    case PQ_ATTR_LIFO:
+        pq_remove_lifo(aQueue, aMessage);
+        break;
+    case PQ_ATTR_DELAY:
+        pq_remove_delay(aQueue, aMessage);
+        break;
+    case PQ_ATTR_WFQ:
+        pq_remove_wfq(aQueue, aMessage);
+        break;
+    default:
+        break;
+    }
+    if (aQueue->memory == PQ_MEM_FILE) {
+        pq_journal_clear(aQueue, offset);
+    }
+    pq_publish_top(aQueue);
+}
+
+/******************************************************************************/
+/*!
+ * Insert message depending on order.
+ * @param   aQueue    [in] Queue handle.
+ * @param   aMessage  [in] Message with highest priority.
+ */
+void pq_insert(struct pq_queue *aQueue, const struct pq_msg *aMessage) {
+    /* Every order fills the free slot at tail, free or fill, maybe moving it. */
+    const msgindex_t slot = pq_ring(aQueue) ? aQueue->tail
+        : (aQueue->order == PQ_ATTR_WFQ) ? aQueue->free : aQueue->fill;
+    const msgoffset_t offset = aQueue->message[slot].offset;
+    if (aQueue->handles) {
+        /* New generation for the slot's data block; never 0, so that no
+         * handle is 0. */
+        struct pq_slot *const s = &aQueue->message[slot];
+        uint64_t gen = (((s->key & PQ_HANDLE_MASK) >> 16) + 1u) & 0xffffffffu;
+        gen += (gen == 0);
+        s->key = ((uint64_t) aMessage->prio << 48) | (gen << 16) | (s->key & 0xffffu);
+        const struct pq_msg_ex *const ex = (const struct pq_msg_ex *) aMessage;
+        if (ex->handle != NULL) {
+            *ex->handle = s->key & PQ_HANDLE_MASK;
+        }
+    }
+    switch (aQueue->order) {
+    case PQ_ATTR_PRIFO:
+        pq_insert_prifo(aQueue, aMessage);
+        break;
+    case PQ_ATTR_PRIOQ:
+        if (aQueue->aging_ns != 0) {
+            pq_insert_delay(aQueue, aMessage);
+        }
+        else {
+            pq_insert_prioq(aQueue, aMessage);
+        }
+        break;
+    case PQ_ATTR_FIFO:
+        pq_insert_fifo(aQueue, aMessage);
+        break;
+    case PQ_ATTR_LIFO:
+        pq_insert_lifo(aQueue, aMessage);
+        break;
+    case PQ_ATTR_DELAY:
+        pq_insert_delay(aQueue, aMessage);
+        break;
+    case PQ_ATTR_WFQ:
+        pq_insert_wfq(aQueue, aMessage);
+        break;
+    default:
+        break;
+    }
+    if (aQueue->memory == PQ_MEM_FILE) {
+        pq_journal_write(aQueue, offset, aMessage);
+    }
+    if (aQueue->index_mask != 0) {
+        /* Conflating queues are FIFO; the message stays at slot. */
+        const uint64_t key = ((const struct pq_msg_ex *) aMessage)->key;
+        aQueue->message[slot].key = key;
+        pq_index(aQueue)[pq_index_probe(aQueue, key)] = slot;
+    }
+    pq_publish_top(aQueue);
+}
+
+/******************************************************************************/
+/*!
+ * Remove message from message heap.
+ * @param   aQueue    [in] Queue handle.
+ * @param   aMessage  [out] Message with highest priority.
+ * @note    Assumes queue is not empty.
+ * @note    Assumes mutex held by caller.
+ * @note    Complexity: O(log N).
+ */
+void pq_remove_prioq(struct pq_queue *aQueue, struct pq_msg *const aMessage) {
+    assert(aQueue->fill > 0);
+    struct pq_slot *const message = aQueue->message;
+
+    aMessage->size = message[0].size;
+    aMessage->prio = message[0].prio;
+    memcpy(aMessage->msg, pq_data(aQueue, 0), message[0].size);
+
+    const msgindex_t last = aQueue->fill - 1;
+    pq_set_fill(aQueue, last);
+    if (last == 0) {
+        return;
+    }
+    pq_swap(aQueue, 0, last);
+    message[last].prio = 0;
+    if (pq_minmax(aQueue)) {
+        pq_minmax_fix(aQueue, 0);
+        return;
+    }
+    /* Restore heap order. */
+    msgindex_t i = 0;
+    while (((2 * i) + 1) < last) {
+        const msgindex_t l = (2 * i) + 1;
+        const msgindex_t r = (2 * i) + 2;
+        const msgindex_t j = (message[l].prio > message[r].prio) ? l : r;
+        if (message[i].prio >= message[j].prio) {
+            break;
+        }
+        pq_swap(aQueue, i, j);
+        i = j;
+    }
+}
+
+/******************************************************************************/
+/*!
+ * Insert message into message heap.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aMessage    [in] Message to insert.
+ * @note    Assumes queue is not full.
+ * @note    Assumes mutex held by caller.
+ * @note    Complexity: O(log N).
+ */
+void pq_insert_prioq(struct pq_queue *aQueue, const struct pq_msg *aMessage) {
+    assert(aQueue->fill < aQueue->maxmsg);
+    struct pq_slot *const message = aQueue->message;
+
+    msgindex_t i = aQueue->fill;
+    message[i].size = aMessage->size;
+    message[i].prio = aMessage->prio;
+    message[i].expires = pq_expires(aQueue, aMessage);
+    memcpy(pq_data(aQueue, i), aMessage->msg, aMessage->size);
+    pq_set_fill(aQueue, i + 1);
+    if (pq_minmax(aQueue)) {
+        pq_minmax_fix(aQueue, i);
+        return;
+    }
+    while ((i > 0) && (message[(i - 1) / 2].prio < message[i].prio)) {
+        const msgindex_t j = (i - 1) / 2;
+        pq_swap(aQueue, i, j);
+        i = j;
+    }
+}
+
+/******************************************************************************/
+/*!
+ * Insert message into message fifo.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aMessage    [in] Message to insert.
+ * @note    Assumes queue is not full.
+ * @note    Assumes mutex held by caller.
+ * @note    Complexity: O(1).
+ */
+void pq_insert_fifo(struct pq_queue *aQueue, const struct pq_msg *aMessage) {
+    assert(aQueue->fill < aQueue->maxmsg);
+    struct pq_slot *const message = aQueue->message;
+
+    const msgindex_t i = aQueue->tail++;
+    message[i].size = aMessage->size;
+    message[i].prio = aMessage->prio;
+    message[i].expires = pq_expires(aQueue, aMessage);
+    memcpy(pq_data(aQueue, i), aMessage->msg, aMessage->size);
+    if (aQueue->tail == aQueue->maxmsg) {
+        aQueue->tail = 0;
+    }
+    pq_set_fill(aQueue, aQueue->fill + 1);
+}
+
+/******************************************************************************/
+/*!
+ * Insert message into message array in FIFO order.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aMessage    [in] Message to insert.
+ * @note    Assumes queue is not full.
+ * @note    Assumes mutex held by caller.
+ * @note    Complexity: O(N).
+ *
+ * Find index where to insert into array.
+ * That's the index of the first message with greater or equal priority.
+ * This message and all higher-ups need to rotate up one index to make
+ * room for the new message.
+ */
+void pq_insert_prifo(struct pq_queue *aQueue, const struct pq_msg *aMessage) {
+    assert(aQueue->fill < aQueue->maxmsg);
+    struct pq_slot *const message = aQueue->message;
+
+    /* Find index where to insert. */
+    msgindex_t insert;
+    uint64_t due = 0;
+    if (aQueue->aging_ns != 0) {
+        /* By aging key instead, which is smaller for higher priority. */
+        due = pq_aged_due(aQueue, aMessage->prio);
+        for (insert = 0; insert < aQueue->fill; ++insert) {
+            if (message[insert].due <= due) {
+                break;
+            }
+        }
+    }
+    else {
+        for (insert = 0; insert < aQueue->fill; ++insert) {
+            if (message[insert].prio >= aMessage->prio) {
+                break;
+            }
+        }
+    }
+
+    /* Rotation required? */
+    const msgindex_t rotate = aQueue->fill - insert;
+    if (rotate != 0) {
+        const msgoffset_t tmp = message[insert + rotate].offset;
+        struct pq_slot *const src = &message[insert];
+        struct pq_slot *const dst = &message[insert + 1];
+        memmove(dst, src, rotate * sizeof *src);
+        message[insert].offset = tmp;
+    }
+
+    /* Insert message. */
+    message[insert].prio = aMessage->prio;
+    message[insert].due = due;
+    message[insert].expires = pq_expires(aQueue, aMessage);
+    message[insert].size = aMessage->size;
+    memcpy(pq_data(aQueue, insert), aMessage->msg, aMessage->size);
+    pq_set_fill(aQueue, aQueue->fill + 1);
+}
+
+/******************************************************************************/
+/*!
+ * Insert a message to queue in LIFO order (push onto stack).
+ * @param   aQueue    [in] Queue handle.
+ * @param   aMessage  [out] Message to push.
+ * @note    Assumes stack is not empty.
+ * @note    Assumes mutex held by caller.
+ * @note    Complexity: O(1).
+ *
+ * The stack is a ring like a FIFO queue, from the oldest message at head
+ * to the top below tail, so that the oldest can be dropped in O(1).
+ */
+void pq_insert_lifo(struct pq_queue *aQueue, const struct pq_msg *aMessage) {
+    assert(aQueue->fill < aQueue->maxmsg);
+    struct pq_slot *const message = aQueue->message;
+
+    const msgindex_t i = aQueue->tail++;
+    if (aQueue->tail == aQueue->maxmsg) {
+        aQueue->tail = 0;
+    }
+    pq_set_fill(aQueue, aQueue->fill + 1);
+    message[i].prio = aMessage->prio;
+    message[i].expires = pq_expires(aQueue, aMessage);
+    message[i].size = aMessage->size;
+    memcpy(pq_data(aQueue, i), aMessage->msg, aMessage->size);
+}
+
+/******************************************************************************/
+/*!
+ * Remove message from message priority queue, plus FIFO.
+ * @param   aQueue    [in] Queue handle.
+ * @param   aMessage  [out] Message with highest priority.
+ * @note    Assumes queue is not empty.
+ * @note    Assumes mutex held by caller.
+ * @note    Complexity: O(1).
+ */
+void pq_remove_prifo(struct pq_queue *aQueue, struct pq_msg *const aMessage) {
+    assert(aQueue->fill > 0);
+    struct pq_slot *const message = aQueue->message;
+
+    const msgindex_t i = aQueue->fill - 1;
+    pq_set_fill(aQueue, i);
+    aMessage->size = message[i].size;
+    aMessage->prio = message[i].prio;
+    memcpy(aMessage->msg, pq_data(aQueue, i), aMessage->size);
+}
+
+/******************************************************************************/
+/*!
+ * Remove message from message array.
+ * @param   aQueue    [in] Queue handle.
+ * @param   aMessage  [out] Message with highest priority.
+ * @note    Assumes queue is not empty.
+ * @note    Assumes mutex held by caller.
+ * @note    Complexity: O(1).
+ */
+void pq_remove_fifo(struct pq_queue *aQueue, struct pq_msg *const aMessage) {
+    assert(aQueue->fill > 0);
+    struct pq_slot *const message = aQueue->message;
+
+    const msgindex_t i = aQueue->head;
+    ++aQueue->head;
+    if (aQueue->head == aQueue->maxmsg) {
+        aQueue->head = 0;
+    }
+    aMessage->size = message[i].size;
+    aMessage->prio = message[i].prio;
+    memcpy(aMessage->msg, pq_data(aQueue, i), aMessage->size);
+    pq_set_fill(aQueue, aQueue->fill - 1);
+}
+
+/******************************************************************************/
+/*!
+ * Remove a message from queue in LIFO order (pop stack).
+ * @param   aQueue    [in] Queue handle.
+ * @param   aMessage  [out] Message on top of stack.
+ * @note    Assumes stack is not empty.
+ * @note    Assumes mutex held by caller.
+ * @note    Complexity: O(1).
+ */
+void pq_remove_lifo(struct pq_queue *aQueue, struct pq_msg *const aMessage) {
+    assert(aQueue->fill > 0);
+    struct pq_slot *const message = aQueue->message;
+
+    const msgindex_t i = pq_next(aQueue);
+    aQueue->tail = i;
+    pq_set_fill(aQueue, aQueue->fill - 1);
+    aMessage->size = message[i].size;
+    aMessage->prio = message[i].prio;
+    memcpy(aMessage->msg, pq_data(aQueue, i), aMessage->size);
+}
+
+
+/******************************************************************************/
+/*!
+ * Insert message into min-heap of due times.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aMessage    [in] Message to insert.
+ * @note    Assumes queue is not full.
+ * @note    Assumes mutex held by caller.
+ * @note    Complexity: O(log N), O(1) on average for random due times.
+ *
+ * An aging PRIOQ queue uses the same heap with aging keys as due times.
+ */
+void pq_insert_delay(struct pq_queue *aQueue, const struct pq_msg *aMessage) {
+    assert(aQueue->fill < aQueue->maxmsg);
+    struct pq_slot *const message = aQueue->message;
+
+    msgindex_t i = aQueue->fill;
+    message[i].size = aMessage->size;
+    message[i].prio = aMessage->prio;
+    message[i].expires = pq_expires(aQueue, aMessage);
+    message[i].due = (aQueue->order == PQ_ATTR_DELAY) ? pq_ns(&((const struct pq_msg_ex *) aMessage)->due)
+        : pq_aged_due(aQueue, aMessage->prio);
+    memcpy(pq_data(aQueue, i), aMessage->msg, aMessage->size);
+    pq_set_fill(aQueue, i + 1);
+    while ((i > 0) && (message[(i - 1) / 2].due > message[i].due)) {
+        const msgindex_t j = (i - 1) / 2;
+        pq_swap(aQueue, i, j);
+        i = j;
+    }
+}
+
+/******************************************************************************/
+/*!
+ * Remove message with earliest due time from min-heap.
+ * @param   aQueue    [in] Queue handle.
+ * @param   aMessage  [out] Message due first.
+ * @note    Assumes queue is not empty.
+ * @note    Assumes mutex held by caller.
+ * @note    Complexity: O(log N).
+ */
+void pq_remove_delay(struct pq_queue *aQueue, struct pq_msg *const aMessage) {
+    assert(aQueue->fill > 0);
+    struct pq_slot *const message = aQueue->message;
+
+    aMessage->size = message[0].size;
+    aMessage->prio = message[0].prio;
+    if (aQueue->order == PQ_ATTR_DELAY) {
+        pq_timespec(&((struct pq_msg_ex *) aMessage)->due, message[0].due);
+    }
+    memcpy(aMessage->msg, pq_data(aQueue, 0), message[0].size);
+
+    const msgindex_t last = aQueue->fill - 1;
+    pq_set_fill(aQueue, last);
+    if (last == 0) {
+        return;
+    }
+    pq_swap(aQueue, 0, last);
+    /* Restore heap order. */
+    msgindex_t i = 0;
+    while (((2 * i) + 1) < last) {
+        const msgindex_t l = (2 * i) + 1;
+        const msgindex_t r = (2 * i) + 2;
+        const msgindex_t j = ((r < last) && (message[r].due < message[l].due)) ? r : l;
+        if (message[i].due <= message[j].due) {
+            break;
+        }
+        pq_swap(aQueue, i, j);
+        i = j;
+    }
+}
+
+/******************************************************************************/
+/*!
+ * Insert message into the FIFO of its class in a WFQ queue.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aMessage    [in] Message to insert.
+ * @note    Assumes queue is not full.
+ * @note    Assumes mutex held by caller.
+ * @note    Complexity: O(1).
+ *
+ * Slots never move; each class links its slots from head to tail, and
+ * free slots are linked from aQueue->free.
+ */
+void pq_insert_wfq(struct pq_queue *aQueue, const struct pq_msg *aMessage) {
+    assert(aQueue->fill < aQueue->maxmsg);
+    struct pq_slot *const message = aQueue->message;
+    msgindex_t *const link = pq_index(aQueue);
+    struct pq_class *const cls = &pq_classes(aQueue)[aMessage->prio];
+
+    const msgindex_t i = aQueue->free;
+    aQueue->free = link[i];
+    message[i].size = aMessage->size;
+    message[i].prio = aMessage->prio;
+    message[i].expires = pq_expires(aQueue, aMessage);
+    memcpy(pq_data(aQueue, i), aMessage->msg, aMessage->size);
+    link[i] = PQ_INDEX_NIL;
+    if (cls->head == PQ_INDEX_NIL) {
+        cls->head = i;
+        cls->tail = i;
+        /* Its quantum covers the message if it becomes the head class. */
+        pq_wfq_activate(aQueue, aMessage->prio);
+    }
+    else {
+        link[cls->tail] = i;
+        cls->tail = i;
+    }
+    pq_set_fill(aQueue, aQueue->fill + 1);
+}
+
+/******************************************************************************/
+/*!
+ * Remove message by deficit round robin over the classes of a WFQ queue.
+ * @param   aQueue    [in] Queue handle.
+ * @param   aMessage  [out] Head message of the head active class.
+ * @note    Assumes queue is not empty.
+ * @note    Assumes mutex held by caller.
+ * @note    Complexity: O(1).
+ *
+ * The head class pays for the message from its deficit and keeps its
+ * turn while the deficit covers its next message.
+ */
+void pq_remove_wfq(struct pq_queue *aQueue, struct pq_msg *const aMessage) {
+    assert(aQueue->fill > 0);
+    struct pq_slot *const message = aQueue->message;
+    struct pq_class *const cls = &pq_classes(aQueue)[aQueue->active_head];
+
+    const msgindex_t i = cls->head;
+    aMessage->size = message[i].size;
+    aMessage->prio = message[i].prio;
+    memcpy(aMessage->msg, pq_data(aQueue, i), message[i].size);
+    cls->deficit -= pq_wfq_cost(aQueue, i);
+    pq_wfq_unlink(aQueue, i, PQ_INDEX_NIL);
+}
+
+/******************************************************************************/
+/*!
+ * Check whether a message can be removed now, discarding expired messages
+ * that would be removed first.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aDue        [out] If not, the due time in ns of the earliest
+ *                      pending message, or 0 if the queue is empty.
+ * @return  Nonzero if a message can be removed.
+ * @note    Assumes mutex held by caller.
+ */
+int pq_receivable(struct pq_queue *aQueue, uint64_t *aDue) {
+    *aDue = 0;
+    msgindex_t expired = 0;
+    uint64_t now = 0;
+    while (aQueue->fill > 0) {
+        const uint64_t expires = aQueue->message[pq_next(aQueue)].expires;
+        if (expires == 0) {
+            break;
+        }
+        if (now == 0) {
+            now = pq_now_ns();
+        }
+        if (expires > now) {
+            break;
+        }
+        pq_delete_at(aQueue, pq_next(aQueue));
+        ++expired;
+    }
+    pq_expired(aQueue, expired);
+    if (aQueue->fill == 0) {
+        return 0;
+    }
+    if (aQueue->order != PQ_ATTR_DELAY) {
+        return 1;
+    }
+    const uint64_t due = aQueue->message[0].due;
+    if (due <= pq_now_ns()) {
+        return 1;
+    }
+    *aDue = due;
+    return 0;
+}
+
+/******************************************************************************/
+/*!
+ * Get index of the message pq_remove() would remove next.
+ * @param   aQueue      [in] Queue handle.
+ * @return  Slot index.
+ * @note    Assumes queue is not empty.
+ */
+msgindex_t pq_next(const struct pq_queue *aQueue) {
+    switch (aQueue->order) {
+    case PQ_ATTR_FIFO:
+        return aQueue->head;
+    case PQ_ATTR_LIFO:
+        return (aQueue->tail == 0) ? (msgindex_t) (aQueue->maxmsg - 1) : (msgindex_t) (aQueue->tail - 1);
+    case PQ_ATTR_PRIOQ:
+    case PQ_ATTR_DELAY:
+        return 0;
+    case PQ_ATTR_WFQ:
+        return pq_classes(aQueue)[aQueue->active_head].head;
+    default:
+        return aQueue->fill - 1;
+    }
+}
+
+/******************************************************************************/
+/*!
+ * Compute when a message being inserted expires.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aMessage    [in] Message.
+ * @return  CLOCK_MONOTONIC time in ns, or 0 for never.
+ *
+ * The ttl member is only read from queues created with ttl set, so
+ * callers that leave it unset are not affected.
+ */
+uint64_t pq_expires(const struct pq_queue *aQueue, const struct pq_msg *aMessage) {
+    if (!aQueue->ttl) {
+        return 0;
+    }
+    const pq_time_t ttl = ((const struct pq_msg_ex *) aMessage)->ttl;
+    return (ttl == 0) ? 0 : pq_now_ns() + (((uint64_t) ttl * 1000000000u) / PQ_TIMEOUT_RESOLUTION);
+}
+
+/******************************************************************************/
+/*!
+ * Find when the first of a queue's messages expires.
+ * @param   aQueue      [in] Queue handle.
+ * @return  CLOCK_MONOTONIC time in ns, or 0 if no message expires.
+ * @note    Assumes mutex held by caller.
+ * @note    Complexity: O(N), only paid by senders about to wait.
+ */
+uint64_t pq_first_expiry(const struct pq_queue *aQueue) {
+    const msgindex_t slots = (aQueue->order == PQ_ATTR_WFQ) ? aQueue->maxmsg : aQueue->fill;
+    uint64_t first = 0;
+    for (msgindex_t k = 0; k < slots; ++k) {
+        const msgindex_t i = pq_ring(aQueue) ? (msgindex_t) ((aQueue->head + k) % aQueue->maxmsg) : k;
+        const uint64_t expires = aQueue->message[i].expires;
+        if ((expires != 0) && ((first == 0) || (expires < first))) {
+            first = expires;
+        }
+    }
+    return first;
+}
+
+/******************************************************************************/
+/*!
+ * Account for discarded expired messages.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aCount      Number of messages discarded.
+ * @note    Assumes mutex held by caller.
+ *
+ * Their slots are free now; wake up senders waiting for one.
+ */
+void pq_expired(struct pq_queue *aQueue, msgindex_t aCount) {
+    if (aCount == 0) {
+        return;
+    }
+    aQueue->stats.expired += aCount;
+    pq_wake_senders(aQueue, aCount);
+}
+
+/******************************************************************************/
+/*!
+ * Check whether a queue is full for a message, reclaiming slots of
+ * expired messages.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aPrio       Priority of message.
+ * @return  Nonzero if full, up to the slots reserved for the priority.
+ * @note    Assumes mutex held by caller.
+ */
+int pq_full(struct pq_queue *aQueue, msgprio_t aPrio) {
+    const msgindex_t limit = pq_limit(aQueue, aPrio);
+    if (aQueue->fill < limit) {
+        return 0;
+    }
+    uint64_t due;
+    pq_receivable(aQueue, &due);
+    if (aQueue->ttl && (aQueue->fill >= limit)) {
+        pq_purge(aQueue, PQ_PURGE_STEP);
+    }
+    return aQueue->fill >= limit;
+}
+
+/******************************************************************************/
+/*!
+ * Get how many messages a queue may hold when a message is admitted.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aPrio       Priority of message.
+ * @return  maxmsg less the slots reserved for higher priorities.
+ * @note    Complexity: O(1), at most PQ_BANDS steps.
+ */
+msgindex_t pq_limit(const struct pq_queue *aQueue, msgprio_t aPrio) {
+    for (unsigned b = 0; b < aQueue->bands; ++b) {
+        if (aPrio < aQueue->band_prio[b]) {
+            return aQueue->band_limit[b];
+        }
+    }
+    return aQueue->maxmsg;
+}
+
+/******************************************************************************/
+/*!
+ * Set up the admission limits of a queue's priority bands.
+ * @param   aQueue      [inout] Queue handle.
+ * @param   aAttributes [in] Queue attributes.
+ *
+ * Bands are sorted by priority. A message below a band's priority may
+ * not use the slots reserved by that band or any higher one, so each
+ * band's limit is the lowest of its own and those of higher bands.
+ */
+void pq_bands_init(struct pq_queue *aQueue, const struct pq_attr *aAttributes) {
+    aQueue->bands = 0;
+    for (unsigned i = 0; i < PQ_BANDS; ++i) {
+        const struct pq_band *const band = &aAttributes->bands[i];
+        if (band->percent == 0) {
+            continue;
+        }
+        const msgindex_t limit = (msgindex_t) (aQueue->maxmsg - ((aQueue->maxmsg * (uint32_t) band->percent) / 100u));
+        unsigned b = aQueue->bands++;
+        while ((b > 0) && (aQueue->band_prio[b - 1] > band->prio)) {
+            aQueue->band_prio[b] = aQueue->band_prio[b - 1];
+            aQueue->band_limit[b] = aQueue->band_limit[b - 1];
+            --b;
+        }
+        aQueue->band_prio[b] = band->prio;
+        aQueue->band_limit[b] = limit;
+    }
+    for (unsigned b = aQueue->bands; b-- > 1;) {
+        if (aQueue->band_limit[b] < aQueue->band_limit[b - 1]) {
+            aQueue->band_limit[b - 1] = aQueue->band_limit[b];
+        }
+    }
+}
+
+/******************************************************************************/
+/*!
+ * Decide what to do with a message to send, according to the queue's full
+ * policy.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aMessage    [in] Message to send.
+ * @return  PQ_ADMIT_INSERT  There is room, maybe after evicting a message.
+ * @return  PQ_ADMIT_FULL    Queue is full; reject or wait.
+ * @return  PQ_ADMIT_DROP    Drop the message.
+ * @note    Assumes mutex held by caller.
+ */
+unsigned pq_admit(struct pq_queue *aQueue, const struct pq_msg *aMessage) {
+    if (!pq_full(aQueue, aMessage->prio)) {
+        return PQ_ADMIT_INSERT;
+    }
+    switch (aQueue->full) {
+    case PQ_FULL_DROP_OLDEST:
+        pq_delete_at(aQueue, aQueue->head);
+        ++aQueue->stats.overwritten;
+        return PQ_ADMIT_INSERT;
+    case PQ_FULL_DROP_LOWEST:{
+            const msgindex_t i = pq_lowest(aQueue);
+            if (aQueue->message[i].prio >= aMessage->prio) {
+                ++aQueue->stats.dropped;
+                return PQ_ADMIT_DROP;
+            }
+            pq_delete_at(aQueue, i);
+            ++aQueue->stats.evicted;
+            return PQ_ADMIT_INSERT;
+        }
+    case PQ_FULL_DROP_NEW:
+        ++aQueue->stats.dropped;
+        return PQ_ADMIT_DROP;
+    default:
+        return PQ_ADMIT_FULL;
+    }
+}
+
+/******************************************************************************/
+/*!
+ * Find a message with the lowest priority in a priority queue.
+ * @param   aQueue      [in] Queue handle of order PQ_ATTR_PRIOQ or PQ_ATTR_PRIFO.
+ * @return  Slot index.
+ * @note    Assumes queue is not empty.
+ * @note    Complexity: O(1).
+ *
+ * PRIFO keeps the lowest priority at index 0. A PRIOQ queue evicting the
+ * lowest priority is a min-max heap, with the lowest at index 1 or 2.
+ */
+msgindex_t pq_lowest(const struct pq_queue *aQueue) {
+    if ((aQueue->order == PQ_ATTR_PRIFO) || (aQueue->fill == 1)) {
+        return 0;
+    }
+    if ((aQueue->fill == 2) || (aQueue->message[1].prio <= aQueue->message[2].prio)) {
+        return 1;
+    }
+    return 2;
+}
+
+/******************************************************************************/
+/*!
+ * Check whether a queue keeps its messages in a ring from head to tail.
+ * @param   aQueue      [in] Queue handle.
+ * @return  Nonzero for orders PQ_ATTR_FIFO and PQ_ATTR_LIFO.
+ */
+int pq_ring(const struct pq_queue *aQueue) {
+    return (aQueue->order == PQ_ATTR_FIFO) || (aQueue->order == PQ_ATTR_LIFO);
+}
+
+/******************************************************************************/
+/*!
+ * Check a full policy against the queue's order.
+ * @param   aAttributes [in] Queue attributes.
+ * @return  Nonzero if invalid.
+ */
+int pq_full_policy_invalid(const struct pq_attr *aAttributes) {
+    const msgorder_t order = aAttributes->order;
+    switch (aAttributes->full) {
+    case PQ_FULL_REJECT:
+    case PQ_FULL_DROP_NEW:
+        return 0;
+    case PQ_FULL_DROP_OLDEST:
+        return (order != PQ_ATTR_FIFO) && (order != PQ_ATTR_LIFO);
+    case PQ_FULL_DROP_LOWEST:
+        /* Aging ranks by effective priority, which eviction can't see. */
+        return ((order != PQ_ATTR_PRIOQ) && (order != PQ_ATTR_PRIFO)) || (aAttributes->aging != 0);
+    default:
+        return 1;
+    }
+}
+
+/******************************************************************************/
+/*!
+ * Discard expired messages anywhere in a queue, a few slots at a time.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aSteps      Max number of slots to look at.
+ * @note    Assumes mutex held by caller.
+ *
+ * Each call continues where the last one stopped, so a queue full of
+ * expired messages is reclaimed with bounded work per call and no
+ * background thread.
+ */
+void pq_purge(struct pq_queue *aQueue, msgindex_t aSteps) {
+    const uint64_t now = pq_now_ns();
+    msgindex_t expired = 0;
+    for (msgindex_t step = 0; (step < aSteps) && (aQueue->fill > 0); ++step) {
+        /* Slots of a WFQ queue are spread out; free ones never expire. */
+        if (aQueue->purge >= ((aQueue->order == PQ_ATTR_WFQ) ? aQueue->maxmsg : aQueue->fill)) {
+            aQueue->purge = 0;
+        }
+        const msgindex_t i = pq_ring(aQueue)
+            ? (msgindex_t) ((aQueue->head + aQueue->purge) % aQueue->maxmsg) : aQueue->purge;
+        const uint64_t expires = aQueue->message[i].expires;
+        if ((expires != 0) && (expires <= now)) {
+            pq_delete_at(aQueue, i);
+            ++expired;
+        }
+        else {
+            ++aQueue->purge;
+        }
+    }
+    pq_expired(aQueue, expired);
+}
+
+/******************************************************************************/
+/*!
+ * Delete the message at any slot index, keeping the order's invariants.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aIndex      Slot index of message.
+ * @note    Assumes mutex held by caller.
+ * @note    Complexity: O(log N) for heaps, O(1) for the oldest message of
+ *          FIFO and LIFO queues, O(N) otherwise.
+ */
+void pq_delete_at(struct pq_queue *aQueue, msgindex_t aIndex) {
+    struct pq_slot *const message = aQueue->message;
+    const msgoffset_t offset = message[aIndex].offset;
+    const msgindex_t last = aQueue->fill - 1;
+
+    if (aQueue->index_mask != 0) {
+        pq_index_remove(aQueue, message[aIndex].key);
+    }
+    switch (aQueue->order) {
+    case PQ_ATTR_PRIOQ:
+    case PQ_ATTR_DELAY:
+        pq_set_fill(aQueue, last);
+        if (aIndex != last) {
+            pq_swap(aQueue, aIndex, last);
+            pq_heap_fix(aQueue, aIndex);
+        }
+        break;
+    case PQ_ATTR_WFQ:{
+            const msgindex_t *const link = pq_index(aQueue);
+            msgindex_t prev = PQ_INDEX_NIL;
+            for (msgindex_t i = pq_classes(aQueue)[message[aIndex].prio].head; i != aIndex; i = link[i]) {
+                prev = i;
+            }
+            pq_wfq_unlink(aQueue, aIndex, prev);
+            break;
+        }
+    case PQ_ATTR_FIFO:
+    case PQ_ATTR_LIFO:{
+            /* Shift the older messages one slot towards the tail. */
+            msgindex_t i = aIndex;
+            while (i != aQueue->head) {
+                const msgindex_t prev = (i == 0) ? (msgindex_t) (aQueue->maxmsg - 1) : (msgindex_t) (i - 1);
+                message[i] = message[prev];
+                if (aQueue->index_mask != 0) {
+                    pq_index(aQueue)[pq_index_probe(aQueue, message[i].key)] = i;
+                }
+                i = prev;
+            }
+            message[i].offset = offset;
+            aQueue->head = (aQueue->head + 1u == aQueue->maxmsg) ? 0 : (msgindex_t) (aQueue->head + 1u);
+            pq_set_fill(aQueue, last);
+            break;
+        }
+    default:
+        memmove(&message[aIndex], &message[aIndex + 1], (size_t) (last - aIndex) * sizeof *message);
+        message[last].offset = offset;
+        pq_set_fill(aQueue, last);
+        break;
+    }
+    if (aQueue->memory == PQ_MEM_FILE) {
+        pq_journal_clear(aQueue, offset);
+    }
+    pq_publish_top(aQueue);
+}
+
+/******************************************************************************/
+/*!
+ * Check whether one heap slot belongs above another.
+ * @param   aQueue      [in] Queue handle of order PQ_ATTR_PRIOQ or PQ_ATTR_DELAY.
+ * @param   aFirst      Slot index.
+ * @param   aSecond     Slot index.
+ * @return  Nonzero if aFirst must not be below aSecond.
+ */
+int pq_heap_above(const struct pq_queue *aQueue, msgindex_t aFirst, msgindex_t aSecond) {
+    const struct pq_slot *const message = aQueue->message;
+    if ((aQueue->order == PQ_ATTR_DELAY) || (aQueue->aging_ns != 0)) {
+        return message[aFirst].due < message[aSecond].due;
+    }
+    return message[aFirst].prio > message[aSecond].prio;
+}
+
+/******************************************************************************/
+/*!
+ * Restore heap order after the slot at an index changed.
+ * @param   aQueue      [in] Queue handle of order PQ_ATTR_PRIOQ or PQ_ATTR_DELAY.
+ * @param   aIndex      Slot index.
+ * @note    Complexity: O(log N).
+ */
+void pq_heap_fix(struct pq_queue *aQueue, msgindex_t aIndex) {
+    if (pq_minmax(aQueue)) {
+        pq_minmax_fix(aQueue, aIndex);
+        return;
+    }
+    msgindex_t i = aIndex;
+    while ((i > 0) && pq_heap_above(aQueue, i, (i - 1) / 2)) {
+        const msgindex_t j = (i - 1) / 2;
+        pq_swap(aQueue, i, j);
+        i = j;
+    }
+    for (;;) {
+        const msgindex_t l = (2 * i) + 1;
+        const msgindex_t r = (2 * i) + 2;
+        msgindex_t j = i;
+        if ((l < aQueue->fill) && pq_heap_above(aQueue, l, j)) {
+            j = l;
+        }
+        if ((r < aQueue->fill) && pq_heap_above(aQueue, r, j)) {
+            j = r;
+        }
+        if (j == i) {
+            break;
+        }
+        pq_swap(aQueue, i, j);
+        i = j;
+    }
+}
+
+/******************************************************************************/
+/*!
+ * Check whether a queue's heap is a min-max heap.
+ * @param   aQueue      [in] Queue handle.
+ * @return  Nonzero for a PRIOQ queue evicting the lowest priority.
+ *
+ * Even levels, starting with the root, hold the highest priority of their
+ * subtree and odd levels the lowest, so both ends are found in O(1).
+ */
+int pq_minmax(const struct pq_queue *aQueue) {
+    return (aQueue->order == PQ_ATTR_PRIOQ) && (aQueue->full == PQ_FULL_DROP_LOWEST);
+}
+
+/******************************************************************************/
+/*!
+ * Check whether a min-max heap slot is on a max level.
+ * @param   aIndex      Slot index.
+ * @return  Nonzero for a max level.
+ */
+int pq_minmax_level(msgindex_t aIndex) {
+    unsigned level = 0;
+    for (uint32_t i = aIndex + 1u; i > 1; i >>= 1) {
+        ++level;
+    }
+    return (level & 1u) == 0;
+}
+
+/******************************************************************************/
+/*!
+ * Compare two min-max heap slots in the sense of a level.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aFirst      Slot index.
+ * @param   aSecond     Slot index.
+ * @param   aMax        Nonzero for a max level.
+ * @return  Nonzero if aFirst belongs strictly above aSecond on such levels.
+ */
+int pq_minmax_above(const struct pq_queue *aQueue, msgindex_t aFirst, msgindex_t aSecond, int aMax) {
+    const struct pq_slot *const message = aQueue->message;
+    return aMax ? (message[aFirst].prio > message[aSecond].prio) : (message[aFirst].prio < message[aSecond].prio);
+}
+
+/******************************************************************************/
+/*!
+ * Move a min-max heap slot up through the levels of its kind.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aIndex      Slot index.
+ * @param   aMax        Nonzero if aIndex is on a max level.
+ * @return  Final slot index.
+ */
+msgindex_t pq_minmax_up(struct pq_queue *aQueue, msgindex_t aIndex, int aMax) {
+    msgindex_t i = aIndex;
+    while (i > 2) {
+        const msgindex_t g = (msgindex_t) ((((i - 1u) / 2u) - 1u) / 2u);
+        if (!pq_minmax_above(aQueue, i, g, aMax)) {
+            break;
+        }
+        pq_swap(aQueue, i, g);
+        i = g;
+    }
+    return i;
+}
+
+/******************************************************************************/
+/*!
+ * Move a min-max heap slot down below its children and grandchildren.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aIndex      Slot index.
+ */
+void pq_minmax_down(struct pq_queue *aQueue, msgindex_t aIndex) {
+    const int max = pq_minmax_level(aIndex);
+    const uint32_t fill = aQueue->fill;
+    msgindex_t i = aIndex;
+    for (;;) {
+        const uint32_t first = (2u * i) + 1u;
+        msgindex_t m = i;
+        for (uint32_t c = first; (c <= first + 1u) && (c < fill); ++c) {
+            if (pq_minmax_above(aQueue, (msgindex_t) c, m, max)) {
+                m = (msgindex_t) c;
+            }
+            for (uint32_t g = (2u * c) + 1u; (g <= (2u * c) + 2u) && (g < fill); ++g) {
+                if (pq_minmax_above(aQueue, (msgindex_t) g, m, max)) {
+                    m = (msgindex_t) g;
+                }
+            }
+        }
+        if (m == i) {
+            return;
+        }
+        pq_swap(aQueue, i, m);
+        if (m <= first + 1u) {
+            return;
+        }
+        /* A grandchild moved up; the slot may now be out of order with its
+         * parent on the other kind of level. */
+        const msgindex_t p = (msgindex_t) ((m - 1u) / 2u);
+        if (pq_minmax_above(aQueue, p, m, max)) {
+            pq_swap(aQueue, p, m);
+        }
+        i = m;
+    }
+}
+
+/******************************************************************************/
+/*!
+ * Restore min-max heap order after the slot at an index changed.
+ * @param   aQueue      [in] Queue handle of order PQ_ATTR_PRIOQ.
+ * @param   aIndex      Slot index.
+ * @note    Complexity: O(log N).
+ *
+ * A slot out of order with its parent swaps with it, and both move on in
+ * the sense of their new levels. Otherwise the slot moves up among its
+ * grandparents or, if it stays, down.
+ */
+void pq_minmax_fix(struct pq_queue *aQueue, msgindex_t aIndex) {
+    const int max = pq_minmax_level(aIndex);
+    if (aIndex > 0) {
+        const msgindex_t p = (msgindex_t) ((aIndex - 1u) / 2u);
+        if (pq_minmax_above(aQueue, aIndex, p, !max)) {
+            pq_swap(aQueue, aIndex, p);
+            pq_minmax_up(aQueue, p, !max);
+            pq_minmax_down(aQueue, aIndex);
+            return;
+        }
+    }
+    if (pq_minmax_up(aQueue, aIndex, max) == aIndex) {
+        pq_minmax_down(aQueue, aIndex);
+    }
+}
+
+/******************************************************************************/
+/*!
+ * Get the number of entries in a queue's index.
+ * @param   aAttributes [in] Queue attributes.
+ * @return  maxmsg with handles or order PQ_ATTR_WFQ; for a conflating
+ *          queue a power of two at least twice maxmsg; otherwise 0.
+ */
+size_t pq_index_capacity(const struct pq_attr *aAttributes) {
+    if (aAttributes->handles || (aAttributes->order == PQ_ATTR_WFQ)) {
+        return aAttributes->maxmsg;
+    }
+    if (!aAttributes->conflate) {
+        return 0;
+    }
+    size_t cap = 1;
+    while (cap < (2u * (size_t) aAttributes->maxmsg)) {
+        cap <<= 1;
+    }
+    return cap;
+}
+
+/******************************************************************************/
+/*!
+ * Get a queue's index. With handles, it maps data block numbers to slot
+ * indices. For order PQ_ATTR_WFQ, it links each slot to the next one of
+ * its class or of the free list. For a conflating queue, it is an open-addressing hash table of
+ * slot indices with linear probing.
+ * @param   aQueue      [in] Queue handle.
+ * @return  With handles or WFQ, table of maxmsg entries. Otherwise table of
+ *          index_mask + 1 entries; PQ_INDEX_NIL marks a free one.
+ */
+msgindex_t *pq_index(const struct pq_queue *aQueue) {
+    return (msgindex_t *) ((uint8_t *) aQueue + aQueue->index_offset);
+}
+
+/******************************************************************************/
+/*!
+ * Get the home position of a key in the key index.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aKey        Key.
+ * @return  Table position.
+ */
+uint32_t pq_index_home(const struct pq_queue *aQueue, uint64_t aKey) {
+    /* Finalizer of splitmix64, so sequential keys spread out. */
+    uint64_t h = aKey;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+    h ^= h >> 31;
+    return (uint32_t) h & aQueue->index_mask;
+}
+
+/******************************************************************************/
+/*!
+ * Find the table position of a key in the key index.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aKey        Key.
+ * @return  Position holding the key's slot, or the free position where
+ *          it would go.
+ * @note    Assumes mutex held by caller.
+ */
+uint32_t pq_index_probe(const struct pq_queue *aQueue, uint64_t aKey) {
+    const msgindex_t *const table = pq_index(aQueue);
+    uint32_t pos = pq_index_home(aQueue, aKey);
+    while ((table[pos] != PQ_INDEX_NIL) && (aQueue->message[table[pos]].key != aKey)) {
+        pos = (pos + 1u) & aQueue->index_mask;
+    }
+    return pos;
+}
+
+/******************************************************************************/
+/*!
+ * Remove a key from the key index.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aKey        Key of a queued message.
+ * @note    Assumes mutex held by caller.
+ *
+ * Later entries of the probe sequence shift back into the hole, so
+ * lookups never need tombstones.
+ */
+void pq_index_remove(struct pq_queue *aQueue, uint64_t aKey) {
+    msgindex_t *const table = pq_index(aQueue);
+    uint32_t hole = pq_index_probe(aQueue, aKey);
+    table[hole] = PQ_INDEX_NIL;
+    for (uint32_t pos = (hole + 1u) & aQueue->index_mask; table[pos] != PQ_INDEX_NIL;
+         pos = (pos + 1u) & aQueue->index_mask) {
+        const uint32_t home = pq_index_home(aQueue, aQueue->message[table[pos]].key);
+        /* Stays if its home lies cyclically in (hole, pos]. */
+        const int stays = (hole <= pos) ? ((hole < home) && (home <= pos)) : ((hole < home) || (home <= pos));
+        if (!stays) {
+            table[hole] = table[pos];
+            table[pos] = PQ_INDEX_NIL;
+            hole = pos;
+        }
+    }
+}
+
+/******************************************************************************/
+/*!
+ * Replace a queued message with the same key, in place.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aMessage    [in] Message to send.
+ * @return  Nonzero if replaced; otherwise the message must be inserted.
+ * @note    Assumes mutex held by caller.
+ *
+ * The replaced message keeps its position, so receive order follows
+ * the first arrival of each key.
+ */
+int pq_conflate(struct pq_queue *aQueue, const struct pq_msg *aMessage) {
+    const msgindex_t i = pq_index(aQueue)[pq_index_probe(aQueue, ((const struct pq_msg_ex *) aMessage)->key)];
+    if (i == PQ_INDEX_NIL) {
+        return 0;
+    }
+    struct pq_slot *const message = aQueue->message;
+    message[i].size = aMessage->size;
+    message[i].prio = aMessage->prio;
+    message[i].expires = pq_expires(aQueue, aMessage);
+    memcpy(pq_data(aQueue, i), aMessage->msg, aMessage->size);
+    ++aQueue->stats.conflated;
+    return 1;
+}
+
+/******************************************************************************/
+/*!
+ * Find the slot of a queued message by its handle.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aHandle     Message handle from a send.
+ * @param   aIndex      [out] Slot index.
+ * @return  0           Success.
+ * @return  ENOENT      Message is no longer queued.
+ * @note    Assumes mutex held by caller.
+ * @note    Complexity: O(1).
+ */
+pq_status_t pq_handle_find(const struct pq_queue *aQueue, pq_handle_t aHandle, msgindex_t *aIndex) {
+    const msgindex_t block = (msgindex_t) (aHandle & 0xffffu);
+    if (block >= aQueue->maxmsg) {
+        return ENOENT;
+    }
+    /* A data block's slot is free or holds a later message once the
+     * message is gone. */
+    const msgindex_t i = pq_index(aQueue)[block];
+    if ((i >= aQueue->fill) || ((aQueue->message[i].key & PQ_HANDLE_MASK) != aHandle)) {
+        return ENOENT;
+    }
+    *aIndex = i;
+    return 0;
+}
+
+/******************************************************************************/
+/*!
+ * Cancel a queued message.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aHandle     Message handle from a send.
+ * @return  0           Success.
+ * @return  EINVAL      Invalid argument, or queue has no handles.
+ * @return  ENOENT      Message was received, cancelled, expired or evicted.
+ * @return  Error code otherwise.
+ * @note    Complexity: O(log N).
+ */
+pq_status_t pq_cancel(struct pq_queue *aQueue, pq_handle_t aHandle) {
+    if ((aQueue == NULL) || !aQueue->handles) {
+        return EINVAL;
+    }
+
+    pq_status_t sc = pq_lock(aQueue, PQ_OP_OTHER);
+    pq_return_if_unsuccessful(sc);
+    msgindex_t i;
+    sc = pq_handle_find(aQueue, aHandle, &i);
+    pq_unlock_and_return_if_unsuccessful(sc);
+    pq_delete_at(aQueue, i);
+    struct pq_post post;
+    sc = pq_notify_send(aQueue, &post);
+    pq_unlock_and_return_if_unsuccessful(sc);
+    sc = pq_unlock(aQueue);
+    pq_after_unlock(aQueue, &post);
+    return sc;
+}
+
+/******************************************************************************/
+/*!
+ * Change the priority of a queued message.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aHandle     Message handle from a send.
+ * @param   aPrio       New priority.
+ * @return  0           Success.
+ * @return  EINVAL      Invalid argument, or queue has no handles.
+ * @return  ENOENT      Message was received, cancelled, expired or evicted.
+ * @return  Error code otherwise.
+ * @note    Complexity: O(log N).
+ */
+pq_status_t pq_change_prio(struct pq_queue *aQueue, pq_handle_t aHandle, msgprio_t aPrio) {
+    if ((aQueue == NULL) || !aQueue->handles || (aPrio > aQueue->maxprio)) {
+        return EINVAL;
+    }
+
+    pq_status_t sc = pq_lock(aQueue, PQ_OP_OTHER);
+    pq_return_if_unsuccessful(sc);
+    msgindex_t i;
+    sc = pq_handle_find(aQueue, aHandle, &i);
+    if (sc == 0) {
+        struct pq_slot *const s = &aQueue->message[i];
+        /* Keep the send time in an aging key. */
+        s->due = s->due + ((uint64_t) s->prio * aQueue->aging_ns) - ((uint64_t) aPrio * aQueue->aging_ns);
+        s->prio = aPrio;
+        pq_heap_fix(aQueue, i);
+        pq_publish_top(aQueue);
+    }
+    pq_unlock_and_return_if_unsuccessful(sc);
+    return pq_unlock(aQueue);
+}
+
+/******************************************************************************/
+/*!
+ * Get the offset of an aging queue's wait statistics from the queue's start.
+ * @param   aAttributes [in] Queue attributes.
+ * @return  Offset in bytes, after the index, aligned.
+ */
+size_t pq_wait_offset(const struct pq_attr *aAttributes) {
+    const size_t end = pq_index_offset(aAttributes) + (pq_index_capacity(aAttributes) * sizeof(msgindex_t));
+    const size_t align = sizeof(uint64_t);
+    return (end + align - 1) / align * align;
+}
+
+/******************************************************************************/
+/*!
+ * Get an aging queue's wait statistics.
+ * @param   aQueue      [in] Queue handle.
+ * @return  Array of maxprio + 1 entries, indexed by priority.
+ */
+struct pq_wait *pq_waits(const struct pq_queue *aQueue) {
+    return (struct pq_wait *) ((uint8_t *) aQueue + aQueue->wait_offset);
+}
+
+/******************************************************************************/
+/*!
+ * Compute the heap key of a message being inserted into an aging queue.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aPrio       Message priority.
+ * @return  Time in ns when the message reaches maxprio.
+ *
+ * A message's effective priority is its priority plus one per aging
+ * interval waited. Comparing two effective priorities at any time gives
+ * the same result as comparing when each reaches maxprio, so the key
+ * never changes while the message waits and nothing needs re-sorting.
+ */
+uint64_t pq_aged_due(const struct pq_queue *aQueue, msgprio_t aPrio) {
+    return pq_now_ns() + ((uint64_t) (aQueue->maxprio - aPrio) * aQueue->aging_ns);
+}
+
+/******************************************************************************/
+/*!
+ * Record the wait of a message about to be received from an aging queue.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aIndex      Slot index of message.
+ * @note    Assumes mutex held by caller.
+ */
+void pq_aged(struct pq_queue *aQueue, msgindex_t aIndex) {
+    const struct pq_slot *const s = &aQueue->message[aIndex];
+    const uint64_t sent = s->due - ((uint64_t) (aQueue->maxprio - s->prio) * aQueue->aging_ns);
+    const uint64_t now = pq_now_ns();
+    /* By the priority sent with, which pq_change_prio() leaves in the key. */
+    const msgprio_t prio = aQueue->handles ? (msgprio_t) (s->key >> 48) : s->prio;
+    struct pq_wait *const w = &pq_waits(aQueue)[prio];
+    ++w->count;
+    pq_profile_record(w->hist, &w->wait_ns, &w->wait_max_ns, (now > sent) ? (now - sent) : 0);
+}
+
+/******************************************************************************/
+/*!
+ * Get the distribution of waits of messages received from an aging queue.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aPrio       Priority the messages were sent with.
+ * @param   aWait       [out] Wait statistics.
+ * @return  0           Success.
+ * @return  EINVAL      Invalid argument, or queue does not age.
+ * @return  Otherwise status code of failed pthread call.
+ */
+pq_status_t pq_get_wait(struct pq_queue *aQueue, msgprio_t aPrio, struct pq_wait *aWait) {
+    if ((aQueue == NULL) || (aWait == NULL) || (aQueue->aging_ns == 0) || (aPrio > aQueue->maxprio)) {
+        return EINVAL;
+    }
+
+    pq_status_t sc = pq_lock(aQueue, PQ_OP_OTHER);
+    pq_return_if_unsuccessful(sc);
+    *aWait = pq_waits(aQueue)[aPrio];
+    return pq_unlock(aQueue);
+}
+
+/******************************************************************************/
+/*!
+ * Get the offset of a WFQ queue's classes from the queue's start.
+ * @param   aAttributes [in] Queue attributes.
+ * @return  Offset in bytes, after the wait statistics, aligned.
+ */
+size_t pq_class_offset(const struct pq_attr *aAttributes) {
+    const size_t waits = aAttributes->aging ? ((size_t) aAttributes->maxprio + 1) : 0;
+    const size_t end = pq_wait_offset(aAttributes) + (waits * sizeof(struct pq_wait));
+    const size_t align = sizeof(uint64_t);
+    return (end + align - 1) / align * align;
+}
+
+/******************************************************************************/
+/*!
+ * Get a WFQ queue's classes.
+ * @param   aQueue      [in] Queue handle.
+ * @return  Array of maxprio + 1 entries, indexed by priority.
+ */
+struct pq_class *pq_classes(const struct pq_queue *aQueue) {
+    return (struct pq_class *) ((uint8_t *) aQueue + aQueue->class_offset);
+}
+
+/******************************************************************************/
+/*!
+ * Get what serving a message costs its class in a WFQ queue.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aIndex      Slot index of message.
+ * @return  Message size for byte-based, otherwise 1.
+ */
+uint32_t pq_wfq_cost(const struct pq_queue *aQueue, msgindex_t aIndex) {
+    return aQueue->wfq_bytes ? aQueue->message[aIndex].size : 1u;
+}
+
+/******************************************************************************/
+/*!
+ * Append a class to the end of the active list of a WFQ queue.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aPrio       Class.
+ * @note    Assumes mutex held by caller.
+ *
+ * A class that becomes the head of the list starts its turn and
+ * receives its quantum.
+ */
+void pq_wfq_activate(struct pq_queue *aQueue, msgprio_t aPrio) {
+    struct pq_class *const cls = pq_classes(aQueue);
+    cls[aPrio].next = PQ_INDEX_NIL;
+    if (aQueue->active_head == PQ_INDEX_NIL) {
+        aQueue->active_head = aPrio;
+        cls[aPrio].deficit += cls[aPrio].quantum;
+    }
+    else {
+        cls[aQueue->active_tail].next = aPrio;
+    }
+    aQueue->active_tail = aPrio;
+}
+
+/******************************************************************************/
+/*!
+ * Remove the head of the active list of a WFQ queue.
+ * @param   aQueue      [in] Queue handle.
+ * @return  Class that was the head.
+ * @note    Assumes active list is not empty.
+ * @note    Assumes mutex held by caller.
+ */
+msgprio_t pq_wfq_pop(struct pq_queue *aQueue) {
+    struct pq_class *const cls = pq_classes(aQueue);
+    const msgprio_t c = aQueue->active_head;
+    aQueue->active_head = cls[c].next;
+    if (aQueue->active_head == PQ_INDEX_NIL) {
+        aQueue->active_tail = PQ_INDEX_NIL;
+    }
+    else {
+        cls[aQueue->active_head].deficit += cls[aQueue->active_head].quantum;
+    }
+    return c;
+}
+
+/******************************************************************************/
+/*!
+ * End turns of active classes until the head class can afford its next
+ * message.
+ * @param   aQueue      [in] Queue handle.
+ * @note    Assumes mutex held by caller.
+ * @note    Complexity: O(1); a quantum covers any message, so at most one
+ *          turn ends.
+ */
+void pq_wfq_settle(struct pq_queue *aQueue) {
+    struct pq_class *const cls = pq_classes(aQueue);
+    while ((aQueue->active_head != PQ_INDEX_NIL)
+           && (cls[aQueue->active_head].deficit < pq_wfq_cost(aQueue, cls[aQueue->active_head].head))) {
+        pq_wfq_activate(aQueue, pq_wfq_pop(aQueue));
+    }
+}
+
+/******************************************************************************/
+/*!
+ * Unlink a message from its class in a WFQ queue and free its slot.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aIndex      Slot index of message.
+ * @param   aPrev       Slot index of the message before it in its class,
+ *                      or PQ_INDEX_NIL if it is the class's head.
+ * @note    Assumes mutex held by caller.
+ *
+ * A class left empty leaves the active list and forfeits its deficit.
+ */
+void pq_wfq_unlink(struct pq_queue *aQueue, msgindex_t aIndex, msgindex_t aPrev) {
+    msgindex_t *const link = pq_index(aQueue);
+    struct pq_class *const cls = pq_classes(aQueue);
+    const msgprio_t c = aQueue->message[aIndex].prio;
+
+    if (aPrev == PQ_INDEX_NIL) {
+        cls[c].head = link[aIndex];
+    }
+    else {
+        link[aPrev] = link[aIndex];
+    }
+    if (cls[c].tail == aIndex) {
+        cls[c].tail = aPrev;
+    }
+    aQueue->message[aIndex].expires = 0;
+    link[aIndex] = aQueue->free;
+    aQueue->free = aIndex;
+    pq_set_fill(aQueue, aQueue->fill - 1);
+
+    if (cls[c].head == PQ_INDEX_NIL) {
+        cls[c].deficit = 0;
+        if (aQueue->active_head == c) {
+            pq_wfq_pop(aQueue);
+        }
+        else {
+            msgprio_t p = aQueue->active_head;
+            while (cls[p].next != c) {
+                p = cls[p].next;
+            }
+            cls[p].next = cls[c].next;
+            if (aQueue->active_tail == c) {
+                aQueue->active_tail = p;
+            }
+        }
+    }
+    pq_wfq_settle(aQueue);
+}
+
+/******************************************************************************/
+/*!
+ * Check the WFQ attributes of a queue.
+ * @param   aAttributes [in] Queue attributes of order PQ_ATTR_WFQ.
+ * @return  Nonzero if invalid.
+ */
+int pq_wfq_invalid(const struct pq_attr *aAttributes) {
+    /* Classes are linked by msgprio_t, with PQ_INDEX_NIL as end. */
+    if ((aAttributes->maxprio >= PQ_INDEX_NIL) || (aAttributes->path != NULL)) {
+        return 1;
+    }
+    if (aAttributes->weights != NULL) {
+        for (size_t p = 0; p <= aAttributes->maxprio; ++p) {
+            if (aAttributes->weights[p] == 0) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/******************************************************************************/
+/*!
+ * Check whether messages can be handed directly to waiting receivers.
+ * @param   aAttributes [in] Queue attributes.
+ * @return  Nonzero if so.
+ *
+ * Waiters are linked through the stacks of the receiving threads, so the
+ * queue must be process-local, and a message handed over must not need a
+ * slot: for a due time, a handle or wait statistics.
+ */
+int pq_handoff_possible(const struct pq_attr *aAttributes) {
+    return (aAttributes->name == NULL) && (aAttributes->path == NULL) && (aAttributes->order != PQ_ATTR_DELAY)
+        && !aAttributes->handles && (aAttributes->aging == 0);
+}
+
+/******************************************************************************/
+/*!
+ * Get the offset of a flat-combining queue's requests from the queue's start.
+ * @param   aAttributes [in] Queue attributes.
+ * @return  Offset in bytes, after the WFQ classes, aligned.
+ */
+size_t pq_request_offset(const struct pq_attr *aAttributes) {
+    const size_t classes = (aAttributes->order == PQ_ATTR_WFQ) ? ((size_t) aAttributes->maxprio + 1) : 0;
+    const size_t end = pq_class_offset(aAttributes) + (classes * sizeof(struct pq_class));
+    const size_t align = sizeof(uint64_t);
+    return (end + align - 1) / align * align;
+}
+
+/******************************************************************************/
+/*!
+ * Get a flat-combining queue's requests.
+ * @param   aQueue      [in] Queue handle.
+ * @return  Array of combine entries.
+ */
+struct pq_request *pq_requests(const struct pq_queue *aQueue) {
+    return (struct pq_request *) ((uint8_t *) aQueue + aQueue->request_offset);
+}
+
+/******************************************************************************/
+/*!
+ * Send or receive through a flat-combining queue.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aSend       [in] Message to send, or NULL.
+ * @param   aRecv       [out] Message to receive, or NULL.
+ * @return  0           Success.
+ * @return  EAGAIN      Queue is full or empty.
+ * @return  Otherwise status code of failed pthread call.
+ *
+ * The request is published in a free entry of the request array. Whoever
+ * gets the mutex serves all published requests in one batch, so the heap
+ * stays in the cache of one core while the others only watch their entry.
+ */
+pq_status_t pq_combine(struct pq_queue *aQueue, const struct pq_msg *aSend, struct pq_msg *aRecv) {
+    const unsigned op = (aSend != NULL) ? PQ_OP_SEND : PQ_OP_RECV;
+    struct pq_request *const request = pq_requests(aQueue);
+    struct pq_request *r = NULL;
+    /* Stacks of different threads are far apart, so they start the
+     * search for a free entry at different entries. */
+    uint32_t i = (uint32_t) (((uintptr_t) &r >> 12) * 0x9e3779b9u);
+    while (r == NULL) {
+        for (uint16_t n = 0; (n < aQueue->combine) && (r == NULL); ++n, ++i) {
+            uint32_t expected = PQ_REQ_FREE;
+            struct pq_request *const e = &request[i % aQueue->combine];
+            if (__atomic_compare_exchange_n(&e->state, &expected, PQ_REQ_CLAIMED, 0, __ATOMIC_ACQUIRE,
+                                            __ATOMIC_RELAXED)) {
+                r = e;
+            }
+        }
+        if (r == NULL) {
+            sched_yield();
+        }
+    }
+    r->send = aSend;
+    r->recv = aRecv;
+    __atomic_store_n(&r->state, (op == PQ_OP_SEND) ? PQ_REQ_SEND : PQ_REQ_RECV, __ATOMIC_RELEASE);
+
+    pq_status_t sc = 0;
+    while (__atomic_load_n(&r->state, __ATOMIC_ACQUIRE) != PQ_REQ_DONE) {
+        sc = pq_trylock(aQueue, op);
+        if (sc == EBUSY) {
+            /* The combiner at work likely serves us. Watch our own entry,
+             * backing off, and leave the mutex alone for a while. */
+            sc = 0;
+            for (unsigned spins = 1; (spins <= PQ_COMBINE_SPIN)
+                 && (__atomic_load_n(&r->state, __ATOMIC_ACQUIRE) != PQ_REQ_DONE); spins *= 2u) {
+                for (unsigned k = 0; k < spins; ++k) {
+                    pq_pause();
+                }
+            }
+            if (__atomic_load_n(&r->state, __ATOMIC_ACQUIRE) != PQ_REQ_DONE) {
+                sched_yield();
+            }
+            continue;
+        }
+        if (sc != 0) {
+            /* Withdraw the request, unless a combiner served it meanwhile;
+             * then its status must be seen. */
+            uint32_t expected = (op == PQ_OP_SEND) ? PQ_REQ_SEND : PQ_REQ_RECV;
+            if (__atomic_compare_exchange_n(&r->state, &expected, PQ_REQ_FREE, 0, __ATOMIC_ACQUIRE,
+                                            __ATOMIC_ACQUIRE)) {
+                return sc;
+            }
+            sc = 0;
+            break;
+        }
+        struct pq_post post[2] = {{.eventfd = -1,.sync = 0}, {.eventfd = -1,.sync = 0}};
+        sc = pq_combine_batch(aQueue, r, post);
+        const pq_status_t su = pq_unlock(aQueue);
+        pq_after_unlock(aQueue, &post[PQ_OP_SEND]);
+        pq_after_unlock(aQueue, &post[PQ_OP_RECV]);
+        sc = (sc != 0) ? sc : su;
+        /* Our request was pending, so the batch served it. */
+        break;
     }
+    const pq_status_t status = r->status;
+    __atomic_store_n(&r->state, PQ_REQ_FREE, __ATOMIC_RELEASE);
+    return (sc != 0) ? sc : status;
 }
 
 /******************************************************************************/
 /*!
- * Insert message into message fifo.
- * @param   aQueue      [in] Queue handle.
- * @param   aMessage    [in] Message to insert.
- * @note    Assumes queue is not full.
- * @note    Assumes mutex held by caller.
- * @note    Complexity: O(1).
+ * Pause a spinning thread briefly, yielding the core to a sibling thread.
  */
-void pq_insert_fifo(struct pq_queue *aQueue, const struct pq_msg *aMessage) {
-    assert(aQueue->fill < aQueue->maxmsg);
-    struct pq_msg *const message = aQueue->message;
-
-    const msgindex_t i = aQueue->tail++;
-    message[i].size = aMessage->size;
-    message[i].prio = aMessage->prio;
-    memcpy(message[i].msg, aMessage->msg, aMessage->size);
-    if (aQueue->tail == aQueue->maxmsg) {
-        aQueue->tail = 0;
-    }
-    ++aQueue->fill;
+void pq_pause(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#else
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+#endif
 }
 
 /******************************************************************************/
 /*!
- * Insert message into message array in FIFO order.
+ * Serve all published requests of a flat-combining queue.
  * @param   aQueue      [in] Queue handle.
- * @param   aMessage    [in] Message to insert.
- * @note    Assumes queue is not full.
+ * @param   aOwn        [in] Request of the combining thread.
+ * @param   aPost       [inout] Work for pq_after_unlock() after sends and
+ *                      after receives, indexed by PQ_OP_*.
+ * @return  0           Success.
+ * @return  Otherwise status code of failed pthread call.
  * @note    Assumes mutex held by caller.
- * @note    Complexity: O(N).
  *
- * Find index where to insert into array.
- * That's the index of the first message with greater or equal priority.
- * This message and all higher-ups need to rotate up one index to make
- * room for the new message.
+ * Receives are served first from the queue as it is. Then sends are
+ * inserted, except that while the queue is empty a send goes directly to
+ * a receive still pending, without touching the heap. Receives left over
+ * get what the sends inserted, or EAGAIN.
  */
-void pq_insert_prifo(struct pq_queue *aQueue, const struct pq_msg *aMessage) {
-    assert(aQueue->fill < aQueue->maxmsg);
-    struct pq_msg *const message = aQueue->message;
+pq_status_t pq_combine_batch(struct pq_queue *aQueue, const struct pq_request *aOwn, struct pq_post *aPost) {
+    struct pq_request *const request = pq_requests(aQueue);
+    /* Handles and wait statistics need the message to pass a slot. */
+    const int handoff = !aQueue->handles && (aQueue->aging_ns == 0);
+    pq_status_t sc = 0;
+    uint64_t due;
+    uint16_t unserved = 0;
+    uint16_t r = 0;
 
-    /* Find index where to insert. */
-    msgindex_t insert;
-    for (insert = 0; insert < aQueue->fill; ++insert) {
-        if (message[insert].prio >= aMessage->prio) {
-            break;
+    for (uint16_t i = 0; i < aQueue->combine; ++i) {
+        if (__atomic_load_n(&request[i].state, __ATOMIC_ACQUIRE) != PQ_REQ_RECV) {
+            continue;
+        }
+        if (!pq_receivable(aQueue, &due)) {
+            ++unserved;
+            continue;
         }
+        pq_remove(aQueue, request[i].recv);
+        sc = pq_combine_done(aQueue, &request[i], aOwn, 0, aPost, sc);
     }
-
-    /* Rotation required? */
-    const msgindex_t rotate = aQueue->fill - insert;
-    if (rotate != 0) {
-        void   *const tmp = message[insert + rotate].msg;
-        struct pq_msg *const src = &message[insert];
-        struct pq_msg *const dst = &message[insert + 1];
-        memmove(dst, src, rotate * sizeof *src);
-        message[insert].msg = tmp;
+    for (uint16_t i = 0; i < aQueue->combine; ++i) {
+        if (__atomic_load_n(&request[i].state, __ATOMIC_ACQUIRE) != PQ_REQ_SEND) {
+            continue;
+        }
+        const struct pq_msg *const m = request[i].send;
+        if (handoff && (unserved > 0) && (aQueue->fill == 0)) {
+            /* Entries counted as unserved stay pending until served here. */
+            while (__atomic_load_n(&request[r].state, __ATOMIC_ACQUIRE) != PQ_REQ_RECV) {
+                ++r;
+            }
+            struct pq_msg *const out = request[r].recv;
+            memcpy(out->msg, m->msg, m->size);
+            out->size = m->size;
+            out->prio = m->prio;
+            ++aQueue->stats.handed_off;
+            --unserved;
+            pq_combine_done(aQueue, &request[r], aOwn, 0, NULL, 0);
+            pq_combine_done(aQueue, &request[i], aOwn, 0, NULL, 0);
+            continue;
+        }
+        const unsigned admit = pq_admit(aQueue, m);
+        if (admit == PQ_ADMIT_INSERT) {
+            pq_insert(aQueue, m);
+            sc = pq_combine_done(aQueue, &request[i], aOwn, 0, aPost, sc);
+        }
+        else {
+            if (admit == PQ_ADMIT_FULL) {
+                ++aQueue->stats.rejected;
+            }
+            pq_combine_done(aQueue, &request[i], aOwn, (admit == PQ_ADMIT_FULL) ? EAGAIN : 0, NULL, 0);
+        }
     }
-
-    /* Insert message. */
-    message[insert].prio = aMessage->prio;
-    message[insert].size = aMessage->size;
-    memcpy(message[insert].msg, aMessage->msg, aMessage->size);
-    ++aQueue->fill;
+    for (uint16_t i = 0; i < aQueue->combine; ++i) {
+        if (__atomic_load_n(&request[i].state, __ATOMIC_ACQUIRE) != PQ_REQ_RECV) {
+            continue;
+        }
+        if (pq_receivable(aQueue, &due)) {
+            pq_remove(aQueue, request[i].recv);
+            sc = pq_combine_done(aQueue, &request[i], aOwn, 0, aPost, sc);
+        }
+        else {
+            pq_combine_done(aQueue, &request[i], aOwn, EAGAIN, NULL, 0);
+        }
+    }
+    return sc;
 }
 
 /******************************************************************************/
 /*!
- * Insert a message to queue in LIFO order (push onto stack).
- * @param   aQueue    [in] Queue handle.
- * @param   aMessage  [out] Message to push.
- * @note    Assumes stack is not empty.
+ * Complete a request of a flat-combining queue.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aRequest    [inout] Request served.
+ * @param   aOwn        [in] Request of the combining thread.
+ * @param   aStatus     Status of the request.
+ * @param   aPost       [inout] Work for pq_after_unlock() if a message was
+ *                      inserted or removed, or NULL.
+ * @param   aSofar      Status of the batch so far.
+ * @return  aSofar, or the status of waking up waiters if aSofar was 0.
  * @note    Assumes mutex held by caller.
- * @note    Complexity: O(1).
  */
-void pq_insert_lifo(struct pq_queue *aQueue, const struct pq_msg *aMessage) {
-    assert(aQueue->fill < aQueue->maxmsg);
-    struct pq_msg *const message = aQueue->message;
-
-    const msgindex_t i = aQueue->fill++;
-    message[i].prio = aMessage->prio;
-    message[i].size = aMessage->size;
-    memcpy(message[i].msg, aMessage->msg, aMessage->size);
+pq_status_t pq_combine_done(struct pq_queue *aQueue, struct pq_request *aRequest, const struct pq_request *aOwn,
+                            pq_status_t aStatus, struct pq_post *aPost, pq_status_t aSofar) {
+    pq_status_t sc = 0;
+    if (aPost != NULL) {
+        /* Waiters of pq_send_until() and pq_recv_until() need to hear of
+         * it, as after any send or receive. */
+        const unsigned op = (__atomic_load_n(&aRequest->state, __ATOMIC_RELAXED) == PQ_REQ_SEND) ? PQ_OP_SEND
+            : PQ_OP_RECV;
+        struct pq_post post;
+        sc = (op == PQ_OP_SEND) ? pq_notify_recv(aQueue, &post) : pq_notify_send(aQueue, &post);
+        if (post.eventfd >= 0) {
+            aPost[op].eventfd = post.eventfd;
+        }
+    }
+    if (aRequest != aOwn) {
+        ++aQueue->stats.combined;
+    }
+    aRequest->status = aStatus;
+    __atomic_store_n(&aRequest->state, PQ_REQ_DONE, __ATOMIC_RELEASE);
+    return (aSofar != 0) ? aSofar : sc;
 }
 
 /******************************************************************************/
 /*!
- * Remove message from message priority queue, plus FIFO.
- * @param   aQueue    [in] Queue handle.
- * @param   aMessage  [out] Message with highest priority.
- * @note    Assumes queue is not empty.
- * @note    Assumes mutex held by caller.
- * @note    Complexity: O(1).
+ * Try to lock a queue's mutex.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aOp         PQ_OP_SEND, PQ_OP_RECV or PQ_OP_OTHER.
+ * @return  0           Success.
+ * @return  EBUSY       Mutex is locked.
+ * @return  Otherwise status code of failed pthread call.
+ *
+ * With PQ_PROFILE defined, an acquisition is recorded without wait time.
  */
-void pq_remove_prifo(struct pq_queue *aQueue, struct pq_msg *const aMessage) {
-    assert(aQueue->fill > 0);
-    struct pq_msg *const message = aQueue->message;
-
-    const msgindex_t i = --aQueue->fill;
-    aMessage->size = message[i].size;
-    aMessage->prio = message[i].prio;
-    memcpy(aMessage->msg, message[i].msg, aMessage->size);
+pq_status_t pq_trylock(struct pq_queue *aQueue, unsigned aOp) {
+    pq_status_t sc = pthread_mutex_trylock(&aQueue->mtx);
+    if (sc == EOWNERDEAD) {
+        sc = pthread_mutex_consistent(&aQueue->mtx);
+    }
+#ifdef PQ_PROFILE
+    if (sc == 0) {
+        ++aQueue->profile.op[aOp].acquired;
+        aQueue->prof_op = aOp;
+        aQueue->prof_t0 = pq_now_ns();
+    }
+#endif
+    if ((sc == 0) && aQueue->numa_side) {
+        pq_numa_settle(aQueue, aOp);
+    }
+    return sc;
 }
 
 /******************************************************************************/
 /*!
- * Remove message from message array.
- * @param   aQueue    [in] Queue handle.
- * @param   aMessage  [out] Message with highest priority.
- * @note    Assumes queue is not empty.
- * @note    Assumes mutex held by caller.
- * @note    Complexity: O(1).
+ * Set the memory policy of a queue's pages, moving those already in use,
+ * and fault in the others.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aMode       MPOL_* mode.
+ * @param   aNodes      [in] Mask of PQ_NUMA_NODES nodes.
+ * @return  0           Success.
+ * @return  ENOTSUP     Not Linux.
+ * @return  Otherwise error of failed mbind().
+ *
+ * The syscall is made directly, so there is no dependency on libnuma.
+ * Only pages no other process maps move. Pages are touched with an atomic
+ * no-op, as other threads may update requests without the mutex.
  */
-void pq_remove_fifo(struct pq_queue *aQueue, struct pq_msg *const aMessage) {
-    assert(aQueue->fill > 0);
-    struct pq_msg *const message = aQueue->message;
-
-    const msgindex_t i = aQueue->head;
-    ++aQueue->head;
-    if (aQueue->head == aQueue->maxmsg) {
-        aQueue->head = 0;
+pq_status_t pq_numa_place(struct pq_queue *aQueue, int aMode, const unsigned long *aNodes) {
+#ifdef __linux__
+    const size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    const size_t size = (aQueue->mapsize + page - 1) / page * page;
+    /* The kernel reads one node less than it is told. */
+    if (syscall(SYS_mbind, aQueue, size, aMode, aNodes, PQ_NUMA_NODES + 1ul, MPOL_MF_MOVE) != 0) {
+        return errno;
     }
-    aMessage->size = message[i].size;
-    aMessage->prio = message[i].prio;
-    memcpy(aMessage->msg, message[i].msg, aMessage->size);
-    --aQueue->fill;
+    for (size_t offset = 0; offset < size; offset += page) {
+        __atomic_fetch_or((unsigned char *) aQueue + offset, 0, __ATOMIC_RELAXED);
+    }
+    return 0;
+#else
+    return ENOTSUP;
+#endif
 }
 
 /******************************************************************************/
 /*!
- * Remove a message from queue in LIFO order (pop stack).
- * @param   aQueue    [in] Queue handle.
- * @param   aMessage  [out] Message on top of stack.
- * @note    Assumes stack is not empty.
- * @note    Assumes mutex held by caller.
- * @note    Complexity: O(1).
+ * Interleave a queue's pages across the nodes the process may use.
+ * @param   aQueue      [in] Queue handle.
+ * @return  0           Success.
+ * @return  Otherwise error of failed get_mempolicy() or mbind().
  */
-void pq_remove_lifo(struct pq_queue *aQueue, struct pq_msg *const aMessage) {
-    assert(aQueue->fill > 0);
-    struct pq_msg *const message = aQueue->message;
+pq_status_t pq_numa_interleave(struct pq_queue *aQueue) {
+#ifdef __linux__
+    unsigned long nodes[PQ_NUMA_NODES / (CHAR_BIT * sizeof(unsigned long))];
+    memset(nodes, 0, sizeof nodes);
+    if (syscall(SYS_get_mempolicy, NULL, nodes, (unsigned long) PQ_NUMA_NODES, NULL, MPOL_F_MEMS_ALLOWED) != 0) {
+        return errno;
+    }
+    return pq_numa_place(aQueue, MPOL_INTERLEAVE, nodes);
+#else
+    return pq_numa_place(aQueue, 0, NULL);
+#endif
+}
 
-    const msgindex_t i = --aQueue->fill;
-    aMessage->size = message[i].size;
-    aMessage->prio = message[i].prio;
-    memcpy(aMessage->msg, message[i].msg, aMessage->size);
+/******************************************************************************/
+/*!
+ * Place a queue on the node of the calling thread, if it is the first to
+ * lock it for the operation the placement waits for.
+ * @param   aQueue      [in] Queue handle, locked.
+ * @param   aOp         Operation type (PQ_OP_*) the lock is taken for.
+ *
+ * The placement is a hint; if it fails, the queue stays where it is.
+ */
+void pq_numa_settle(struct pq_queue *aQueue, unsigned aOp) {
+    if (aOp + 1 != aQueue->numa_side) {
+        return;
+    }
+    aQueue->numa_side = 0;
+#ifdef __linux__
+    unsigned cpu;
+    unsigned node;
+    if ((syscall(SYS_getcpu, &cpu, &node, NULL) == 0) && (node < PQ_NUMA_NODES)) {
+        unsigned long nodes[PQ_NUMA_NODES / (CHAR_BIT * sizeof(unsigned long))];
+        memset(nodes, 0, sizeof nodes);
+        nodes[node / (CHAR_BIT * sizeof *nodes)] = 1ul << (node % (CHAR_BIT * sizeof *nodes));
+        pq_numa_place(aQueue, MPOL_PREFERRED, nodes);
+    }
+#endif
 }
 
+/******************************************************************************/
+/*!
+ * Get a queue's statistics.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aStats      [out] Statistics.
+ * @return  0           Success.
+ * @return  EINVAL      Invalid argument.
+ * @return  Otherwise status code of failed pthread call.
+ */
+pq_status_t pq_get_stats(struct pq_queue *aQueue, struct pq_stats *aStats) {
+    if ((aQueue == NULL) || (aStats == NULL)) {
+        return EINVAL;
+    }
+    pq_status_t sc = pq_lock(aQueue, PQ_OP_OTHER);
+    pq_return_if_unsuccessful(sc);
+    *aStats = aQueue->stats;
+    return pq_unlock(aQueue);
+}
 
 /******************************************************************************/
 /*!
  * Swap two messages in the message store.
- * @param   aMessage  [inout] Message store.
+ * @param   aQueue    [inout] Queue handle.
  * @param   aFirst    Index of first message.
  * @param   aSecond   Index of second message.
+ *
+ * With handles, the position index follows the data blocks.
  */
-void pq_swap(struct pq_msg *aMessage, msgindex_t aFirst, msgindex_t aSecond) {
-    const struct pq_msg tmp = aMessage[aFirst];
-    aMessage[aFirst] = aMessage[aSecond];
-    aMessage[aSecond] = tmp;
+void pq_swap(struct pq_queue *aQueue, msgindex_t aFirst, msgindex_t aSecond) {
+    struct pq_slot *const message = aQueue->message;
+    const struct pq_slot tmp = message[aFirst];
+    message[aFirst] = message[aSecond];
+    message[aSecond] = tmp;
+    if (aQueue->handles) {
+        msgindex_t *const pos = pq_index(aQueue);
+        pos[message[aFirst].key & 0xffffu] = aFirst;
+        pos[message[aSecond].key & 0xffffu] = aSecond;
+    }
 }
 
 /******************************************************************************/
@@ -579,12 +4519,13 @@ void pq_add_time(struct timespec *aTime, pq_time_t aIncrement) {
  */
 pq_status_t pq_cleanup(struct pq_queue *aQueue, pq_status_t aItems, pq_status_t aStatus) {
     if (aItems >= 6) {
-        for (msgindex_t i = 0; i < aQueue->maxmsg; ++i) {
-            if (aQueue->message[i].msg != NULL) {
-                free(aQueue->message[i].msg);
+#ifdef __linux__
+        for (unsigned e = PQ_EVENT_RECV; e <= PQ_EVENT_SEND; ++e) {
+            if (aQueue->eventfd[e] >= 0) {
+                close(aQueue->eventfd[e]);
             }
         }
-        free(aQueue->message);
+#endif
     }
     if (aItems >= 5) {
         pthread_cond_destroy(&aQueue->ready_to_recv);
@@ -598,7 +4539,19 @@ pq_status_t pq_cleanup(struct pq_queue *aQueue, pq_status_t aItems, pq_status_t
     if (aItems >= 2) {
         pthread_mutexattr_destroy(&aQueue->attr);
     }
-    if (aItems >= 1) {
+    if ((aItems >= 1) && (aQueue->memory == PQ_MEM_FILE)) {
+        const int fd = aQueue->fd;
+        msync(aQueue, aQueue->mapsize, MS_SYNC);
+        munmap(aQueue, aQueue->mapsize);
+        close(fd);
+    }
+    else if ((aItems >= 1) && (aQueue->memory == PQ_MEM_SHM)) {
+        char    name[sizeof aQueue->name];
+        strcpy(name, aQueue->name);
+        munmap(aQueue, aQueue->mapsize);
+        shm_unlink(name);
+    }
+    else if (aItems >= 1) {
         free(aQueue);
     }
     return aStatus;
@@ -613,13 +4566,44 @@ pq_status_t pq_cleanup(struct pq_queue *aQueue, pq_status_t aItems, pq_status_t
  * @return  Otherwise status code of failed pthread call.
  */
 pq_status_t pq_get_fill(struct pq_queue *aQueue, msgindex_t *aFill) {
-    pq_status_t sc = pthread_mutex_lock(&aQueue->mtx);
-    pq_unlock_and_return_if_unsuccessful(sc);
+    pq_status_t sc = pq_lock(aQueue, PQ_OP_OTHER);
+    pq_return_if_unsuccessful(sc);
     *aFill = aQueue->fill;
-    sc = pthread_mutex_unlock(&aQueue->mtx);
+    sc = pq_unlock(aQueue);
     return sc;
 }
 
+/******************************************************************************/
+/*!
+ * Get queue's fill level without locking the queue.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aFill       [out] Fill level.
+ * @return  0           Success.
+ * @return  EINVAL      Invalid argument.
+ *
+ * The value is a snapshot which may be outdated as soon as it is returned.
+ * Intended for pollers that check many queues; a zero fill level means that
+ * pq_recv_nonbl() would also have returned EAGAIN.
+ */
+pq_status_t pq_peek_fill(struct pq_queue *aQueue, msgindex_t *aFill) {
+    if ((aQueue == NULL) || (aFill == NULL)) {
+        return EINVAL;
+    }
+    *aFill = __atomic_load_n(&aQueue->fill, __ATOMIC_ACQUIRE);
+    return 0;
+}
+
+/******************************************************************************/
+/*!
+ * Publish a new fill level to lock-free readers.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aFill       New fill level.
+ * @note    Assumes mutex held by caller.
+ */
+void pq_set_fill(struct pq_queue *aQueue, msgindex_t aFill) {
+    __atomic_store_n(&aQueue->fill, aFill, __ATOMIC_RELEASE);
+}
+
 /******************************************************************************/
 /*!
  * Dump queue contents to stdout.
@@ -629,32 +4613,222 @@ pq_status_t pq_get_fill(struct pq_queue *aQueue, msgindex_t *aFill) {
  * @return  Otherwise status code of failed pthread call.
  */
 pq_status_t pq_dump(struct pq_queue *aQueue) {
-    if ((aQueue == NULL) || (aQueue->message == NULL)) {
+    if (aQueue == NULL) {
         return EINVAL;
     }
-    pq_status_t sc = pthread_mutex_lock(&aQueue->mtx);
-    pq_unlock_and_return_if_unsuccessful(sc);
+    pq_status_t sc = pq_lock(aQueue, PQ_OP_OTHER);
+    pq_return_if_unsuccessful(sc);
     printf("Queue handle %p ", (void *) aQueue);
     printf("(%u messages of %u bytes)\n", aQueue->maxmsg, aQueue->msgsize);
-    printf("sizeof(struct pq_msg) is %zu bytes.\n", sizeof(struct pq_msg));
+    printf("sizeof(struct pq_slot) is %zu bytes.\n", sizeof(struct pq_slot));
     printf("Fill=%u; ", aQueue->fill);
     if (aQueue->fill == 0) {
         printf("queue empty.\n");
     }
+    else if (aQueue->order == PQ_ATTR_WFQ) {
+        printf("active classes:\n");
+        for (msgprio_t p = aQueue->active_head; p != PQ_INDEX_NIL; p = pq_classes(aQueue)[p].next) {
+            const struct pq_class *const cls = &pq_classes(aQueue)[p];
+            printf("prio %u, deficit %u of quantum %u\n", p, cls->deficit, cls->quantum);
+            for (msgindex_t i = cls->head; i != PQ_INDEX_NIL; i = pq_index(aQueue)[i]) {
+                pq_dump_slot(aQueue, i);
+            }
+        }
+    }
     else {
         printf("heap:\n");
         for (msgindex_t i = 0; i < aQueue->fill; ++i) {
-            printf("%3u: prio %u, size %u {", i, aQueue->message[i].prio, aQueue->message[i].size);
-            const uint8_t *const data = aQueue->message[i].msg;
-            for (msgsize_t j = 0; j < aQueue->message[i].size; ++j) {
-                printf(" %02x", data[j]);
-            }
-            printf(" }\n");
+            pq_dump_slot(aQueue, i);
         }
     }
     printf("\n");
-    sc = pthread_mutex_unlock(&aQueue->mtx);
+    sc = pq_unlock(aQueue);
+    return sc;
+}
+
+/******************************************************************************/
+/*!
+ * Print one message slot of a queue.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aIndex      Slot index.
+ */
+void pq_dump_slot(const struct pq_queue *aQueue, msgindex_t aIndex) {
+    printf("%3u: prio %u, size %u {", aIndex, aQueue->message[aIndex].prio, aQueue->message[aIndex].size);
+    const uint8_t *const data = pq_data(aQueue, aIndex);
+    for (msgsize_t j = 0; j < aQueue->message[aIndex].size; ++j) {
+        printf(" %02x", data[j]);
+    }
+    printf(" }\n");
+}
+
+/******************************************************************************/
+/*!
+ * Lock a queue's mutex.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aOp         Operation type (PQ_OP_*) the lock is taken for.
+ * @return  0           Success.
+ * @return  Otherwise status code of failed pthread call.
+ *
+ * If a process died holding the robust mutex of a shared queue, the mutex
+ * is made consistent again. Queue operations with the mutex held are short
+ * and the queue is assumed usable.
+ *
+ * With PQ_PROFILE defined, a trylock first detects contention, and the
+ * time until the mutex is acquired is recorded as wait time of aOp.
+ */
+pq_status_t pq_lock(struct pq_queue *aQueue, unsigned aOp) {
+#ifdef PQ_PROFILE
+    const uint64_t t0 = pq_now_ns();
+    pq_status_t sc = pthread_mutex_trylock(&aQueue->mtx);
+    const int contended = (sc == EBUSY);
+    if (contended) {
+        sc = pthread_mutex_lock(&aQueue->mtx);
+    }
+    if (sc == EOWNERDEAD) {
+        sc = pthread_mutex_consistent(&aQueue->mtx);
+    }
+    if (sc == 0) {
+        const uint64_t t1 = pq_now_ns();
+        struct pq_lock_profile *const p = &aQueue->profile.op[aOp];
+        ++p->acquired;
+        if (contended) {
+            ++p->contended;
+        }
+        pq_profile_record(p->wait_hist, &p->wait_ns, &p->wait_max_ns, t1 - t0);
+        aQueue->prof_op = aOp;
+        aQueue->prof_t0 = t1;
+    }
+#else
+    pq_status_t sc = pthread_mutex_lock(&aQueue->mtx);
+    if (sc == EOWNERDEAD) {
+        sc = pthread_mutex_consistent(&aQueue->mtx);
+    }
+#endif
+    if ((sc == 0) && aQueue->numa_side) {
+        pq_numa_settle(aQueue, aOp);
+    }
+    return sc;
+}
+
+/******************************************************************************/
+/*!
+ * Unlock a queue's mutex.
+ * @param   aQueue      [in] Queue handle.
+ * @return  0           Success.
+ * @return  Otherwise status code of failed pthread call.
+ *
+ * With PQ_PROFILE defined, records the hold time of the current operation.
+ */
+pq_status_t pq_unlock(struct pq_queue *aQueue) {
+#ifdef PQ_PROFILE
+    struct pq_lock_profile *const p = &aQueue->profile.op[aQueue->prof_op];
+    pq_profile_record(p->hold_hist, &p->hold_ns, &p->hold_max_ns, pq_now_ns() - aQueue->prof_t0);
+#endif
+    return pthread_mutex_unlock(&aQueue->mtx);
+}
+
+/******************************************************************************/
+/*!
+ * Convert a CLOCK_MONOTONIC time to nanoseconds.
+ * @param   aTime       [in] Time.
+ * @return  Nanoseconds; negative times become 0.
+ */
+uint64_t pq_ns(const struct timespec *aTime) {
+    if (aTime->tv_sec < 0) {
+        return 0;
+    }
+    return ((uint64_t) aTime->tv_sec * 1000000000u) + (uint64_t) aTime->tv_nsec;
+}
+
+/******************************************************************************/
+/*!
+ * Convert nanoseconds to a CLOCK_MONOTONIC time.
+ * @param   aTime       [out] Time.
+ * @param   aNanoseconds Nanoseconds.
+ */
+void pq_timespec(struct timespec *aTime, uint64_t aNanoseconds) {
+    aTime->tv_sec = (time_t) (aNanoseconds / 1000000000u);
+    aTime->tv_nsec = (long) (aNanoseconds % 1000000000u);
+}
+
+/******************************************************************************/
+/*!
+ * Read the monotonic clock.
+ * @return  Nanoseconds since some unspecified starting point.
+ */
+uint64_t pq_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return pq_ns(&ts);
+}
+
+/******************************************************************************/
+/*!
+ * Add a duration to a log2 histogram, a total and a maximum.
+ * @param   aHist         [inout] Histogram with PQ_PROFILE_BUCKETS buckets.
+ * @param   aTotal        [inout] Sum of durations.
+ * @param   aMax          [inout] Maximum duration.
+ * @param   aNanoseconds  Duration to record.
+ */
+void pq_profile_record(uint64_t *aHist, uint64_t *aTotal, uint64_t *aMax, uint64_t aNanoseconds) {
+    unsigned bucket = 0;
+    for (uint64_t ns = aNanoseconds; (ns > 1) && (bucket < (PQ_PROFILE_BUCKETS - 1)); ns >>= 1) {
+        ++bucket;
+    }
+    ++aHist[bucket];
+    *aTotal += aNanoseconds;
+    if (aNanoseconds > *aMax) {
+        *aMax = aNanoseconds;
+    }
+}
+
+/******************************************************************************/
+/*!
+ * Get a copy of the queue's lock statistics.
+ * @param   aQueue      [in] Queue handle.
+ * @param   aProfile    [out] Lock statistics per operation type.
+ * @return  0           Success.
+ * @return  EINVAL      Invalid argument.
+ * @return  ENOTSUP     Not compiled with PQ_PROFILE.
+ * @return  Otherwise status code of failed pthread call.
+ */
+pq_status_t pq_get_profile(struct pq_queue *aQueue, struct pq_profile *aProfile) {
+    if ((aQueue == NULL) || (aProfile == NULL)) {
+        return EINVAL;
+    }
+#ifdef PQ_PROFILE
+    pq_status_t sc = pq_lock(aQueue, PQ_OP_OTHER);
+    pq_return_if_unsuccessful(sc);
+    *aProfile = aQueue->profile;
+    sc = pq_unlock(aQueue);
+    return sc;
+#else
+    return ENOTSUP;
+#endif
+}
+
+/******************************************************************************/
+/*!
+ * Clear the queue's lock statistics.
+ * @param   aQueue      [in] Queue handle.
+ * @return  0           Success.
+ * @return  EINVAL      Invalid argument.
+ * @return  ENOTSUP     Not compiled with PQ_PROFILE.
+ * @return  Otherwise status code of failed pthread call.
+ */
+pq_status_t pq_reset_profile(struct pq_queue *aQueue) {
+    if (aQueue == NULL) {
+        return EINVAL;
+    }
+#ifdef PQ_PROFILE
+    pq_status_t sc = pq_lock(aQueue, PQ_OP_OTHER);
+    pq_return_if_unsuccessful(sc);
+    memset(aQueue->profile.op, 0, sizeof aQueue->profile.op);
+    sc = pq_unlock(aQueue);
     return sc;
+#else
+    return ENOTSUP;
+#endif
 }
 
 /* vim: set syntax=c tabstop=4 shiftwidth=4 expandtab fileformat=unix: */
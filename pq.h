@@ -1,7 +1,9 @@
 #ifndef PQ_H
 #define PQ_H
 
+#include <stddef.h>
 #include <stdint.h>
+#include <time.h>
 #include <pthread.h>
 
 /* Timeout resolution (frequency); 1L=1s, 1000L=1ms, 1000000L=1us. */
@@ -25,14 +27,129 @@
 /* Return messages in LIFO order. A stack. Ignore prio. */
 #define PQ_ATTR_LIFO  3
 
+/* Return messages in order of due time, each not before it. Ignore prio. */
+#define PQ_ATTR_DELAY 4
+
+/* Serve priorities by deficit round robin, each in FIFO order. */
+#define PQ_ATTR_WFQ   5
+
 /* Maximum value that fits in a msgprio_t. */
 #define PQ_MAXPRIO 65535u
 
-/* Avoid some repetitive code in case of errors. */
+/* Max length of a shared memory object name, including the NUL. */
+#define PQ_NAME_MAX 64
+
+/* Value of pq_queue.magic once a queue is initialized: "QU" and the
+ * version of the layout of the queue's memory block. Persistent files
+ * keep it, so the version goes up whenever that layout changes. */
+#define PQ_MAGIC 0x51550002u
+
+/* Alignment of the regions of a queue descriptor: two 64-byte cache
+ * lines, as adjacent-line prefetch fetches them in pairs. */
+#define PQ_CACHELINE 128
+#if defined(__GNUC__)
+#define PQ_ALIGNED __attribute__((aligned(PQ_CACHELINE)))
+#else
+#define PQ_ALIGNED
+#endif
+
+/* Where a queue's memory comes from. */
+#define PQ_MEM_HEAP 0u
+#define PQ_MEM_SHM  1u
+#define PQ_MEM_FILE 2u
+
+/* When to msync() a persistent queue. */
+#define PQ_SYNC_NONE  0u /* Only in pq_sync() and pq_destroy(). */
+#define PQ_SYNC_EACH  1u /* After every send and receive. */
+#define PQ_SYNC_COUNT 2u /* After sync_every sends and receives. */
+#define PQ_SYNC_TIME  3u /* On send or receive, sync_every timeout units after the last. */
+
+/* Events for pq_get_eventfd(). */
+#define PQ_EVENT_RECV 0u
+#define PQ_EVENT_SEND 1u
+
+/* Lock profiling operation types (see PQ_PROFILE). */
+#define PQ_OP_SEND  0
+#define PQ_OP_RECV  1
+#define PQ_OP_OTHER 2
+#define PQ_OP_COUNT 3
+
+/* Maximum priority of a queue within a queue set. */
+#define PQ_SET_MAXPRIO 31u
+
+/* End of a queue set's ready list. */
+#define PQ_SET_NIL ((msgindex_t)~0u)
+
+/* What a send to a full queue does. */
+#define PQ_FULL_REJECT      0u /* Return EAGAIN or wait. */
+#define PQ_FULL_DROP_OLDEST 1u /* Overwrite the oldest message. FIFO, LIFO. */
+#define PQ_FULL_DROP_LOWEST 2u /* Evict a lowest priority message. PRIOQ, PRIFO. */
+#define PQ_FULL_DROP_NEW    3u /* Drop the message sent. */
+
+/* Mutex types. pq.c never locks a queue it holds, so any type works. */
+#define PQ_MUTEX_DEFAULT   0u /* PQ_MUTEX_ADAPTIVE. */
+#define PQ_MUTEX_RECURSIVE 1u
+#define PQ_MUTEX_NORMAL    2u /* No owner tracking. */
+#define PQ_MUTEX_ADAPTIVE  3u /* Spins briefly before sleeping where
+                               * supported, else PQ_MUTEX_NORMAL. */
+
+/* Mutex protocols for real-time threads. */
+#define PQ_PROTO_NONE    0u
+#define PQ_PROTO_INHERIT 1u /* PTHREAD_PRIO_INHERIT. */
+#define PQ_PROTO_PROTECT 2u /* PTHREAD_PRIO_PROTECT with attr.ceiling. */
+
+/* Placement of a queue's memory on NUMA nodes. */
+#define PQ_NUMA_NONE       0u /* Where it is first touched. */
+#define PQ_NUMA_PRODUCER   1u /* On the node of the first sender. */
+#define PQ_NUMA_CONSUMER   2u /* On the node of the first receiver. */
+#define PQ_NUMA_INTERLEAVE 3u /* Page by page across the allowed nodes. */
+
+/* Number of NUMA nodes a placement covers. */
+#define PQ_NUMA_NODES 1024
+
+/* Results of pq_admit(). */
+#define PQ_ADMIT_INSERT 0u
+#define PQ_ADMIT_FULL   1u
+#define PQ_ADMIT_DROP   2u
+
+/* States of a flat-combining queue's request. */
+#define PQ_REQ_FREE    0u
+#define PQ_REQ_CLAIMED 1u
+#define PQ_REQ_SEND    2u
+#define PQ_REQ_RECV    3u
+#define PQ_REQ_DONE    4u
+
+/* Max number of pauses a flat-combining request waits for the combiner
+ * at work, doubling from one, before it tries the lock again. */
+#define PQ_COMBINE_SPIN 1024u
+
+/* Bits of a slot's key holding the handle, in a queue with handles. */
+#define PQ_HANDLE_MASK ((UINT64_C(1) << 48) - 1u)
+
+/* Free entry of a conflating queue's key index. */
+#define PQ_INDEX_NIL ((msgindex_t)~0u)
+
+/* Max number of priority bands with reserved capacity. */
+#define PQ_BANDS 4
+
+/* Max number of slots pq_purge() looks at per full-queue send. */
+#define PQ_PURGE_STEP 16
+
+/* Number of log2 histogram buckets; bucket i counts [2^i, 2^(i+1)) ns. */
+#define PQ_PROFILE_BUCKETS 32
+
+/* Avoid some repetitive code in case of errors. Only a caller holding
+ * the queue's mutex may unlock it; after a failed pq_lock(), just return. */
+#define pq_return_if_unsuccessful(aStatus) \
+    do { \
+        if ((aStatus) != 0) { \
+            return (aStatus); \
+        } \
+    } while (0)
 #define pq_unlock_and_return_if_unsuccessful(aStatus) \
     do { \
         if ((aStatus) != 0) { \
-            pthread_mutex_unlock(&aQueue->mtx); \
+            pq_unlock(aQueue); \
             return (aStatus); \
         } \
     } while (0)
@@ -58,6 +175,20 @@ typedef uint16_t thrcount_t;
 /* Type for message order attribute. */
 typedef uint16_t msgorder_t;
 
+/* Type for offset of message data within a queue's data area. */
+typedef uint32_t msgoffset_t;
+
+/* Type for handle of a queued message: generation << 16 | data block,
+ * with a 32-bit generation. */
+typedef uint64_t pq_handle_t;
+
+/* Slots reserved for messages of a priority or higher. */
+struct pq_band {
+    msgprio_t prio;
+    /* Percentage of maxmsg, rounded down; 0 for an unused band. */
+    uint16_t percent;
+};
+
 /* Queue attributes. */
 struct pq_attr {
     /* Max number of messages queue can hold. */
@@ -68,17 +199,229 @@ struct pq_attr {
     msgorder_t order;
     /* Maximum priority. */
     msgprio_t maxprio;
+    /* Name of POSIX shared memory object to create queue in, or NULL. */
+    const char *name;
+    /* Path of file to keep a persistent queue in, or NULL. */
+    const char *path;
+    /* When to msync() a persistent queue, PQ_SYNC_*. */
+    uint16_t sync;
+    /* Operations (PQ_SYNC_COUNT) or timeout units (PQ_SYNC_TIME) per sync. */
+    pq_time_t sync_every;
+    /* What a send to a full queue does, PQ_FULL_*. */
+    uint16_t full;
+    /* Nonzero to expire messages by their time to live, pq_msg_ex.ttl. */
+    uint16_t ttl;
+    /* Nonzero for a conflating FIFO queue keeping the latest message per key. */
+    uint16_t conflate;
+    /* Nonzero for a PRIOQ queue whose messages can be cancelled and
+     * reprioritized through handles. */
+    uint16_t handles;
+    /* For PRIOQ and PRIFO, timeout units of waiting that raise a message's
+     * effective priority by one; 0 for strict priority. */
+    pq_time_t aging;
+    /* For PQ_ATTR_WFQ, maxprio + 1 weights of the priorities, indexed by
+     * priority; NULL for priority + 1. */
+    const uint16_t *weights;
+    /* For PQ_ATTR_WFQ, nonzero to share bytes instead of messages. */
+    uint16_t wfq_bytes;
+    /* Capacity reserved for higher priorities. */
+    struct pq_band bands[PQ_BANDS];
+    /* For PRIOQ and PRIFO, number of request entries for flat combining,
+     * about the number of threads; 0 to lock per operation. */
+    uint16_t combine;
+    /* Type of the queue's mutex, PQ_MUTEX_*. */
+    uint16_t mutex;
+    /* Protocol of the queue's mutex, PQ_PROTO_*, and for PQ_PROTO_PROTECT
+     * the priority ceiling. */
+    uint16_t protocol;
+    int     ceiling;
+    /* Placement of the queue's memory, PQ_NUMA_*. */
+    uint16_t numa;
 };
 
-/* Element type of queue's message array. */
+/* Lock statistics of one operation type. */
+struct pq_lock_profile {
+    /* Number of mutex acquisitions. */
+    uint64_t acquired;
+    /* Number of acquisitions where the mutex was already locked. */
+    uint64_t contended;
+    /* Total and maximum time spent waiting for the mutex, in ns. */
+    uint64_t wait_ns;
+    uint64_t wait_max_ns;
+    /* Total and maximum time the mutex was held, in ns. */
+    uint64_t hold_ns;
+    uint64_t hold_max_ns;
+    /* Wait and hold time histograms. */
+    uint64_t wait_hist[PQ_PROFILE_BUCKETS];
+    uint64_t hold_hist[PQ_PROFILE_BUCKETS];
+};
+
+/* Waits of messages received from an aging queue, for one priority. */
+struct pq_wait {
+    /* Number of messages received. */
+    uint64_t count;
+    /* Total and maximum time from send to receive, in ns. */
+    uint64_t wait_ns;
+    uint64_t wait_max_ns;
+    /* Histogram of waits, bucket i holding waits below 2^(i+1) ns. */
+    uint64_t hist[PQ_PROFILE_BUCKETS];
+};
+
+/* Lock statistics of a queue, indexed by PQ_OP_*. */
+struct pq_profile {
+    /* Order of the profiled queue. */
+    msgorder_t order;
+    struct pq_lock_profile op[PQ_OP_COUNT];
+};
+
+/* Message as sent and received. */
 struct pq_msg {
     void   *msg;
     msgsize_t size;
     msgprio_t prio;
 };
 
-/* Priority queue descriptor. */
+/* Message with the metadata of delay, time to live, conflating and handle
+ * queues, as sent by pq_send_ex() and received by pq_recv_ex(). */
+struct pq_msg_ex {
+    /* Data, size and priority. */
+    struct pq_msg base;
+    /* For PQ_ATTR_DELAY, CLOCK_MONOTONIC time when message becomes receivable. */
+    struct timespec due;
+    /* If the queue was created with ttl, time to live in timeout units;
+     * 0 for forever. Not received. */
+    pq_time_t ttl;
+    /* Key of message in a conflating queue. */
+    uint64_t key;
+    /* If not NULL and the queue has handles, receives the message's handle
+     * on send. */
+    pq_handle_t *handle;
+};
+
+/* Queue statistics. */
+struct pq_stats {
+    /* Messages discarded because their time to live ran out. */
+    uint64_t expired;
+    /* Sends that failed on a full queue (PQ_FULL_REJECT). */
+    uint64_t rejected;
+    /* Oldest messages overwritten (PQ_FULL_DROP_OLDEST). */
+    uint64_t overwritten;
+    /* Lowest priority messages evicted (PQ_FULL_DROP_LOWEST). */
+    uint64_t evicted;
+    /* Messages sent but dropped (PQ_FULL_DROP_NEW, or PQ_FULL_DROP_LOWEST
+     * when no queued message has a lower priority). */
+    uint64_t dropped;
+    /* Messages replaced in place by a newer one with the same key. */
+    uint64_t conflated;
+    /* Sends and receives of a flat-combining queue served by another
+     * thread holding the mutex. */
+    uint64_t combined;
+    /* Messages passed from a send directly to a receive, without taking
+     * a slot. */
+    uint64_t handed_off;
+};
+
+/* Header of a message data block in a persistent queue's file. */
+struct pq_record {
+    /* Sequence number of message, 0 if block is free. */
+    uint64_t seq;
+    /* Checksum of header and data. */
+    uint32_t check;
+    msgsize_t size;
+    msgprio_t prio;
+};
+
+/* Element type of queue's message array. */
+struct pq_slot {
+    /* Offset of data in queue's data area; position independent. */
+    msgoffset_t offset;
+    msgsize_t size;
+    msgprio_t prio;
+    /* Due time in ns for PQ_ATTR_DELAY. */
+    uint64_t due;
+    /* Expiry time in ns, or 0 for never. */
+    uint64_t expires;
+    /* Key in a conflating queue. In a queue with handles, the handle in
+     * the bits of PQ_HANDLE_MASK and the priority sent with above them. */
+    uint64_t key;
+};
+
+/* Priority class of a PQ_ATTR_WFQ queue. */
+struct pq_class {
+    /* First and last slot of the class's FIFO. */
+    msgindex_t head;
+    msgindex_t tail;
+    /* Next class in the active list. */
+    msgprio_t next;
+    /* Credit added per turn, and credit left, in messages or bytes. */
+    uint32_t quantum;
+    uint32_t deficit;
+};
+
+/* Message found by pq_journal_recover(). */
+struct pq_recovered {
+    uint64_t seq;
+    struct pq_slot slot;
+};
+
+/* Work left for after a queue's mutex is released, see pq_after_unlock(). */
+struct pq_post {
+    /* Event file descriptor to signal, or -1. */
+    int     eventfd;
+    /* Nonzero if a persistent queue is due for msync(). */
+    int     sync;
+};
+
+/* Thread waiting in line on a full or empty queue. */
+struct pq_waiter {
+    /* Next waiter in the queue's list. */
+    struct pq_waiter *next;
+    /* Condition signalled for this waiter only, where there are no futexes. */
+    pthread_cond_t cond;
+    /* Futex word, set to nonzero when the waiter is woken. */
+    uint32_t state;
+    /* For a sender to a rendezvous queue, message a receiver may take. */
+    const struct pq_msg *send;
+    /* For a receiver, buffer to copy a message handed over into, or NULL. */
+    struct pq_msg *recv;
+    /* For a sender, priority of its message; for a receiver, its own. */
+    msgprio_t prio;
+    /* Nonzero while in the queue's list. */
+    int     linked;
+    /* Nonzero once a message was copied from send or into recv. */
+    int     handed;
+};
+
+/* Send or receive published to the combiner of a flat-combining queue. */
+struct pq_request {
+    /* PQ_REQ_*. */
+    uint32_t state;
+    /* Status of a done request. */
+    pq_status_t status;
+    /* Message to send, or to receive into. */
+    const struct pq_msg *send;
+    struct pq_msg *recv;
+};
+
+struct pq_set;
+
+/* Priority queue descriptor, in regions that different threads write,
+ * each starting on its own PQ_CACHELINE bytes. */
 struct pq_queue {
+    /* Read-mostly region: set up by pq_create(), then only read. */
+    /* PQ_MAGIC once initialized. */
+    uint32_t magic;
+    /* Where the memory of this queue comes from, PQ_MEM_*. */
+    uint16_t memory;
+    /* Size in bytes of this queue, including slots and data. */
+    size_t  mapsize;
+    /* Name of shared memory object, or empty. */
+    char    name[PQ_NAME_MAX];
+    /* Locked file descriptor of a persistent queue, or -1. */
+    int     fd;
+    /* Sync policy of a persistent queue, PQ_SYNC_*, and its argument. */
+    uint16_t sync;
+    pq_time_t sync_every;
     /* Max number of messages queue can hold. */
     msgindex_t maxmsg;
     /* Max size of message in bytes. */
@@ -87,44 +430,285 @@ struct pq_queue {
     msgorder_t order;
     /* Maximum priority. */
     msgprio_t maxprio;
-    /* Array of messages. */
-    struct pq_msg *message;
+    /* What a send to a full queue does, PQ_FULL_*. */
+    uint16_t full;
+    /* Nonzero if messages expire by their time to live. */
+    uint16_t ttl;
+    /* Nonzero if messages carry metadata, so that every pq_msg handled
+     * inside is the base of a pq_msg_ex. */
+    uint16_t meta;
+    /* Priority bands sorted by priority, each with the number of messages
+     * a message below its priority may fill the queue to. */
+    uint16_t bands;
+    msgprio_t band_prio[PQ_BANDS];
+    msgindex_t band_limit[PQ_BANDS];
+    /* Nonzero if top is published. */
+    uint16_t publish_top;
+    /* Mutex attribute. */
+    pthread_mutexattr_t attr;
+    /* Queue set this queue belongs to, or NULL. */
+    struct pq_set *set;
+    /* Index of this queue within its set. */
+    msgindex_t set_index;
+    /* Event file descriptors indexed by PQ_EVENT_*, or -1. */
+    int eventfd[2];
+    /* Offset of the index from the queue's start, and for the key index
+     * its size - 1; index_mask is 0 if the queue does not conflate. */
+    uint32_t index_offset;
+    uint32_t index_mask;
+    /* Nonzero if the index maps data blocks to slots for handles. */
+    uint16_t handles;
+    /* Aging interval in ns, or 0 for strict priority. */
+    uint64_t aging_ns;
+    /* Offset of the wait statistics of an aging queue from its start. */
+    uint32_t wait_offset;
+    /* For PQ_ATTR_WFQ: offset of the classes from the queue's start, and
+     * cost of messages. */
+    uint32_t class_offset;
+    uint16_t wfq_bytes;
+    /* Nonzero if threads wait in line in lists of waiters, indexed by
+     * PQ_OP_SEND and PQ_OP_RECV, instead of on ready_to_send and
+     * ready_to_recv; waiters are process-local. */
+    uint16_t wait_lists;
+    /* Nonzero if senders may hand messages to waiting receivers. */
+    uint16_t handoff;
+    /* Number of request entries of a flat-combining queue, and their
+     * offset from the queue's start. */
+    uint16_t combine;
+    uint32_t request_offset;
+    /* PQ_OP_SEND or PQ_OP_RECV + 1 if the queue moves to the node of the
+     * first thread locking it for that operation, else 0. */
+    uint16_t numa_side;
+
+    /* Published region: written with mutex held, readable without. */
     /* Number of messages in queue. */
-    msgindex_t fill;
+    msgindex_t fill PQ_ALIGNED;
+    /* If publish_top is nonzero, priority of the next message. */
+    msgprio_t top;
+
+    /* Producer region. */
+    /* Number of threads waiting to send to a full queue; with wait lists,
+     * those in the list. */
+    thrcount_t waiting_to_send PQ_ALIGNED;
+    /* Condition indicating queue no longer full. */
+    pthread_cond_t ready_to_send;
+
+    /* Consumer region. */
+    /* Number of threads waiting to recv from an empty queue; with wait
+     * lists, those in the list. */
+    thrcount_t waiting_to_recv PQ_ALIGNED;
+    /* Condition indicating queue no longer empty. */
+    pthread_cond_t ready_to_recv;
+
+    /* Locked region: the mutex and the state it protects. */
+    /* Mutex to protect queue state. */
+    pthread_mutex_t mtx PQ_ALIGNED;
     /* Index of head element. */
     msgindex_t head;
     /* Index of tail element. */
     msgindex_t tail;
-    /* Mutex to protect queue state. */
+    /* Sequence number of the next journal record. */
+    uint64_t seq;
+    /* Journal operations since the last sync, and time of the last sync. */
+    uint32_t unsynced;
+    uint64_t synced_ns;
+    /* Queue statistics. */
+    struct pq_stats stats;
+    /* Position where pq_purge() continues. */
+    msgindex_t purge;
+    /* For PQ_ATTR_WFQ: first free slot, and the list of non-empty classes. */
+    msgindex_t free;
+    msgprio_t active_head;
+    msgprio_t active_tail;
+    /* Lists of waiters, see wait_lists. */
+    struct pq_waiter *waiter_head[2];
+    struct pq_waiter *waiter_tail[2];
+#ifdef PQ_PROFILE
+    /* Lock statistics. */
+    struct pq_profile profile;
+    /* Operation type of current mutex holder. */
+    unsigned prof_op;
+    /* Time the current holder acquired the mutex, in ns. */
+    uint64_t prof_t0;
+#endif
+    /* Array of messages, followed by data area of maxmsg blocks. */
+    struct pq_slot message[] PQ_ALIGNED;
+};
+
+/* Member of a queue set. */
+struct pq_set_member {
+    /* Member queue. */
+    struct pq_queue *queue;
+    /* Priority; ready members with higher priority are served first. */
+    msgprio_t prio;
+    /* Messages received from this member per turn. */
+    msgindex_t weight;
+    /* Messages left in the current turn. */
+    msgindex_t credit;
+    /* Nonzero while in a ready list or claimed by a receiver. */
+    uint16_t ready;
+    /* Next member in ready list, or PQ_SET_NIL. */
+    msgindex_t next;
+};
+
+/* Queue set descriptor. */
+struct pq_set {
+    /* Max number of member queues. */
+    msgindex_t maxqueues;
+    /* Number of member queues. */
+    msgindex_t count;
+    /* Array of members. */
+    struct pq_set_member *member;
+    /* Bit p set if ready list of priority p is not empty. */
+    uint32_t readymask;
+    /* Ready lists of members that may have messages, one per priority. */
+    msgindex_t head[PQ_SET_MAXPRIO + 1];
+    msgindex_t tail[PQ_SET_MAXPRIO + 1];
+    /* Mutex to protect set state. Locked after a member queue's mutex. */
     pthread_mutex_t mtx;
-    /* Mutex attribute. */
-    pthread_mutexattr_t attr;
-    /* Number of threads waiting to send to a full queue. */
+    /* Number of threads waiting for a ready member. */
+    thrcount_t waiting;
+    /* Condition indicating a ready list is no longer empty. */
+    pthread_cond_t ready;
+};
+
+/* Sharded queue: independent lanes with aggregated blocking. */
+struct pq_shard {
+    /* Number of lanes. */
+    msgindex_t lanes;
+    /* Nonzero for a relaxed priority queue from pq_multi_create(). */
+    uint16_t relaxed;
+    /* Thread-specific home lane + 1, or NULL before first use; for a
+     * relaxed queue, random state. */
+    pthread_key_t home;
+    /* Next home lane or random seed to hand out. */
+    unsigned next_home;
+    /* Mutex for waiting while all lanes are full or empty. */
+    pthread_mutex_t mtx;
+    /* Number of threads waiting; read without mutex. */
     thrcount_t waiting_to_send;
-    /* Condition indicating queue no longer full. */
-    pthread_cond_t ready_to_send;
-    /* Number of threads waiting to recv from an empty queue. */
     thrcount_t waiting_to_recv;
-    /* Condition indicating queue no longer empty. */
+    /* Conditions indicating some lane took or got a message. */
+    pthread_cond_t ready_to_send;
     pthread_cond_t ready_to_recv;
+    struct pq_queue *lane[];
 };
 
 /* Public functions. */
 pq_status_t pq_create(struct pq_queue **aQueue, const struct pq_attr *aAttributes);
 pq_status_t pq_destroy(struct pq_queue *aQueue);
+pq_status_t pq_open(struct pq_queue **aQueue, const char *aName);
+pq_status_t pq_close(struct pq_queue *aQueue);
+pq_status_t pq_sync(struct pq_queue *aQueue);
 
 pq_status_t pq_recv_nonbl(struct pq_queue *aQueue, struct pq_msg *aMessage);
 pq_status_t pq_recv_timed(struct pq_queue *aQueue, struct pq_msg *aMessage, pq_time_t aTimeout);
+pq_status_t pq_recv_prio(struct pq_queue *aQueue, struct pq_msg *aMessage, msgprio_t aPrio, pq_time_t aTimeout);
 
 pq_status_t pq_send_nonbl(struct pq_queue *aQueue, const struct pq_msg *aMessage);
 pq_status_t pq_send_timed(struct pq_queue *aQueue, const struct pq_msg *aMessage, pq_time_t aTimeout);
 
+pq_status_t pq_recv_until(struct pq_queue *aQueue, struct pq_msg *aMessage, const struct timespec *aDeadline);
+pq_status_t pq_send_until(struct pq_queue *aQueue, const struct pq_msg *aMessage, const struct timespec *aDeadline);
+
+pq_status_t pq_recv_ex(struct pq_queue *aQueue, struct pq_msg_ex *aMessage, pq_time_t aTimeout);
+pq_status_t pq_send_ex(struct pq_queue *aQueue, const struct pq_msg_ex *aMessage, pq_time_t aTimeout);
+
+pq_status_t pq_set_create(struct pq_set **aSet, msgindex_t aMaxQueues);
+pq_status_t pq_set_destroy(struct pq_set *aSet);
+pq_status_t pq_set_add(struct pq_set *aSet, struct pq_queue *aQueue, msgprio_t aPrio, msgindex_t aWeight, msgindex_t *aIndex);
+pq_status_t pq_select(struct pq_set *aSet, msgindex_t *aIndex, pq_time_t aTimeout);
+pq_status_t pq_recv_any(struct pq_set *aSet, struct pq_msg *aMessage, msgindex_t *aIndex, pq_time_t aTimeout);
+
+pq_status_t pq_shard_create(struct pq_shard **aShard, const struct pq_attr *aAttributes, msgindex_t aLanes);
+pq_status_t pq_shard_destroy(struct pq_shard *aShard);
+pq_status_t pq_multi_create(struct pq_shard **aShard, const struct pq_attr *aAttributes, msgindex_t aHeaps);
+pq_status_t pq_shard_send(struct pq_shard *aShard, const struct pq_msg *aMessage, pq_time_t aTimeout);
+pq_status_t pq_shard_recv(struct pq_shard *aShard, struct pq_msg *aMessage, pq_time_t aTimeout);
+
+pq_status_t pq_get_eventfd(struct pq_queue *aQueue, unsigned aEvent, int *aFd);
+pq_status_t pq_get_stats(struct pq_queue *aQueue, struct pq_stats *aStats);
+pq_status_t pq_cancel(struct pq_queue *aQueue, pq_handle_t aHandle);
+pq_status_t pq_change_prio(struct pq_queue *aQueue, pq_handle_t aHandle, msgprio_t aPrio);
+pq_status_t pq_get_wait(struct pq_queue *aQueue, msgprio_t aPrio, struct pq_wait *aWait);
+
 /* Helper/debug functions. */
 pq_status_t pq_dump(struct pq_queue *aQueue);
+void    pq_dump_slot(const struct pq_queue *aQueue, msgindex_t aIndex);
 pq_status_t pq_get_fill(struct pq_queue *aQueue, msgindex_t *aFill);
+pq_status_t pq_peek_fill(struct pq_queue *aQueue, msgindex_t *aFill);
+pq_status_t pq_get_profile(struct pq_queue *aQueue, struct pq_profile *aProfile);
+pq_status_t pq_reset_profile(struct pq_queue *aQueue);
 
 /* Private functions. */
 pq_status_t pq_cleanup(struct pq_queue *aQueue, pq_status_t aItems, pq_status_t aStatus);
+pq_status_t pq_alloc(struct pq_queue **aQueue, const struct pq_attr *aAttributes);
+pq_status_t pq_alloc_file(struct pq_queue **aQueue, const struct pq_attr *aAttributes, size_t aSize);
+size_t  pq_stride(const struct pq_attr *aAttributes);
+size_t  pq_index_offset(const struct pq_attr *aAttributes);
+size_t  pq_index_capacity(const struct pq_attr *aAttributes);
+msgindex_t *pq_index(const struct pq_queue *aQueue);
+uint32_t pq_index_home(const struct pq_queue *aQueue, uint64_t aKey);
+uint32_t pq_index_probe(const struct pq_queue *aQueue, uint64_t aKey);
+void    pq_index_remove(struct pq_queue *aQueue, uint64_t aKey);
+int     pq_conflate(struct pq_queue *aQueue, const struct pq_msg *aMessage);
+size_t  pq_wait_offset(const struct pq_attr *aAttributes);
+struct pq_wait *pq_waits(const struct pq_queue *aQueue);
+uint64_t pq_aged_due(const struct pq_queue *aQueue, msgprio_t aPrio);
+void    pq_aged(struct pq_queue *aQueue, msgindex_t aIndex);
+msgindex_t pq_shard_home(struct pq_shard *aShard);
+msgindex_t pq_shard_random(struct pq_shard *aShard);
+msgindex_t pq_shard_pick(struct pq_shard *aShard, unsigned aOp);
+void    pq_publish_top(struct pq_queue *aQueue);
+pq_status_t pq_shard_try(struct pq_shard *aShard, struct pq_msg *aMessage, unsigned aOp);
+pq_status_t pq_shard_wait(struct pq_shard *aShard, struct pq_msg *aMessage, unsigned aOp, pq_time_t aTimeout);
+void    pq_shard_wake(struct pq_shard *aShard, thrcount_t *aWaiting, pthread_cond_t *aCond);
+size_t  pq_class_offset(const struct pq_attr *aAttributes);
+struct pq_class *pq_classes(const struct pq_queue *aQueue);
+int     pq_wfq_invalid(const struct pq_attr *aAttributes);
+uint32_t pq_wfq_cost(const struct pq_queue *aQueue, msgindex_t aIndex);
+void    pq_wfq_activate(struct pq_queue *aQueue, msgprio_t aPrio);
+msgprio_t pq_wfq_pop(struct pq_queue *aQueue);
+void    pq_wfq_settle(struct pq_queue *aQueue);
+void    pq_wfq_unlink(struct pq_queue *aQueue, msgindex_t aIndex, msgindex_t aPrev);
+int     pq_handoff_possible(const struct pq_attr *aAttributes);
+pq_status_t pq_handoff(struct pq_queue *aQueue, const struct pq_msg *aMessage, int *aHanded);
+pq_status_t pq_take(struct pq_queue *aQueue, struct pq_msg *aMessage, int *aTaken);
+pq_status_t pq_send_try(struct pq_queue *aQueue, const struct pq_msg *aMessage);
+pq_status_t pq_send_wait(struct pq_queue *aQueue, const struct pq_msg *aMessage, const struct timespec *aDeadline);
+pq_status_t pq_recv_try(struct pq_queue *aQueue, struct pq_msg *aMessage);
+pq_status_t pq_recv_plain(struct pq_queue *aQueue, struct pq_msg *aMessage, msgprio_t aPrio,
+                          const struct timespec *aDeadline);
+pq_status_t pq_recv_ranked(struct pq_queue *aQueue, struct pq_msg *aMessage, msgprio_t aPrio,
+                           const struct timespec *aDeadline);
+pq_status_t pq_park(struct pq_queue *aQueue, unsigned aOp, const struct pq_msg *aSend, struct pq_msg *aRecv,
+                    msgprio_t aPrio, const struct timespec *aDeadline, int *aFront, int *aReleased);
+pq_status_t pq_waiter_wake(struct pq_waiter *aWaiter);
+pq_status_t pq_futex_wait(uint32_t *aWord, const struct timespec *aDeadline);
+pq_status_t pq_wake_senders(struct pq_queue *aQueue, msgindex_t aCount);
+void    pq_waiter_push(struct pq_queue *aQueue, unsigned aOp, struct pq_waiter *aWaiter, int aFront);
+struct pq_waiter *pq_waiter_pop(struct pq_queue *aQueue, unsigned aOp);
+void    pq_waiter_unlink(struct pq_queue *aQueue, unsigned aOp, struct pq_waiter *aWaiter);
+size_t  pq_request_offset(const struct pq_attr *aAttributes);
+struct pq_request *pq_requests(const struct pq_queue *aQueue);
+pq_status_t pq_combine(struct pq_queue *aQueue, const struct pq_msg *aSend, struct pq_msg *aRecv);
+void    pq_pause(void);
+pq_status_t pq_combine_batch(struct pq_queue *aQueue, const struct pq_request *aOwn, struct pq_post *aPost);
+pq_status_t pq_combine_done(struct pq_queue *aQueue, struct pq_request *aRequest, const struct pq_request *aOwn,
+                            pq_status_t aStatus, struct pq_post *aPost, pq_status_t aSofar);
+pq_status_t pq_numa_place(struct pq_queue *aQueue, int aMode, const unsigned long *aNodes);
+pq_status_t pq_numa_interleave(struct pq_queue *aQueue);
+void    pq_numa_settle(struct pq_queue *aQueue, unsigned aOp);
+pq_status_t pq_handle_find(const struct pq_queue *aQueue, pq_handle_t aHandle, msgindex_t *aIndex);
+void   *pq_data(const struct pq_queue *aQueue, msgindex_t aIndex);
+struct pq_record *pq_record(const struct pq_queue *aQueue, msgoffset_t aOffset);
+uint32_t pq_checksum(const struct pq_record *aRecord);
+void    pq_journal_write(struct pq_queue *aQueue, msgoffset_t aOffset, const struct pq_msg *aMessage);
+void    pq_journal_clear(struct pq_queue *aQueue, msgoffset_t aOffset);
+pq_status_t pq_journal_recover(struct pq_queue *aQueue);
+int     pq_recovered_by_seq(const void *aLeft, const void *aRight);
+int     pq_recovered_by_prio(const void *aLeft, const void *aRight);
+int     pq_sync_due(struct pq_queue *aQueue);
 void    pq_insert(struct pq_queue *aQueue, const struct pq_msg *aMessage);
 void    pq_insert_prioq(struct pq_queue *aQueue, const struct pq_msg *aMessage);
 void    pq_insert_fifo(struct pq_queue *aQueue, const struct pq_msg *aMessage);
@@ -135,9 +719,54 @@ void    pq_remove_prioq(struct pq_queue *aQueue, struct pq_msg *const aMessage);
 void    pq_remove_fifo(struct pq_queue *aQueue, struct pq_msg *const aMessage);
 void    pq_remove_lifo(struct pq_queue *aQueue, struct pq_msg *const aMessage);
 void    pq_remove_prifo(struct pq_queue *aQueue, struct pq_msg *const aMessage);
+void    pq_insert_delay(struct pq_queue *aQueue, const struct pq_msg *aMessage);
+void    pq_remove_delay(struct pq_queue *aQueue, struct pq_msg *const aMessage);
+void    pq_insert_wfq(struct pq_queue *aQueue, const struct pq_msg *aMessage);
+void    pq_remove_wfq(struct pq_queue *aQueue, struct pq_msg *const aMessage);
+int     pq_receivable(struct pq_queue *aQueue, uint64_t *aDue);
+msgindex_t pq_next(const struct pq_queue *aQueue);
+uint64_t pq_expires(const struct pq_queue *aQueue, const struct pq_msg *aMessage);
+uint64_t pq_first_expiry(const struct pq_queue *aQueue);
+void    pq_expired(struct pq_queue *aQueue, msgindex_t aCount);
+int     pq_full(struct pq_queue *aQueue, msgprio_t aPrio);
+msgindex_t pq_limit(const struct pq_queue *aQueue, msgprio_t aPrio);
+void    pq_bands_init(struct pq_queue *aQueue, const struct pq_attr *aAttributes);
+unsigned pq_admit(struct pq_queue *aQueue, const struct pq_msg *aMessage);
+msgindex_t pq_lowest(const struct pq_queue *aQueue);
+int     pq_ring(const struct pq_queue *aQueue);
+int     pq_full_policy_invalid(const struct pq_attr *aAttributes);
+void    pq_purge(struct pq_queue *aQueue, msgindex_t aSteps);
+void    pq_delete_at(struct pq_queue *aQueue, msgindex_t aIndex);
+int     pq_heap_above(const struct pq_queue *aQueue, msgindex_t aFirst, msgindex_t aSecond);
+void    pq_heap_fix(struct pq_queue *aQueue, msgindex_t aIndex);
+int     pq_minmax(const struct pq_queue *aQueue);
+int     pq_minmax_level(msgindex_t aIndex);
+int     pq_minmax_above(const struct pq_queue *aQueue, msgindex_t aFirst, msgindex_t aSecond, int aMax);
+msgindex_t pq_minmax_up(struct pq_queue *aQueue, msgindex_t aIndex, int aMax);
+void    pq_minmax_down(struct pq_queue *aQueue, msgindex_t aIndex);
+void    pq_minmax_fix(struct pq_queue *aQueue, msgindex_t aIndex);
 void    pq_add_time(struct timespec *aTime, pq_time_t aIncrement);
-void    pq_swap(struct pq_msg *aMessage, msgindex_t aFirst, msgindex_t aSecond);
+pq_status_t pq_notify_recv(struct pq_queue *aQueue, struct pq_post *aPost);
+pq_status_t pq_notify_send(struct pq_queue *aQueue, struct pq_post *aPost);
+void    pq_after_unlock(struct pq_queue *aQueue, const struct pq_post *aPost);
+void    pq_eventfd_signal(int aFd);
+pq_status_t pq_set_notify(struct pq_queue *aQueue);
+pq_status_t pq_set_claim(struct pq_set *aSet, msgindex_t *aIndex, const struct timespec *aDeadline);
+void    pq_set_push(struct pq_set *aSet, msgindex_t aIndex, int aFront);
+void    pq_set_unclaim(struct pq_set *aSet, msgindex_t aIndex);
+void    pq_set_fill(struct pq_queue *aQueue, msgindex_t aFill);
+void    pq_swap(struct pq_queue *aQueue, msgindex_t aFirst, msgindex_t aSecond);
 pq_status_t pq_cond_timedwait(pthread_cond_t *aCond, pthread_mutex_t *aMutex, pq_time_t aTimeout);
+pq_status_t pq_cond_init(pthread_cond_t *aCond, int aShared);
+pq_status_t pq_deadline(struct timespec *aDeadline, pq_time_t aTimeout);
+pq_status_t pq_wait(struct pq_queue *aQueue, pthread_cond_t *aCond, const struct timespec *aDeadline);
+pq_status_t pq_lock(struct pq_queue *aQueue, unsigned aOp);
+pq_status_t pq_trylock(struct pq_queue *aQueue, unsigned aOp);
+pq_status_t pq_unlock(struct pq_queue *aQueue);
+uint64_t pq_now_ns(void);
+uint64_t pq_ns(const struct timespec *aTime);
+void    pq_timespec(struct timespec *aTime, uint64_t aNanoseconds);
+void    pq_profile_record(uint64_t *aHist, uint64_t *aTotal, uint64_t *aMax, uint64_t aNanoseconds);
 
 #endif /* PQ_H */
 
@@ -4,6 +4,8 @@
 #include <errno.h>
 #include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
 #include "pq.h"
 #include "unity.h"
 
@@ -15,12 +17,26 @@
 /* Default queues, one for each attribute, indexed by PQ_ATTR_*. */
 struct pq_queue *gQueue[4] = { NULL };
 
+/* Message a test thread sends to a queue. */
+struct test_sender {
+    struct pq_queue *queue;
+    char    value;
+};
+
+/* Receiver of a priority in a test thread, and the message it got. */
+struct test_receiver {
+    struct pq_queue *queue;
+    msgprio_t prio;
+    char    value;
+};
+
 /* Get array element count. */
 #define ELEMENTS(aArray) (sizeof(aArray) / sizeof(*aArray))
 
 void    setUp(void), tearDown(void);
 void    send_message_array(struct pq_queue *aQueue, const struct pq_msg *aArray, msgindex_t aCount);
 void    recv_message_array(struct pq_queue *aQueue, struct pq_msg *aArray, msgindex_t aCount);
+uint64_t profile_holds(const struct pq_lock_profile *aProfile);
 
 void    test_pq_macros(void);
 void    test_pq_create(void);
@@ -37,6 +53,42 @@ void    test_pq_remove_prioq(void);
 void    test_pq_remove_prifo(void);
 void    test_pq_swap(void);
 void    test_pq_cond_timedwait(void);
+void    test_pq_profile(void);
+void    test_pq_until(void);
+void   *test_pq_until_task(void *aUnused);
+void    test_pq_shared(void);
+void    test_pq_persist(void);
+void    test_pq_delay(void);
+void    test_pq_ttl(void);
+void    test_pq_expire(pq_time_t aTtl);
+void    test_pq_full_policy(void);
+void    test_pq_conflate(void);
+void    test_pq_handles(void);
+void    test_pq_aging(void);
+void    test_pq_wfq(void);
+void    test_pq_bands(void);
+void    test_pq_shard(void);
+void   *test_pq_shard_task(void *aShard);
+void    test_pq_multi(void);
+void    test_pq_combine(void);
+void    test_pq_handoff(void);
+void   *test_pq_handoff_task(void *aQueue);
+void   *test_pq_handoff_recv_task(void *aReceiver);
+void    test_pq_wait_lists(void);
+void   *test_pq_wait_lists_task(void *aSender);
+void    test_pq_recv_prio(void);
+void   *test_pq_recv_prio_task(void *aReceiver);
+void    test_pq_mutex(void);
+void   *test_pq_mutex_task(void *aQueue);
+void    test_pq_layout(void);
+void    test_pq_numa(void);
+void   *test_pq_delay_task(void *aQueue);
+void    test_pq_peek_fill(void);
+void    test_pq_eventfd(void);
+void    test_pq_set(void);
+void    test_pq_set_blocking(void);
+void   *test_pq_set_recv_task(void *aSet);
+void   *test_pq_set_unclaim_task(void *aSet);
 void    test_pq_send_blocking(void);
 void    test_pq_recv_blocking(void);
 void   *test_pq_blocking_send_task(void *aQueue);
@@ -85,6 +137,14 @@ void recv_message_array(struct pq_queue *aQueue, struct pq_msg *aArray, msgindex
     }
 }
 
+uint64_t profile_holds(const struct pq_lock_profile *aProfile) {
+    uint64_t holds = 0;
+    for (size_t i = 0; i < PQ_PROFILE_BUCKETS; ++i) {
+        holds += aProfile->hold_hist[i];
+    }
+    return holds;
+}
+
 /******************************************************************************/
 
 void test_pq_macros(void) {
@@ -149,7 +209,7 @@ void test_pq_send_nonbl(void) {
         TEST_ASSERT_EQUAL(EINVAL, pq_send_nonbl(gQueue[order], &m));
         m.prio = Q_MAXPRIO;
         TEST_ASSERT_EQUAL(0, pq_send_nonbl(gQueue[order], &m));
-        TEST_ASSERT_EQUAL_STRING("foo", gQueue[order]->message[0].msg);
+        TEST_ASSERT_EQUAL_STRING("foo", pq_data(gQueue[order], 0));
         TEST_ASSERT_EQUAL(4, gQueue[order]->message[0].size);
         TEST_ASSERT_EQUAL(Q_MAXPRIO, gQueue[order]->message[0].prio);
     }
@@ -456,35 +516,44 @@ void test_pq_add_time(void) {
 /******************************************************************************/
 
 void test_pq_swap(void) {
-    struct pq_msg msg[3] = {
-        {.msg = "foo",.size = 4,.prio = 42},
-        {.msg = "barf",.size = 5,.prio = 43},
-        {.msg = "bazzz",.size = 6,.prio = 44},
-    };
+    struct pq_attr attr = {.maxmsg = 3,.msgsize = Q_MSGSIZE,.order = PQ_ATTR_PRIOQ,.maxprio = Q_MAXPRIO,.handles = 1 };
+    struct pq_queue *q = NULL;
+    TEST_ASSERT_EQUAL(0, pq_create(&q, &attr));
+    struct pq_slot *const msg = q->message;
+    for (msgindex_t i = 0; i < 3; ++i) {
+        msg[i].offset = 12u * i;
+        msg[i].size = 4 + i;
+        msg[i].prio = 42 + i;
+    }
     /* Swapping identical elements should be a no-op. */
     for (msgindex_t i = 0; i < 3; ++i) {
-        pq_swap(msg, i, i);
-        TEST_ASSERT_EQUAL_STRING("foo", msg[0].msg);
+        pq_swap(q, i, i);
+        TEST_ASSERT_EQUAL(0, msg[0].offset);
         TEST_ASSERT_EQUAL(4, msg[0].size);
         TEST_ASSERT_EQUAL(42, msg[0].prio);
-        TEST_ASSERT_EQUAL_STRING("barf", msg[1].msg);
+        TEST_ASSERT_EQUAL(12, msg[1].offset);
         TEST_ASSERT_EQUAL(5, msg[1].size);
         TEST_ASSERT_EQUAL(43, msg[1].prio);
-        TEST_ASSERT_EQUAL_STRING("bazzz", msg[2].msg);
+        TEST_ASSERT_EQUAL(24, msg[2].offset);
         TEST_ASSERT_EQUAL(6, msg[2].size);
         TEST_ASSERT_EQUAL(44, msg[2].prio);
     }
     /* Swapping should only modify the selected elements. */
-    pq_swap(msg, 0, 1);
-    TEST_ASSERT_EQUAL_STRING("barf", msg[0].msg);
+    pq_swap(q, 0, 1);
+    TEST_ASSERT_EQUAL(12, msg[0].offset);
     TEST_ASSERT_EQUAL(5, msg[0].size);
     TEST_ASSERT_EQUAL(43, msg[0].prio);
-    TEST_ASSERT_EQUAL_STRING("foo", msg[1].msg);
+    TEST_ASSERT_EQUAL(0, msg[1].offset);
     TEST_ASSERT_EQUAL(4, msg[1].size);
     TEST_ASSERT_EQUAL(42, msg[1].prio);
-    TEST_ASSERT_EQUAL_STRING("bazzz", msg[2].msg);
+    TEST_ASSERT_EQUAL(24, msg[2].offset);
     TEST_ASSERT_EQUAL(6, msg[2].size);
     TEST_ASSERT_EQUAL(44, msg[2].prio);
+    /* The position index follows the data blocks. */
+    TEST_ASSERT_EQUAL(1, pq_index(q)[0]);
+    TEST_ASSERT_EQUAL(0, pq_index(q)[1]);
+    TEST_ASSERT_EQUAL(2, pq_index(q)[2]);
+    TEST_ASSERT_EQUAL(0, pq_destroy(q));
 }
 
 /******************************************************************************/
@@ -678,14 +747,1577 @@ void   *test_pq_stress_recv_task(void *aQueue) {
 /******************************************************************************/
 
 void test_pq_cond_timedwait(void) {
-    /* When not called from a task, causes EPERM. */
+    /* When not called from a task, a recursive mutex causes EPERM. */
+    for (msgorder_t order = 0; order < ELEMENTS(gQueue); ++order) {
+        const struct pq_attr attr = {.maxmsg = Q_MAXMSG,.msgsize = Q_MSGSIZE,.order = order,.maxprio = Q_MAXPRIO,
+            .mutex = PQ_MUTEX_RECURSIVE
+        };
+        struct pq_queue *q = NULL;
+        TEST_ASSERT_EQUAL(0, pq_create(&q, &attr));
+        TEST_ASSERT_EQUAL(EPERM, pq_cond_timedwait(&q->ready_to_send, &q->mtx, 1));
+        TEST_ASSERT_EQUAL(0, pq_destroy(q));
+    }
+}
+
+/******************************************************************************/
+
+void test_pq_peek_fill(void) {
+    for (msgorder_t order = 0; order < ELEMENTS(gQueue); ++order) {
+        char    data[Q_MSGSIZE];
+        struct pq_msg m = {.msg = "foo",.size = 4,.prio = 1 };
+        msgindex_t fill = 42;
+        TEST_ASSERT_EQUAL(EINVAL, pq_peek_fill(NULL, &fill));
+        TEST_ASSERT_EQUAL(EINVAL, pq_peek_fill(gQueue[order], NULL));
+        TEST_ASSERT_EQUAL(0, pq_peek_fill(gQueue[order], &fill));
+        TEST_ASSERT_EQUAL(0, fill);
+        for (msgindex_t i = 1; i <= Q_MAXMSG; ++i) {
+            TEST_ASSERT_EQUAL(0, pq_send_nonbl(gQueue[order], &m));
+            TEST_ASSERT_EQUAL(0, pq_peek_fill(gQueue[order], &fill));
+            TEST_ASSERT_EQUAL(i, fill);
+        }
+        m.msg = data;
+        for (msgindex_t i = Q_MAXMSG; i > 0; --i) {
+            TEST_ASSERT_EQUAL(0, pq_recv_nonbl(gQueue[order], &m));
+            TEST_ASSERT_EQUAL(0, pq_peek_fill(gQueue[order], &fill));
+            TEST_ASSERT_EQUAL(i - 1, fill);
+        }
+        TEST_ASSERT_EQUAL(EAGAIN, pq_recv_nonbl(gQueue[order], &m));
+    }
+}
+
+/******************************************************************************/
+
+void test_pq_eventfd(void) {
+    int     fd = -1;
+    TEST_ASSERT_EQUAL(EINVAL, pq_get_eventfd(NULL, PQ_EVENT_RECV, &fd));
+    TEST_ASSERT_EQUAL(EINVAL, pq_get_eventfd(gQueue[0], PQ_EVENT_SEND + 1, &fd));
+    TEST_ASSERT_EQUAL(EINVAL, pq_get_eventfd(gQueue[0], PQ_EVENT_RECV, NULL));
+#ifdef __linux__
+    for (msgorder_t order = 0; order < ELEMENTS(gQueue); ++order) {
+        int     rfd = -1;
+        int     sfd = -1;
+        uint64_t count = 0;
+        char    data[Q_MSGSIZE];
+        struct pq_msg m = {.msg = "foo",.size = 4,.prio = 1 };
+        TEST_ASSERT_EQUAL(0, pq_get_eventfd(gQueue[order], PQ_EVENT_RECV, &rfd));
+        TEST_ASSERT_EQUAL(0, pq_get_eventfd(gQueue[order], PQ_EVENT_RECV, &fd));
+        TEST_ASSERT_EQUAL(rfd, fd);
+        TEST_ASSERT_EQUAL(0, pq_get_eventfd(gQueue[order], PQ_EVENT_SEND, &sfd));
+        TEST_ASSERT_NOT_EQUAL(rfd, sfd);
+        TEST_ASSERT_EQUAL(-1, read(rfd, &count, sizeof count));
+        /* Filling the queue signals once, on the empty to non-empty edge. */
+        for (msgindex_t i = 0; i < Q_MAXMSG; ++i) {
+            TEST_ASSERT_EQUAL(0, pq_send_nonbl(gQueue[order], &m));
+        }
+        TEST_ASSERT_EQUAL(sizeof count, read(rfd, &count, sizeof count));
+        TEST_ASSERT_EQUAL(1, count);
+        TEST_ASSERT_EQUAL(-1, read(sfd, &count, sizeof count));
+        /* Draining signals once, on the full to non-full edge. */
+        m.msg = data;
+        while (pq_recv_nonbl(gQueue[order], &m) == 0) {
+            ;
+        }
+        TEST_ASSERT_EQUAL(sizeof count, read(sfd, &count, sizeof count));
+        TEST_ASSERT_EQUAL(1, count);
+        TEST_ASSERT_EQUAL(-1, read(rfd, &count, sizeof count));
+    }
+#else
+    TEST_ASSERT_EQUAL(ENOTSUP, pq_get_eventfd(gQueue[0], PQ_EVENT_RECV, &fd));
+#endif
+}
+
+/******************************************************************************/
+
+void test_pq_set(void) {
+    struct pq_set *set = NULL;
+    char    data[Q_MSGSIZE];
+    struct pq_msg m = {.msg = data,.size = 0,.prio = 0 };
+    msgindex_t index = 42;
+    TEST_ASSERT_EQUAL(EINVAL, pq_set_create(NULL, 4));
+    TEST_ASSERT_EQUAL(EINVAL, pq_set_create(&set, 0));
+    TEST_ASSERT_EQUAL(0, pq_set_create(&set, 3));
+    TEST_ASSERT_EQUAL(EINVAL, pq_set_add(set, gQueue[0], PQ_SET_MAXPRIO + 1, 1, NULL));
+    /* FIFO and LIFO share priority 0 with weight 2, PRIOQ has priority 1. */
+    TEST_ASSERT_EQUAL(0, pq_set_add(set, gQueue[PQ_ATTR_FIFO], 0, 2, &index));
+    TEST_ASSERT_EQUAL(0, index);
+    TEST_ASSERT_EQUAL(0, pq_set_add(set, gQueue[PQ_ATTR_LIFO], 0, 2, &index));
+    TEST_ASSERT_EQUAL(1, index);
+    TEST_ASSERT_EQUAL(EBUSY, pq_set_add(set, gQueue[PQ_ATTR_LIFO], 0, 2, &index));
+    TEST_ASSERT_EQUAL(0, pq_set_add(set, gQueue[PQ_ATTR_PRIOQ], 1, 1, &index));
+    TEST_ASSERT_EQUAL(2, index);
+    TEST_ASSERT_EQUAL(ENOSPC, pq_set_add(set, gQueue[PQ_ATTR_PRIFO], 0, 1, NULL));
+    TEST_ASSERT_EQUAL(EBUSY, pq_destroy(gQueue[PQ_ATTR_FIFO]));
+
+    TEST_ASSERT_EQUAL(EAGAIN, pq_recv_any(set, &m, &index, PQ_TIMEOUT_ZERO));
+    TEST_ASSERT_EQUAL(ETIMEDOUT, pq_recv_any(set, &m, &index, 1));
+    TEST_ASSERT_EQUAL(EAGAIN, pq_select(set, &index, PQ_TIMEOUT_ZERO));
+
+    const struct pq_msg f = {.msg = "f",.size = 2,.prio = 0 };
+    const struct pq_msg l = {.msg = "l",.size = 2,.prio = 0 };
+    const struct pq_msg p = {.msg = "p",.size = 2,.prio = 0 };
+    for (int i = 0; i < 3; ++i) {
+        TEST_ASSERT_EQUAL(0, pq_send_nonbl(gQueue[PQ_ATTR_FIFO], &f));
+        TEST_ASSERT_EQUAL(0, pq_send_nonbl(gQueue[PQ_ATTR_LIFO], &l));
+    }
+    TEST_ASSERT_EQUAL(0, pq_send_nonbl(gQueue[PQ_ATTR_PRIOQ], &p));
+    TEST_ASSERT_EQUAL(0, pq_select(set, &index, PQ_TIMEOUT_ZERO));
+    TEST_ASSERT_EQUAL(2, index);
+
+    /* Higher priority first, then weighted round robin. */
+    const char *const expect[] = { "p", "f", "f", "l", "l", "f", "l" };
+    for (size_t i = 0; i < ELEMENTS(expect); ++i) {
+        TEST_ASSERT_EQUAL(0, pq_recv_any(set, &m, &index, PQ_TIMEOUT_ZERO));
+        TEST_ASSERT_EQUAL_STRING(expect[i], data);
+    }
+    TEST_ASSERT_EQUAL(1, index);
+    TEST_ASSERT_EQUAL(EAGAIN, pq_recv_any(set, &m, &index, PQ_TIMEOUT_ZERO));
+
+    /* A queue drained directly leaves a stale entry which is skipped. */
+    TEST_ASSERT_EQUAL(0, pq_send_nonbl(gQueue[PQ_ATTR_FIFO], &f));
+    TEST_ASSERT_EQUAL(0, pq_recv_nonbl(gQueue[PQ_ATTR_FIFO], &m));
+    TEST_ASSERT_EQUAL(EAGAIN, pq_recv_any(set, &m, &index, PQ_TIMEOUT_ZERO));
+    TEST_ASSERT_EQUAL(0, pq_send_nonbl(gQueue[PQ_ATTR_FIFO], &f));
+    TEST_ASSERT_EQUAL(0, pq_recv_any(set, &m, &index, PQ_TIMEOUT_ZERO));
+    TEST_ASSERT_EQUAL(0, index);
+
+    /* A member whose queue can't be locked stays ready. Locking a priority
+     * protected queue fails for a thread above its ceiling, and creating
+     * a real-time thread needs privileges. */
+    pthread_t thread;
+    pthread_attr_t tattr;
+    const struct sched_param param = {.sched_priority = sched_get_priority_max(SCHED_FIFO) };
+    TEST_ASSERT_EQUAL(0, pthread_attr_init(&tattr));
+    TEST_ASSERT_EQUAL(0, pthread_attr_setinheritsched(&tattr, PTHREAD_EXPLICIT_SCHED));
+    TEST_ASSERT_EQUAL(0, pthread_attr_setschedpolicy(&tattr, SCHED_FIFO));
+    TEST_ASSERT_EQUAL(0, pthread_attr_setschedparam(&tattr, &param));
+    const int sc = pthread_create(&thread, &tattr, test_pq_set_unclaim_task, set);
+    if (sc != EPERM) {
+        TEST_ASSERT_EQUAL(0, sc);
+        TEST_ASSERT_EQUAL(0, pthread_join(thread, NULL));
+    }
+    TEST_ASSERT_EQUAL(0, pthread_attr_destroy(&tattr));
+
+    TEST_ASSERT_EQUAL(0, pq_set_destroy(set));
+    TEST_ASSERT_NULL(gQueue[PQ_ATTR_FIFO]->set);
+}
+
+void   *test_pq_set_unclaim_task(void *aSet) {
+    struct pq_set *const set = aSet;
+    struct pq_attr attr = {.maxmsg = Q_MAXMSG,.msgsize = Q_MSGSIZE,.order = PQ_ATTR_FIFO,.maxprio = Q_MAXPRIO,
+        .protocol = PQ_PROTO_PROTECT,.ceiling = sched_get_priority_min(SCHED_FIFO) };
+    char    data[Q_MSGSIZE];
+    struct pq_msg m = {.msg = data,.size = 0,.prio = 0 };
+    struct pq_queue *q = NULL;
+    msgindex_t index;
+    TEST_ASSERT_EQUAL(0, pq_create(&q, &attr));
+    struct pq_set_member *const member = &set->member[0];
+    member->queue = q;
+    TEST_ASSERT_EQUAL(0, pthread_mutex_lock(&set->mtx));
+    member->ready = 1;
+    pq_set_push(set, 0, 0);
+    TEST_ASSERT_EQUAL(0, pthread_mutex_unlock(&set->mtx));
+    TEST_ASSERT_EQUAL(EINVAL, pq_recv_any(set, &m, &index, PQ_TIMEOUT_ZERO));
+    TEST_ASSERT_EQUAL(EINVAL, pq_select(set, &index, PQ_TIMEOUT_ZERO));
+    TEST_ASSERT_EQUAL(1, member->ready);
+    TEST_ASSERT_EQUAL(0, set->head[0]);
+    member->queue = gQueue[PQ_ATTR_FIFO];
+    /* Nor is a set destroyed halfway. */
+    struct pq_set_member *const last = &set->member[set->count - 1];
+    struct pq_queue *const kept = last->queue;
+    last->queue = q;
+    TEST_ASSERT_EQUAL(EINVAL, pq_set_destroy(set));
+    TEST_ASSERT_EQUAL_PTR(set, gQueue[PQ_ATTR_FIFO]->set);
+    last->queue = kept;
+    TEST_ASSERT_EQUAL(0, pq_destroy(q));
+    /* The stale entry left behind is skipped. */
+    TEST_ASSERT_EQUAL(EAGAIN, pq_recv_any(set, &m, &index, PQ_TIMEOUT_ZERO));
+    return NULL;
+}
+
+void test_pq_set_blocking(void) {
+    /* Receivers block on the set, one message per member wakes them all. */
+    struct pq_set *set = NULL;
+    pthread_t thread[ELEMENTS(gQueue)];
+    TEST_ASSERT_EQUAL(0, pq_set_create(&set, ELEMENTS(gQueue)));
+    for (msgorder_t order = 0; order < ELEMENTS(gQueue); ++order) {
+        TEST_ASSERT_EQUAL(0, pq_set_add(set, gQueue[order], order, 1, NULL));
+    }
+    for (size_t t = 0; t < ELEMENTS(thread); ++t) {
+        TEST_ASSERT_EQUAL(0, pthread_create(&thread[t], NULL, test_pq_set_recv_task, set));
+    }
+    while (set->waiting < ELEMENTS(thread)) {
+        usleep(1000);
+    }
+    for (msgorder_t order = 0; order < ELEMENTS(gQueue); ++order) {
+        const struct pq_msg m = {.msg = "foo",.size = 4,.prio = 1 };
+        TEST_ASSERT_EQUAL(0, pq_send_timed(gQueue[order], &m, PQ_TIMEOUT_INF));
+    }
+    for (size_t t = 0; t < ELEMENTS(thread); ++t) {
+        TEST_ASSERT_EQUAL(0, pthread_join(thread[t], NULL));
+    }
+    TEST_ASSERT_EQUAL(0, pq_set_destroy(set));
+}
+
+void   *test_pq_set_recv_task(void *aSet) {
+    char    data[Q_MSGSIZE];
+    struct pq_msg m = {.msg = data,.size = 0,.prio = 0 };
+    TEST_ASSERT_EQUAL(0, pq_recv_any(aSet, &m, NULL, PQ_TIMEOUT_INF));
+    TEST_ASSERT_EQUAL_STRING("foo", data);
+    return NULL;
+}
+
+/******************************************************************************/
+
+void test_pq_until(void) {
+    pthread_t thread;
+    TEST_ASSERT_EQUAL(0, pthread_create(&thread, NULL, test_pq_until_task, NULL));
+    TEST_ASSERT_EQUAL(0, pthread_join(thread, NULL));
+}
+
+void   *test_pq_until_task(void *aUnused) {
+    char    data[Q_MSGSIZE];
+    const struct pq_msg snd = {.msg = "foo",.size = 4,.prio = 1 };
+    struct pq_msg rcv = {.msg = data,.size = 0,.prio = 0 };
+    struct timespec past, deadline, now;
+    TEST_ASSERT_EQUAL(0, pq_deadline(&past, 0));
+    TEST_ASSERT_EQUAL(EINVAL, pq_recv_until(NULL, &rcv, &past));
+    TEST_ASSERT_EQUAL(EINVAL, pq_send_until(NULL, &snd, &past));
+    for (msgorder_t order = 0; order < ELEMENTS(gQueue); ++order) {
+        TEST_ASSERT_EQUAL(ETIMEDOUT, pq_recv_until(gQueue[order], &rcv, &past));
+        /* Deadline is absolute on CLOCK_MONOTONIC, with ns resolution. */
+        TEST_ASSERT_EQUAL(0, pq_deadline(&deadline, 2));
+        deadline.tv_nsec += 500000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_nsec -= 1000000000L;
+            ++deadline.tv_sec;
+        }
+        TEST_ASSERT_EQUAL(ETIMEDOUT, pq_recv_until(gQueue[order], &rcv, &deadline));
+        TEST_ASSERT_EQUAL(0, clock_gettime(CLOCK_MONOTONIC, &now));
+        TEST_ASSERT_TRUE((now.tv_sec > deadline.tv_sec) ||
+                         ((now.tv_sec == deadline.tv_sec) && (now.tv_nsec >= deadline.tv_nsec)));
+        for (msgindex_t i = 0; i < Q_MAXMSG; ++i) {
+            TEST_ASSERT_EQUAL(0, pq_send_until(gQueue[order], &snd, NULL));
+        }
+        TEST_ASSERT_EQUAL(ETIMEDOUT, pq_send_until(gQueue[order], &snd, &past));
+        TEST_ASSERT_EQUAL(0, pq_recv_until(gQueue[order], &rcv, NULL));
+        TEST_ASSERT_EQUAL_STRING("foo", data);
+        TEST_ASSERT_EQUAL(0, pq_recv_until(gQueue[order], &rcv, &past));
+    }
+    return NULL;
+}
+
+/******************************************************************************/
+
+void test_pq_shared(void) {
+    char    name[32];
+    snprintf(name, sizeof name, "/pq_test_%ld", (long) getpid());
+    const struct pq_attr attr = {
+        .maxmsg = Q_MAXMSG,.msgsize = Q_MSGSIZE,.order = PQ_ATTR_PRIOQ,.maxprio = Q_MAXPRIO,.name = name
+    };
+    struct pq_queue *q = NULL;
+    char    data[Q_MSGSIZE];
+    struct pq_msg m = {.msg = data,.size = 0,.prio = 0 };
+    pid_t   pid;
+    int     status;
+
+    TEST_ASSERT_EQUAL(ENOENT, pq_open(&q, name));
+    TEST_ASSERT_EQUAL(0, pq_create(&q, &attr));
+    TEST_ASSERT_EQUAL(EEXIST, pq_create(&q, &attr));
+    TEST_ASSERT_EQUAL(ENOTSUP, pq_get_eventfd(q, PQ_EVENT_RECV, &status));
+
+    /* A child process attaches and sends more than fits; we receive all. */
+    pid = fork();
+    TEST_ASSERT_TRUE(pid >= 0);
+    if (pid == 0) {
+        struct pq_queue *c = NULL;
+        const struct pq_msg snd = {.msg = "child",.size = 6,.prio = 3 };
+        int     rc = (pq_open(&c, name) != 0);
+        for (msgindex_t i = 0; (rc == 0) && (i < 2 * Q_MAXMSG); ++i) {
+            rc = (pq_send_timed(c, &snd, PQ_TIMEOUT_INF) != 0);
+        }
+        if (rc == 0) {
+            rc = (pq_close(c) != 0);
+        }
+        _exit(rc);
+    }
+    for (msgindex_t i = 0; i < 2 * Q_MAXMSG; ++i) {
+        TEST_ASSERT_EQUAL(0, pq_recv_timed(q, &m, 2 * PQ_TIMEOUT_RESOLUTION));
+        TEST_ASSERT_EQUAL_STRING("child", data);
+        TEST_ASSERT_EQUAL(3, m.prio);
+    }
+    TEST_ASSERT_EQUAL(pid, waitpid(pid, &status, 0));
+    TEST_ASSERT_TRUE(WIFEXITED(status) && (WEXITSTATUS(status) == 0));
+
+    /* A child dying with the mutex held leaves the queue usable. */
+    pid = fork();
+    TEST_ASSERT_TRUE(pid >= 0);
+    if (pid == 0) {
+        struct pq_queue *c = NULL;
+        _exit((pq_open(&c, name) != 0) || (pq_lock(c, PQ_OP_OTHER) != 0));
+    }
+    TEST_ASSERT_EQUAL(pid, waitpid(pid, &status, 0));
+    TEST_ASSERT_TRUE(WIFEXITED(status) && (WEXITSTATUS(status) == 0));
+    m.msg = "foo";
+    m.size = 4;
+    TEST_ASSERT_EQUAL(0, pq_send_nonbl(q, &m));
+    m.msg = data;
+    TEST_ASSERT_EQUAL(0, pq_recv_nonbl(q, &m));
+    TEST_ASSERT_EQUAL_STRING("foo", data);
+
+    TEST_ASSERT_EQUAL(0, pq_destroy(q));
+    TEST_ASSERT_EQUAL(ENOENT, pq_open(&q, name));
+}
+
+/******************************************************************************/
+
+void test_pq_persist(void) {
+    /* A child sends, receives one and dies; recovery restores the rest in
+     * the order of an in-memory queue that saw the same operations. */
+    const msgprio_t prio[] = { 1, 3, 1, 2, 3, 1, 2 };
+    char    path[ELEMENTS(gQueue)][64];
+    struct pq_attr attr = {.maxmsg = Q_MAXMSG,.msgsize = Q_MSGSIZE,.maxprio = Q_MAXPRIO,
+        .sync = PQ_SYNC_COUNT,.sync_every = 4
+    };
+    char    data[Q_MSGSIZE];
+    struct pq_msg m = {.msg = data,.size = 0,.prio = 0 };
+    struct pq_queue *q = NULL;
+    int     status;
+
+    for (msgorder_t order = 0; order < ELEMENTS(gQueue); ++order) {
+        snprintf(path[order], sizeof path[order], "/tmp/pq_test_%ld_%u", (long) getpid(), order);
+        unlink(path[order]);
+    }
+    const pid_t pid = fork();
+    TEST_ASSERT_TRUE(pid >= 0);
+    if (pid == 0) {
+        int     rc = 0;
+        for (msgorder_t order = 0; (rc == 0) && (order < ELEMENTS(gQueue)); ++order) {
+            attr.order = order;
+            attr.path = path[order];
+            rc = (pq_create(&q, &attr) != 0);
+            for (size_t i = 0; (rc == 0) && (i < ELEMENTS(prio)); ++i) {
+                const struct pq_msg snd = {.msg = data,.size = 2,.prio = prio[i] };
+                data[0] = (char) ('a' + i);
+                data[1] = '\0';
+                rc = (pq_send_nonbl(q, &snd) != 0);
+            }
+            if (rc == 0) {
+                rc = (pq_recv_nonbl(q, &m) != 0);
+            }
+        }
+        _exit(rc);
+    }
+    TEST_ASSERT_EQUAL(pid, waitpid(pid, &status, 0));
+    TEST_ASSERT_TRUE(WIFEXITED(status) && (WEXITSTATUS(status) == 0));
+
+    for (msgorder_t order = 0; order < ELEMENTS(gQueue); ++order) {
+        char    want[Q_MSGSIZE];
+        struct pq_msg ref = {.msg = want,.size = 0,.prio = 0 };
+        for (size_t i = 0; i < ELEMENTS(prio); ++i) {
+            const struct pq_msg snd = {.msg = want,.size = 2,.prio = prio[i] };
+            want[0] = (char) ('a' + i);
+            want[1] = '\0';
+            TEST_ASSERT_EQUAL(0, pq_send_nonbl(gQueue[order], &snd));
+        }
+        TEST_ASSERT_EQUAL(0, pq_recv_nonbl(gQueue[order], &ref));
+
+        attr.order = (msgorder_t) ((order + 1u) % ELEMENTS(gQueue));
+        attr.path = path[order];
+        TEST_ASSERT_EQUAL(EINVAL, pq_create(&q, &attr));
+        attr.order = order;
+        TEST_ASSERT_EQUAL(0, pq_create(&q, &attr));
+        TEST_ASSERT_EQUAL(ELEMENTS(prio) - 1, q->fill);
+        while (pq_recv_nonbl(gQueue[order], &ref) == 0) {
+            TEST_ASSERT_EQUAL(0, pq_recv_nonbl(q, &m));
+            TEST_ASSERT_EQUAL(ref.prio, m.prio);
+            if (order != PQ_ATTR_PRIOQ) {
+                TEST_ASSERT_EQUAL_STRING(want, data);
+            }
+        }
+        TEST_ASSERT_EQUAL(EAGAIN, pq_recv_nonbl(q, &m));
+
+        /* A torn record is dropped. */
+        m.msg = "torn";
+        m.size = 5;
+        TEST_ASSERT_EQUAL(0, pq_send_nonbl(q, &m));
+        TEST_ASSERT_EQUAL(0, pq_send_nonbl(q, &m));
+        ((char *) pq_data(q, (order == PQ_ATTR_FIFO) ? q->head : 0))[1] = 'X';
+        m.msg = data;
+        TEST_ASSERT_EQUAL(0, pq_destroy(q));
+        TEST_ASSERT_EQUAL(0, pq_create(&q, &attr));
+        TEST_ASSERT_EQUAL(1, q->fill);
+        TEST_ASSERT_EQUAL(0, pq_sync(q));
+        TEST_ASSERT_EQUAL(0, pq_destroy(q));
+
+        /* A file of the layout before versioning, magic 0x51554555, is
+         * rejected and left alone, even with a matching size. */
+        uint32_t magic = 0x51554555u;
+        int     fd = open(path[order], O_RDWR);
+        TEST_ASSERT_TRUE(fd >= 0);
+        TEST_ASSERT_EQUAL(sizeof magic, pwrite(fd, &magic, sizeof magic, offsetof(struct pq_queue, magic)));
+        TEST_ASSERT_EQUAL(EINVAL, pq_create(&q, &attr));
+        magic = 0;
+        TEST_ASSERT_EQUAL(sizeof magic, pread(fd, &magic, sizeof magic, offsetof(struct pq_queue, magic)));
+        TEST_ASSERT_EQUAL_HEX32(0x51554555u, magic);
+        TEST_ASSERT_EQUAL(0, close(fd));
+        TEST_ASSERT_EQUAL(0, unlink(path[order]));
+    }
+}
+
+/******************************************************************************/
+
+void test_pq_delay(void) {
+    const struct pq_attr attr = {.maxmsg = Q_MAXMSG,.msgsize = Q_MSGSIZE,.order = PQ_ATTR_DELAY,.maxprio = Q_MAXPRIO };
+    struct pq_queue *q = NULL;
+    struct pq_set *set = NULL;
+    char    data[Q_MSGSIZE];
+    struct pq_msg_ex m = {.base = {.msg = data,.size = 0,.prio = 0 } };
+    struct pq_msg_ex snd = {.base = {.msg = "late",.size = 5,.prio = 7 } };
+    struct timespec now;
+    pthread_t thread;
+    int     fd;
+
+    TEST_ASSERT_EQUAL(0, pq_create(&q, &attr));
+    TEST_ASSERT_EQUAL(ENOTSUP, pq_get_eventfd(q, PQ_EVENT_RECV, &fd));
+    TEST_ASSERT_EQUAL(0, pq_set_create(&set, 1));
+    TEST_ASSERT_EQUAL(EINVAL, pq_set_add(set, q, 0, 1, NULL));
+    TEST_ASSERT_EQUAL(0, pq_set_destroy(set));
+
+    /* Messages come out in due order, never before they are due. */
+    TEST_ASSERT_EQUAL(0, pq_deadline(&snd.due, 30));
+    TEST_ASSERT_EQUAL(0, pq_send_ex(q, &snd, PQ_TIMEOUT_ZERO));
+    snd.base.msg = "soon";
+    TEST_ASSERT_EQUAL(0, pq_deadline(&snd.due, 10));
+    TEST_ASSERT_EQUAL(0, pq_send_ex(q, &snd, PQ_TIMEOUT_ZERO));
+    /* Without metadata, a message is due at once. */
+    snd.base.msg = "now";
+    TEST_ASSERT_EQUAL(0, pq_send_nonbl(q, &snd.base));
+    TEST_ASSERT_EQUAL(0, pq_recv_nonbl(q, &m.base));
+    TEST_ASSERT_EQUAL_STRING("now", data);
+    TEST_ASSERT_EQUAL(7, m.base.prio);
+    TEST_ASSERT_EQUAL(EAGAIN, pq_recv_nonbl(q, &m.base));
+    TEST_ASSERT_EQUAL(ETIMEDOUT, pq_recv_timed(q, &m.base, 1));
+    TEST_ASSERT_EQUAL(0, pq_recv_ex(q, &m, PQ_TIMEOUT_INF));
+    TEST_ASSERT_EQUAL_STRING("soon", data);
+    TEST_ASSERT_EQUAL(0, clock_gettime(CLOCK_MONOTONIC, &now));
+    TEST_ASSERT_TRUE(pq_ns(&now) >= pq_ns(&m.due));
+    TEST_ASSERT_EQUAL(0, pq_recv_timed(q, &m.base, PQ_TIMEOUT_INF));
+    TEST_ASSERT_EQUAL_STRING("late", data);
+
+    /* A sleeping receiver wakes up for an earlier message. */
+    snd.base.msg = "later";
+    TEST_ASSERT_EQUAL(0, pq_deadline(&snd.due, 60 * PQ_TIMEOUT_RESOLUTION));
+    TEST_ASSERT_EQUAL(0, pq_send_ex(q, &snd, PQ_TIMEOUT_ZERO));
+    TEST_ASSERT_EQUAL(0, pthread_create(&thread, NULL, test_pq_delay_task, q));
+    while (q->waiting_to_recv == 0) {
+        usleep(1000);
+    }
+    snd.base.msg = "early";
+    TEST_ASSERT_EQUAL(0, pq_deadline(&snd.due, 20));
+    TEST_ASSERT_EQUAL(0, pq_send_ex(q, &snd, PQ_TIMEOUT_ZERO));
+    TEST_ASSERT_EQUAL(0, pthread_join(thread, NULL));
+    TEST_ASSERT_EQUAL(1, q->fill);
+    TEST_ASSERT_EQUAL(0, pq_destroy(q));
+}
+
+void   *test_pq_delay_task(void *aQueue) {
+    char    data[Q_MSGSIZE];
+    struct pq_msg m = {.msg = data,.size = 0,.prio = 0 };
+    TEST_ASSERT_EQUAL(0, pq_recv_timed(aQueue, &m, 10 * PQ_TIMEOUT_RESOLUTION));
+    TEST_ASSERT_EQUAL_STRING("early", data);
+    return NULL;
+}
+
+/******************************************************************************/
+
+/* Sleep until messages sent with a time to live so far have expired. */
+void test_pq_expire(pq_time_t aTtl) {
+    struct timespec deadline;
+    TEST_ASSERT_EQUAL(0, pq_deadline(&deadline, aTtl));
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR) {
+    }
+}
+
+void test_pq_ttl(void) {
+    for (msgorder_t order = 0; order < ELEMENTS(gQueue); ++order) {
+        const struct pq_attr attr = {.maxmsg = Q_MAXMSG,.msgsize = Q_MSGSIZE,.order = order,.maxprio = Q_MAXPRIO,
+            .ttl = 1
+        };
+        struct pq_queue *q = NULL;
+        char    data[Q_MSGSIZE];
+        struct pq_msg m = {.msg = data,.size = 0,.prio = 0 };
+        struct pq_msg keep = {.msg = "keep",.size = 5,.prio = 1 };
+        struct pq_msg_ex stale = {.base = {.msg = "stale",.size = 6,.prio = 1 },.ttl = 1 };
+        struct pq_stats st;
+        TEST_ASSERT_EQUAL(0, pq_create(&q, &attr));
+        TEST_ASSERT_EQUAL(EINVAL, pq_get_stats(q, NULL));
+
+        /* Expired messages are discarded instead of received. */
+        TEST_ASSERT_EQUAL(0, pq_send_ex(q, &stale, PQ_TIMEOUT_ZERO));
+        TEST_ASSERT_EQUAL(0, pq_send_nonbl(q, &keep));
+        TEST_ASSERT_EQUAL(0, pq_send_ex(q, &stale, PQ_TIMEOUT_ZERO));
+        test_pq_expire(stale.ttl);
+        TEST_ASSERT_EQUAL(0, pq_recv_nonbl(q, &m));
+        TEST_ASSERT_EQUAL_STRING("keep", data);
+        TEST_ASSERT_EQUAL(EAGAIN, pq_recv_nonbl(q, &m));
+        TEST_ASSERT_EQUAL(0, pq_get_stats(q, &st));
+        TEST_ASSERT_EQUAL(2, st.expired);
+
+        /* A full queue of mostly expired messages takes new ones. */
+        TEST_ASSERT_EQUAL(0, pq_send_nonbl(q, &keep));
+        for (msgindex_t i = 1; i < Q_MAXMSG; ++i) {
+            TEST_ASSERT_EQUAL(0, pq_send_ex(q, &stale, PQ_TIMEOUT_ZERO));
+        }
+        test_pq_expire(stale.ttl);
+        TEST_ASSERT_EQUAL(0, pq_send_timed(q, &keep, PQ_TIMEOUT_ZERO));
+        TEST_ASSERT_EQUAL(0, pq_recv_nonbl(q, &m));
+        TEST_ASSERT_EQUAL_STRING("keep", data);
+        TEST_ASSERT_EQUAL(0, pq_recv_nonbl(q, &m));
+        TEST_ASSERT_EQUAL_STRING("keep", data);
+        TEST_ASSERT_EQUAL(EAGAIN, pq_recv_nonbl(q, &m));
+        TEST_ASSERT_EQUAL(0, pq_get_stats(q, &st));
+        TEST_ASSERT_EQUAL(2 + Q_MAXMSG - 1, st.expired);
+
+        /* A sender waiting forever on a full queue gets the slot of the
+         * first message to expire. */
+        struct pq_msg_ex slow = stale;
+        slow.ttl = 20;
+        for (msgindex_t i = 0; i < Q_MAXMSG; ++i) {
+            TEST_ASSERT_EQUAL(0, pq_send_ex(q, &slow, PQ_TIMEOUT_ZERO));
+        }
+        TEST_ASSERT_EQUAL(EAGAIN, pq_send_nonbl(q, &keep));
+        TEST_ASSERT_EQUAL(0, pq_send_timed(q, &keep, PQ_TIMEOUT_INF));
+        TEST_ASSERT_EQUAL(0, pq_get_stats(q, &st));
+        TEST_ASSERT_EQUAL(1, st.rejected);
+        test_pq_expire(slow.ttl);
+        TEST_ASSERT_EQUAL(0, pq_recv_nonbl(q, &m));
+        TEST_ASSERT_EQUAL_STRING("keep", data);
+        TEST_ASSERT_EQUAL(EAGAIN, pq_recv_nonbl(q, &m));
+        TEST_ASSERT_EQUAL(0, pq_destroy(q));
+
+        /* Without the attribute, ttl is ignored. */
+        TEST_ASSERT_EQUAL(0, pq_send_ex(gQueue[order], &stale, PQ_TIMEOUT_ZERO));
+        test_pq_expire(stale.ttl);
+        TEST_ASSERT_EQUAL(0, pq_recv_nonbl(gQueue[order], &m));
+        TEST_ASSERT_EQUAL_STRING("stale", data);
+        TEST_ASSERT_EQUAL(0, pq_get_stats(gQueue[order], &st));
+        TEST_ASSERT_EQUAL(0, st.expired);
+    }
+}
+
+/******************************************************************************/
+
+void test_pq_full_policy(void) {
+    struct pq_attr attr = {.maxmsg = 3,.msgsize = Q_MSGSIZE,.maxprio = Q_MAXPRIO };
+    struct pq_queue *q = NULL;
+    char    data[Q_MSGSIZE];
+    struct pq_msg m = {.msg = data,.size = 2,.prio = 0 };
+    struct pq_stats st;
+
+    attr.order = PQ_ATTR_PRIOQ;
+    attr.full = PQ_FULL_DROP_OLDEST;
+    TEST_ASSERT_EQUAL(EINVAL, pq_create(&q, &attr));
+    attr.order = PQ_ATTR_FIFO;
+    attr.full = PQ_FULL_DROP_LOWEST;
+    TEST_ASSERT_EQUAL(EINVAL, pq_create(&q, &attr));
+    attr.full = PQ_FULL_DROP_NEW + 1u;
+    TEST_ASSERT_EQUAL(EINVAL, pq_create(&q, &attr));
+
+    /* Overwrite ring: the newest three of "a".."e" survive; after one is
+     * received, "g" overwrites the oldest again. */
+    attr.full = PQ_FULL_DROP_OLDEST;
+    for (attr.order = PQ_ATTR_FIFO; attr.order <= PQ_ATTR_LIFO; ++attr.order) {
+        const char *const want = (attr.order == PQ_ATTR_FIFO) ? "cefg" : "egfd";
+        TEST_ASSERT_EQUAL(0, pq_create(&q, &attr));
+        for (char c = 'a'; c <= 'g'; ++c) {
+            data[0] = c;
+            data[1] = '\0';
+            TEST_ASSERT_EQUAL(0, pq_send_timed(q, &m, PQ_TIMEOUT_INF));
+            if (c == 'e') {
+                TEST_ASSERT_EQUAL(0, pq_recv_nonbl(q, &m));
+                TEST_ASSERT_EQUAL(want[0], data[0]);
+            }
+        }
+        for (size_t i = 1; i < strlen(want); ++i) {
+            TEST_ASSERT_EQUAL(0, pq_recv_nonbl(q, &m));
+            TEST_ASSERT_EQUAL(want[i], data[0]);
+        }
+        TEST_ASSERT_EQUAL(EAGAIN, pq_recv_nonbl(q, &m));
+        TEST_ASSERT_EQUAL(0, pq_get_stats(q, &st));
+        TEST_ASSERT_EQUAL(3, st.overwritten);
+        TEST_ASSERT_EQUAL(0, pq_destroy(q));
+    }
+
+    /* Evict lowest priority: 1 3 2 then 5 evicts 1, 0 is dropped. */
+    attr.full = PQ_FULL_DROP_LOWEST;
+    for (attr.order = PQ_ATTR_PRIFO; attr.order <= PQ_ATTR_PRIOQ; ++attr.order) {
+        const msgprio_t sent[] = { 1, 3, 2, 5, 0 };
+        const msgprio_t want[] = { 5, 3, 2 };
+        TEST_ASSERT_EQUAL(0, pq_create(&q, &attr));
+        for (size_t i = 0; i < ELEMENTS(sent); ++i) {
+            m.prio = sent[i];
+            TEST_ASSERT_EQUAL(0, pq_send_nonbl(q, &m));
+        }
+        for (size_t i = 0; i < ELEMENTS(want); ++i) {
+            TEST_ASSERT_EQUAL(0, pq_recv_nonbl(q, &m));
+            TEST_ASSERT_EQUAL(want[i], m.prio);
+        }
+        TEST_ASSERT_EQUAL(0, pq_get_stats(q, &st));
+        TEST_ASSERT_EQUAL(1, st.evicted);
+        TEST_ASSERT_EQUAL(1, st.dropped);
+        TEST_ASSERT_EQUAL(0, pq_destroy(q));
+    }
+    /* Eviction goes by priority, not by the effective one of aging. */
+    attr.aging = 1;
+    for (attr.order = PQ_ATTR_PRIFO; attr.order <= PQ_ATTR_PRIOQ; ++attr.order) {
+        TEST_ASSERT_EQUAL(EINVAL, pq_create(&q, &attr));
+    }
+    attr.aging = 0;
+
+    /* The PRIOQ heap keeps both ends in order, with handles moving along. */
+    attr.order = PQ_ATTR_PRIOQ;
+    attr.maxmsg = 40;
+    attr.handles = 1;
+    TEST_ASSERT_EQUAL(0, pq_create(&q, &attr));
+    unsigned count[Q_MAXPRIO + 1] = { 0 };
+    unsigned fill = 0;
+    for (unsigned n = 0; n < 5000; ++n) {
+        if ((rand() % 3) != 0) {
+            m.prio = (msgprio_t) (rand() % (Q_MAXPRIO + 1));
+            data[0] = (char) ('a' + m.prio);
+            msgprio_t lowest = 0;
+            while ((fill > 0) && (count[lowest] == 0)) {
+                ++lowest;
+            }
+            if (fill < attr.maxmsg) {
+                ++fill;
+                ++count[m.prio];
+            }
+            else if (lowest < m.prio) {
+                --count[lowest];
+                ++count[m.prio];
+            }
+            TEST_ASSERT_EQUAL(0, pq_send_nonbl(q, &m));
+        }
+        else if (fill == 0) {
+            TEST_ASSERT_EQUAL(EAGAIN, pq_recv_nonbl(q, &m));
+        }
+        else {
+            msgprio_t highest = Q_MAXPRIO;
+            while (count[highest] == 0) {
+                --highest;
+            }
+            TEST_ASSERT_EQUAL(0, pq_recv_nonbl(q, &m));
+            TEST_ASSERT_EQUAL(highest, m.prio);
+            TEST_ASSERT_EQUAL('a' + highest, data[0]);
+            --count[highest];
+            --fill;
+        }
+        TEST_ASSERT_EQUAL(fill, q->fill);
+    }
+    TEST_ASSERT_EQUAL(0, pq_destroy(q));
+    attr.handles = 0;
+    attr.maxmsg = 3;
+
+    /* Drop new, and reject counting. */
+    attr.order = PQ_ATTR_LIFO;
+    for (attr.full = PQ_FULL_REJECT; attr.full <= PQ_FULL_DROP_NEW; attr.full += PQ_FULL_DROP_NEW) {
+        TEST_ASSERT_EQUAL(0, pq_create(&q, &attr));
+        for (msgindex_t i = 0; i < attr.maxmsg; ++i) {
+            TEST_ASSERT_EQUAL(0, pq_send_nonbl(q, &m));
+        }
+        if (attr.full == PQ_FULL_REJECT) {
+            TEST_ASSERT_EQUAL(EAGAIN, pq_send_nonbl(q, &m));
+            TEST_ASSERT_EQUAL(ETIMEDOUT, pq_send_timed(q, &m, 1));
+        }
+        else {
+            TEST_ASSERT_EQUAL(0, pq_send_nonbl(q, &m));
+            TEST_ASSERT_EQUAL(0, pq_send_timed(q, &m, PQ_TIMEOUT_INF));
+        }
+        TEST_ASSERT_EQUAL(attr.maxmsg, q->fill);
+        TEST_ASSERT_EQUAL(0, pq_get_stats(q, &st));
+        TEST_ASSERT_EQUAL((attr.full == PQ_FULL_REJECT) ? 2 : 0, st.rejected);
+        TEST_ASSERT_EQUAL((attr.full == PQ_FULL_REJECT) ? 0 : 2, st.dropped);
+        TEST_ASSERT_EQUAL(0, pq_destroy(q));
+    }
+}
+
+/******************************************************************************/
+
+void test_pq_conflate(void) {
+    struct pq_attr attr = {.maxmsg = 8,.msgsize = Q_MSGSIZE,.order = PQ_ATTR_PRIOQ,.maxprio = Q_MAXPRIO,.conflate = 1 };
+    struct pq_queue *q = NULL;
+    char    data[Q_MSGSIZE];
+    struct pq_msg_ex m = {.base = {.msg = data,.size = 1,.prio = 0 } };
+    struct pq_stats st;
+
+    TEST_ASSERT_EQUAL(EINVAL, pq_create(&q, &attr));
+    attr.order = PQ_ATTR_FIFO;
+    TEST_ASSERT_EQUAL(0, pq_create(&q, &attr));
+
+    /* Keys 7 3 7 9 3 7: three messages in first-arrival order 7 3 9. */
+    const uint64_t sent[] = { 7, 3, 7, 9, 3, 7 };
+    for (size_t i = 0; i < ELEMENTS(sent); ++i) {
+        m.key = sent[i];
+        data[0] = (char) ('a' + i);
+        TEST_ASSERT_EQUAL(0, pq_send_ex(q, &m, PQ_TIMEOUT_ZERO));
+    }
+    TEST_ASSERT_EQUAL(3, q->fill);
+    const uint64_t keys[] = { 7, 3, 9 };
+    const char latest[] = { 'f', 'e', 'd' };
+    for (size_t i = 0; i < ELEMENTS(keys); ++i) {
+        TEST_ASSERT_EQUAL(0, pq_recv_ex(q, &m, PQ_TIMEOUT_ZERO));
+        TEST_ASSERT_EQUAL(keys[i], m.key);
+        TEST_ASSERT_EQUAL(latest[i], data[0]);
+    }
+    TEST_ASSERT_EQUAL(0, pq_get_stats(q, &st));
+    TEST_ASSERT_EQUAL(3, st.conflated);
+
+    /* A full queue still takes updates of queued keys, and the index
+     * survives wrap-around and colliding probe sequences. */
+    for (uint32_t round = 0; round < 4; ++round) {
+        for (uint64_t k = 0; k < attr.maxmsg; ++k) {
+            m.key = k << 32;
+            data[0] = (char) round;
+            TEST_ASSERT_EQUAL(0, pq_send_ex(q, &m, PQ_TIMEOUT_ZERO));
+        }
+        TEST_ASSERT_EQUAL(attr.maxmsg, q->fill);
+        m.key = 1ull << 40;
+        TEST_ASSERT_EQUAL(EAGAIN, pq_send_ex(q, &m, PQ_TIMEOUT_ZERO));
+        for (uint64_t k = 0; k < attr.maxmsg; k += 2) {
+            TEST_ASSERT_EQUAL(0, pq_recv_ex(q, &m, PQ_TIMEOUT_ZERO));
+            TEST_ASSERT_EQUAL(k << 32, m.key);
+            TEST_ASSERT_EQUAL(0, pq_recv_ex(q, &m, PQ_TIMEOUT_ZERO));
+        }
+    }
+    TEST_ASSERT_EQUAL(0, pq_destroy(q));
+}
+
+/******************************************************************************/
+
+void test_pq_handles(void) {
+    struct pq_attr attr = {.maxmsg = 16,.msgsize = Q_MSGSIZE,.order = PQ_ATTR_FIFO,.maxprio = Q_MAXPRIO,.handles = 1 };
+    struct pq_queue *q = NULL;
+    char    data[Q_MSGSIZE];
+    pq_handle_t h[16];
+    pq_handle_t got;
+    struct pq_msg_ex m = {.base = {.msg = data,.size = 1 } };
+
+    TEST_ASSERT_EQUAL(EINVAL, pq_create(&q, &attr));
+    attr.order = PQ_ATTR_PRIOQ;
+    attr.handles = 0;
+    TEST_ASSERT_EQUAL(0, pq_create(&q, &attr));
+    TEST_ASSERT_EQUAL(EINVAL, pq_cancel(q, 1));
+    TEST_ASSERT_EQUAL(0, pq_destroy(q));
+    attr.handles = 1;
+    TEST_ASSERT_EQUAL(0, pq_create(&q, &attr));
+
+    /* Message i has priority i % 8 and data i. */
+    for (size_t i = 0; i < ELEMENTS(h); ++i) {
+        data[0] = (char) i;
+        m.base.prio = (msgprio_t) (i % 8);
+        m.handle = &h[i];
+        TEST_ASSERT_EQUAL(0, pq_send_ex(q, &m, PQ_TIMEOUT_ZERO));
+        TEST_ASSERT_NOT_EQUAL(0, h[i]);
+    }
+    /* Cancel the two of priority 7, raise 3 and lower 4. */
+    TEST_ASSERT_EQUAL(0, pq_cancel(q, h[7]));
+    TEST_ASSERT_EQUAL(0, pq_cancel(q, h[15]));
+    TEST_ASSERT_EQUAL(ENOENT, pq_cancel(q, h[7]));
+    TEST_ASSERT_EQUAL(0, pq_change_prio(q, h[3], Q_MAXPRIO));
+    TEST_ASSERT_EQUAL(0, pq_change_prio(q, h[4], 0));
+    TEST_ASSERT_EQUAL(EINVAL, pq_change_prio(q, h[5], Q_MAXPRIO + 1));
+    TEST_ASSERT_EQUAL(14, q->fill);
+
+    /* Receiving leaves the handle alone. */
+    got = 0;
+    m.handle = &got;
+    TEST_ASSERT_EQUAL(0, pq_recv_ex(q, &m, PQ_TIMEOUT_ZERO));
+    TEST_ASSERT_EQUAL(3, data[0]);
+    TEST_ASSERT_EQUAL(0, got);
+    TEST_ASSERT_EQUAL(Q_MAXPRIO, m.base.prio);
+    TEST_ASSERT_EQUAL(ENOENT, pq_change_prio(q, h[3], 1));
+    msgprio_t prev = Q_MAXPRIO;
+    while (pq_recv_ex(q, &m, PQ_TIMEOUT_ZERO) == 0) {
+        TEST_ASSERT(m.base.prio <= prev);
+        TEST_ASSERT_NOT_EQUAL(7, data[0]);
+        TEST_ASSERT_NOT_EQUAL(15, data[0]);
+        TEST_ASSERT_EQUAL(((size_t) data[0] == 4) ? 0 : data[0] % 8, m.base.prio);
+        prev = m.base.prio;
+    }
+
+    /* A reused data block gets a new handle; the old one stays stale. */
+    m.handle = &got;
+    TEST_ASSERT_EQUAL(0, pq_send_ex(q, &m, PQ_TIMEOUT_ZERO));
+    for (size_t i = 0; i < ELEMENTS(h); ++i) {
+        TEST_ASSERT_NOT_EQUAL(h[i], got);
+        TEST_ASSERT_EQUAL(ENOENT, pq_cancel(q, h[i]));
+    }
+    TEST_ASSERT_EQUAL(0, pq_cancel(q, got));
+    TEST_ASSERT_EQUAL(0, q->fill);
+
+    /* The generation doesn't wrap after 16 bits of reuses. */
+    const pq_handle_t old = got;
+    q->message[0].key = (old & 0xffffu) | (UINT64_C(0xffff) << 16);
+    TEST_ASSERT_EQUAL(0, pq_send_ex(q, &m, PQ_TIMEOUT_ZERO));
+    TEST_ASSERT_EQUAL(UINT64_C(0x10000), got >> 16);
+    TEST_ASSERT_EQUAL(ENOENT, pq_cancel(q, (old & 0xffffu) | (UINT64_C(1) << 16)));
+    TEST_ASSERT_EQUAL(0, pq_cancel(q, got));
+    TEST_ASSERT_EQUAL(0, pq_destroy(q));
+
+    /* Waits of an aging queue count under the priority sent with. */
+    struct pq_wait w;
+    attr.aging = 20;
+    TEST_ASSERT_EQUAL(0, pq_create(&q, &attr));
+    m.base.prio = 1;
+    m.handle = &got;
+    TEST_ASSERT_EQUAL(0, pq_send_ex(q, &m, PQ_TIMEOUT_ZERO));
+    TEST_ASSERT_EQUAL(0, pq_change_prio(q, got, 5));
+    TEST_ASSERT_EQUAL(0, pq_recv_nonbl(q, &m.base));
+    TEST_ASSERT_EQUAL(5, m.base.prio);
+    TEST_ASSERT_EQUAL(0, pq_get_wait(q, 1, &w));
+    TEST_ASSERT_EQUAL(1, w.count);
+    TEST_ASSERT_EQUAL(0, pq_get_wait(q, 5, &w));
+    TEST_ASSERT_EQUAL(0, w.count);
+    TEST_ASSERT_EQUAL(0, pq_destroy(q));
+}
+
+/******************************************************************************/
+
+void test_pq_aging(void) {
+    struct pq_attr attr = {.maxmsg = 8,.msgsize = Q_MSGSIZE,.order = PQ_ATTR_FIFO,.maxprio = Q_MAXPRIO,.aging = 20 };
+    struct pq_queue *q = NULL;
+    char    data[Q_MSGSIZE];
+    struct pq_msg m = {.msg = data,.size = 1 };
+    struct pq_wait w;
+
+    TEST_ASSERT_EQUAL(EINVAL, pq_create(&q, &attr));
+    /* Aging keys would wrap: 65535 intervals of 49 days each. */
+    attr.order = PQ_ATTR_PRIOQ;
+    attr.maxprio = PQ_MAXPRIO;
+    attr.aging = UINT32_MAX;
+    TEST_ASSERT_EQUAL(EINVAL, pq_create(&q, &attr));
+    attr.aging = 1000u * PQ_TIMEOUT_RESOLUTION;
+    TEST_ASSERT_EQUAL(0, pq_create(&q, &attr));
+    TEST_ASSERT_EQUAL(0, pq_destroy(q));
+    attr.maxprio = Q_MAXPRIO;
+    attr.aging = 20;
+    for (attr.order = PQ_ATTR_PRIFO; attr.order <= PQ_ATTR_PRIOQ; ++attr.order) {
+        TEST_ASSERT_EQUAL(0, pq_create(&q, &attr));
+        /* Priority 0 waits 6.5 aging intervals, overtaking a later 5 but
+         * not a later Q_MAXPRIO. */
+        m.prio = 0;
+        TEST_ASSERT_EQUAL(0, pq_send_nonbl(q, &m));
+        usleep(130 * (1000000 / PQ_TIMEOUT_RESOLUTION));
+        m.prio = 5;
+        TEST_ASSERT_EQUAL(0, pq_send_nonbl(q, &m));
+        TEST_ASSERT_EQUAL(0, pq_send_nonbl(q, &m));
+        m.prio = Q_MAXPRIO;
+        TEST_ASSERT_EQUAL(0, pq_send_nonbl(q, &m));
+        const msgprio_t want[] = { Q_MAXPRIO, 0, 5, 5 };
+        for (size_t i = 0; i < ELEMENTS(want); ++i) {
+            TEST_ASSERT_EQUAL(0, pq_recv_nonbl(q, &m));
+            TEST_ASSERT_EQUAL(want[i], m.prio);
+        }
+        TEST_ASSERT_EQUAL(0, pq_get_wait(q, 0, &w));
+        TEST_ASSERT_EQUAL(1, w.count);
+        TEST_ASSERT(w.wait_ns >= 130000000000u / PQ_TIMEOUT_RESOLUTION);
+        TEST_ASSERT_EQUAL(w.wait_ns, w.wait_max_ns);
+        TEST_ASSERT_EQUAL(0, pq_get_wait(q, 5, &w));
+        TEST_ASSERT_EQUAL(2, w.count);
+        TEST_ASSERT_EQUAL(EINVAL, pq_get_wait(q, Q_MAXPRIO + 1, &w));
+        TEST_ASSERT_EQUAL(0, pq_destroy(q));
+    }
+}
+
+/******************************************************************************/
+
+void test_pq_wfq(void) {
+    const uint16_t weights[Q_MAXPRIO + 1] = { 1, 2, 3, 1, 1, 1, 1, 1, 1, 1 };
+    struct pq_attr attr = {.maxmsg = 24,.msgsize = Q_MSGSIZE,.order = PQ_ATTR_WFQ,.maxprio = Q_MAXPRIO,.weights = weights };
+    struct pq_queue *q = NULL;
+    char    data[Q_MSGSIZE];
+    struct pq_msg m = {.msg = data,.size = 1 };
+
+    TEST_ASSERT_EQUAL(0, pq_create(&q, &attr));
+    /* Eight of each class 0, 1 and 2, served 1:2:3 in FIFO order per class. */
+    for (msgprio_t p = 0; p < 3; ++p) {
+        for (char i = 0; i < 8; ++i) {
+            m.prio = p;
+            data[0] = i;
+            TEST_ASSERT_EQUAL(0, pq_send_nonbl(q, &m));
+        }
+    }
+    const msgprio_t round[] = { 0, 1, 1, 2, 2, 2 };
+    char    next[3] = { 0, 0, 0 };
+    for (size_t i = 0; i < 2 * ELEMENTS(round); ++i) {
+        TEST_ASSERT_EQUAL(0, pq_recv_nonbl(q, &m));
+        TEST_ASSERT_EQUAL(round[i % ELEMENTS(round)], m.prio);
+        TEST_ASSERT_EQUAL(next[m.prio]++, data[0]);
+    }
+    /* Class 2 runs dry in the next round; the rest still alternates. */
+    while (pq_recv_nonbl(q, &m) == 0) {
+        TEST_ASSERT_EQUAL(next[m.prio]++, data[0]);
+    }
+    TEST_ASSERT_EQUAL(8, next[0]);
+    TEST_ASSERT_EQUAL(8, next[1]);
+    TEST_ASSERT_EQUAL(8, next[2]);
+    TEST_ASSERT_EQUAL(0, pq_destroy(q));
+
+    /* Bytes: equal weights, so a class of 1 byte messages gets Q_MSGSIZE
+     * of them per full size message of the other class. */
+    attr.weights = NULL;
+    attr.maxprio = 1;
+    attr.wfq_bytes = 1;
+    TEST_ASSERT_EQUAL(0, pq_create(&q, &attr));
+    for (size_t i = 0; i < attr.maxmsg; ++i) {
+        m.prio = (i < 4) ? 1 : 0;
+        m.size = (msgsize_t) ((i < 4) ? Q_MSGSIZE : 1);
+        TEST_ASSERT_EQUAL(0, pq_send_nonbl(q, &m));
+    }
+    /* Class 1 has weight 2, so two full size messages per turn. */
+    const msgprio_t bytes[] = { 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1 };
+    for (size_t i = 0; i < ELEMENTS(bytes); ++i) {
+        TEST_ASSERT_EQUAL(0, pq_recv_nonbl(q, &m));
+        TEST_ASSERT_EQUAL(bytes[i], m.prio);
+    }
+    TEST_ASSERT_EQUAL(0, pq_destroy(q));
+
+    /* Expired messages leave their class from the middle of a full queue. */
+    attr.maxmsg = 4;
+    attr.wfq_bytes = 0;
+    attr.ttl = 1;
+    TEST_ASSERT_EQUAL(0, pq_create(&q, &attr));
+    m.size = 1;
+    for (char i = 0; i < 4; ++i) {
+        const struct pq_msg_ex x = {.base = {.msg = data,.size = 1,.prio = i & 1 },.ttl = (i == 2) ? 1 : 0 };
+        data[0] = i;
+        TEST_ASSERT_EQUAL(0, pq_send_ex(q, &x, PQ_TIMEOUT_ZERO));
+    }
+    usleep(2 * (1000000 / PQ_TIMEOUT_RESOLUTION));
+    m.prio = 0;
+    data[0] = 4;
+    TEST_ASSERT_EQUAL(0, pq_send_nonbl(q, &m));
+    const char left[] = { 0, 1, 3, 4 };
+    for (size_t i = 0; i < ELEMENTS(left); ++i) {
+        TEST_ASSERT_EQUAL(0, pq_recv_nonbl(q, &m));
+        TEST_ASSERT_EQUAL(left[i], data[0]);
+    }
+    TEST_ASSERT_EQUAL(0, q->fill);
+    TEST_ASSERT_EQUAL(0, pq_destroy(q));
+
+    attr.maxprio = Q_MAXPRIO;
+    attr.weights = weights;
+    attr.path = "/nonexistent";
+    TEST_ASSERT_EQUAL(EINVAL, pq_create(&q, &attr));
+}
+
+/******************************************************************************/
+
+void test_pq_bands(void) {
+    struct pq_attr attr = {.maxmsg = 10,.msgsize = Q_MSGSIZE,.order = PQ_ATTR_PRIOQ,.maxprio = Q_MAXPRIO };
+    struct pq_queue *q = NULL;
+    char    data[Q_MSGSIZE];
+    struct pq_msg m = {.msg = data,.size = 1 };
+
+    attr.bands[0].prio = 1;
+    attr.bands[0].percent = 101;
+    TEST_ASSERT_EQUAL(EINVAL, pq_create(&q, &attr));
+    /* 10% for 8 and up, 20% for 5 and up: 0..4 fill up to 8, 5..7 to 9. */
+    attr.bands[0].prio = 8;
+    attr.bands[0].percent = 10;
+    attr.bands[2].prio = 5;
+    attr.bands[2].percent = 20;
+    TEST_ASSERT_EQUAL(0, pq_create(&q, &attr));
+    m.prio = 4;
+    for (msgindex_t i = 0; i < 8; ++i) {
+        TEST_ASSERT_EQUAL(0, pq_send_nonbl(q, &m));
+    }
+    TEST_ASSERT_EQUAL(EAGAIN, pq_send_nonbl(q, &m));
+    TEST_ASSERT_EQUAL(ETIMEDOUT, pq_send_timed(q, &m, 1));
+    m.prio = 7;
+    TEST_ASSERT_EQUAL(0, pq_send_nonbl(q, &m));
+    TEST_ASSERT_EQUAL(EAGAIN, pq_send_nonbl(q, &m));
+    m.prio = 8;
+    TEST_ASSERT_EQUAL(0, pq_send_nonbl(q, &m));
+    TEST_ASSERT_EQUAL(EAGAIN, pq_send_nonbl(q, &m));
+    TEST_ASSERT_EQUAL(10, q->fill);
+    /* Receiving 8 and 7 frees the reserved slots only for 5 and up. */
+    TEST_ASSERT_EQUAL(0, pq_recv_nonbl(q, &m));
+    TEST_ASSERT_EQUAL(0, pq_recv_nonbl(q, &m));
+    m.prio = 4;
+    TEST_ASSERT_EQUAL(EAGAIN, pq_send_nonbl(q, &m));
+    m.prio = 5;
+    TEST_ASSERT_EQUAL(0, pq_send_nonbl(q, &m));
+    TEST_ASSERT_EQUAL(0, pq_destroy(q));
+}
+
+/******************************************************************************/
+
+void   *test_pq_shard_task(void *aShard) {
+    char    data[Q_MSGSIZE];
+    struct pq_msg m = {.msg = data,.size = 0 };
+    /* A thread of its own gets another home lane and steals. */
+    TEST_ASSERT_EQUAL(0, pq_shard_recv(aShard, &m, PQ_TIMEOUT_INF));
+    TEST_ASSERT_EQUAL(42, data[0]);
+    return NULL;
+}
+
+void test_pq_shard(void) {
+    struct pq_attr attr = {.maxmsg = 2,.msgsize = Q_MSGSIZE,.order = PQ_ATTR_FIFO,.maxprio = Q_MAXPRIO };
+    struct pq_shard *sh = NULL;
+    char    data[Q_MSGSIZE];
+    struct pq_msg m = {.msg = data,.size = 1 };
+    pthread_t tid;
+
+    TEST_ASSERT_EQUAL(EINVAL, pq_shard_create(&sh, &attr, 0));
+    attr.name = "/pq_test_shard";
+    TEST_ASSERT_EQUAL(EINVAL, pq_shard_create(&sh, &attr, 4));
+    attr.name = NULL;
+    TEST_ASSERT_EQUAL(0, pq_shard_create(&sh, &attr, 4));
+
+    /* The home lane fills first, then the others take the rest. */
+    for (char i = 0; i < 8; ++i) {
+        data[0] = i;
+        TEST_ASSERT_EQUAL(0, pq_shard_send(sh, &m, PQ_TIMEOUT_ZERO));
+    }
+    TEST_ASSERT_EQUAL(EAGAIN, pq_shard_send(sh, &m, PQ_TIMEOUT_ZERO));
+    TEST_ASSERT_EQUAL(ETIMEDOUT, pq_shard_send(sh, &m, 1));
+    for (char i = 0; i < 8; ++i) {
+        TEST_ASSERT_EQUAL(0, pq_shard_recv(sh, &m, PQ_TIMEOUT_ZERO));
+        TEST_ASSERT_EQUAL(i, data[0]);
+    }
+    TEST_ASSERT_EQUAL(EAGAIN, pq_shard_recv(sh, &m, PQ_TIMEOUT_ZERO));
+    TEST_ASSERT_EQUAL(ETIMEDOUT, pq_shard_recv(sh, &m, 1));
+
+    /* A receiver blocked on all lanes wakes up for a message in any. */
+    TEST_ASSERT_EQUAL(0, pthread_create(&tid, NULL, test_pq_shard_task, sh));
+    usleep(10000);
+    data[0] = 42;
+    TEST_ASSERT_EQUAL(0, pq_shard_send(sh, &m, PQ_TIMEOUT_INF));
+    TEST_ASSERT_EQUAL(0, pthread_join(tid, NULL));
+    TEST_ASSERT_EQUAL(0, pq_shard_destroy(sh));
+}
+
+/******************************************************************************/
+
+void test_pq_multi(void) {
+    struct pq_attr attr = {.maxmsg = 2,.msgsize = Q_MSGSIZE,.order = PQ_ATTR_FIFO,.maxprio = Q_MAXPRIO };
+    struct pq_shard *sh = NULL;
+    char    data[Q_MSGSIZE];
+    struct pq_msg m = {.msg = data,.size = 1 };
+    unsigned seen = 0;
+
+    TEST_ASSERT_EQUAL(EINVAL, pq_multi_create(&sh, &attr, 4));
+    attr.order = PQ_ATTR_PRIOQ;
+    attr.aging = 10;
+    TEST_ASSERT_EQUAL(EINVAL, pq_multi_create(&sh, &attr, 4));
+    attr.aging = 0;
+    TEST_ASSERT_EQUAL(0, pq_multi_create(&sh, &attr, 4));
+
+    /* Sends spill over to other heaps until all are full. */
+    for (char i = 0; i < 8; ++i) {
+        data[0] = i;
+        m.prio = (msgprio_t) i;
+        TEST_ASSERT_EQUAL(0, pq_shard_send(sh, &m, PQ_TIMEOUT_ZERO));
+    }
+    TEST_ASSERT_EQUAL(EAGAIN, pq_shard_send(sh, &m, PQ_TIMEOUT_ZERO));
+
+    /* Each heap publishes the priority of its top. */
+    for (msgindex_t i = 0; i < 4; ++i) {
+        struct pq_queue *const q = sh->lane[i];
+        TEST_ASSERT_EQUAL(2, q->fill);
+        TEST_ASSERT_EQUAL(q->message[pq_next(q)].prio, q->top);
+    }
+
+    /* Receives take every message once, not strictly in order. */
+    for (char i = 0; i < 8; ++i) {
+        TEST_ASSERT_EQUAL(0, pq_shard_recv(sh, &m, PQ_TIMEOUT_ZERO));
+        TEST_ASSERT_EQUAL(data[0], m.prio);
+        seen |= 1u << data[0];
+    }
+    TEST_ASSERT_EQUAL(0xff, seen);
+    TEST_ASSERT_EQUAL(EAGAIN, pq_shard_recv(sh, &m, PQ_TIMEOUT_ZERO));
+    TEST_ASSERT_EQUAL(0, pq_shard_destroy(sh));
+}
+
+/******************************************************************************/
+
+void test_pq_combine(void) {
+    struct pq_attr attr = {.maxmsg = 4,.msgsize = Q_MSGSIZE,.order = PQ_ATTR_FIFO,.maxprio = Q_MAXPRIO,.combine = 4 };
+    struct pq_queue *q = NULL;
+    char    data[Q_MSGSIZE];
+    char    other[Q_MSGSIZE];
+    struct pq_msg m = {.msg = data,.size = 1 };
+    struct pq_msg in = {.msg = other,.size = 1,.prio = 7 };
+    struct pq_msg out = {.msg = data,.size = 0 };
+    struct pq_stats st;
+
+    TEST_ASSERT_EQUAL(EINVAL, pq_create(&q, &attr));
+    attr.order = PQ_ATTR_PRIOQ;
+    attr.name = "/pq_test_combine";
+    TEST_ASSERT_EQUAL(EINVAL, pq_create(&q, &attr));
+    attr.name = NULL;
+    TEST_ASSERT_EQUAL(0, pq_create(&q, &attr));
+
+    /* Alone, a thread combines its own requests. */
+    for (char i = 1; i <= 4; ++i) {
+        data[0] = i;
+        m.prio = (msgprio_t) i;
+        TEST_ASSERT_EQUAL(0, pq_send_nonbl(q, &m));
+    }
+    TEST_ASSERT_EQUAL(EAGAIN, pq_send_nonbl(q, &m));
+    TEST_ASSERT_EQUAL(ETIMEDOUT, pq_send_timed(q, &m, 1));
+    for (char i = 4; i >= 1; --i) {
+        TEST_ASSERT_EQUAL(0, pq_recv_timed(q, &m, 1));
+        TEST_ASSERT_EQUAL(i, data[0]);
+    }
+    TEST_ASSERT_EQUAL(ETIMEDOUT, pq_recv_timed(q, &m, 1));
+
+    /* A pending receive takes a pending send of the same batch directly. */
+    struct pq_request *const req = pq_requests(q);
+    other[0] = 42;
+    req[0].recv = &out;
+    req[0].state = PQ_REQ_RECV;
+    req[1].send = &in;
+    req[1].state = PQ_REQ_SEND;
+    data[0] = 1;
+    m.prio = 1;
+    TEST_ASSERT_EQUAL(0, pq_send_nonbl(q, &m));
+    TEST_ASSERT_EQUAL(PQ_REQ_DONE, req[0].state);
+    TEST_ASSERT_EQUAL(PQ_REQ_DONE, req[1].state);
+    TEST_ASSERT_EQUAL(0, req[0].status);
+    TEST_ASSERT_EQUAL(42, data[0]);
+    TEST_ASSERT_EQUAL(7, out.prio);
+    req[0].state = PQ_REQ_FREE;
+    req[1].state = PQ_REQ_FREE;
+    TEST_ASSERT_EQUAL(0, pq_get_stats(q, &st));
+    TEST_ASSERT_EQUAL(2, st.combined);
+    TEST_ASSERT_EQUAL(1, st.handed_off);
+    TEST_ASSERT_EQUAL(1, q->fill);
+    TEST_ASSERT_EQUAL(0, pq_destroy(q));
+}
+
+/******************************************************************************/
+
+void   *test_pq_handoff_task(void *aQueue) {
+    char    data[Q_MSGSIZE];
+    struct pq_msg m = {.msg = data,.size = 1 };
+    data[0] = 0;
+    if (pq_recv_timed(aQueue, &m, PQ_TIMEOUT_INF) == 0) {
+        /* Received a handoff; send one back, waiting for a receiver. */
+        ++data[0];
+        TEST_ASSERT_EQUAL(0, pq_send_timed(aQueue, &m, PQ_TIMEOUT_INF));
+    }
+    return NULL;
+}
+
+void   *test_pq_handoff_recv_task(void *aReceiver) {
+    struct test_receiver *const receiver = aReceiver;
+    char    data[Q_MSGSIZE];
+    struct pq_msg m = {.msg = data,.size = 1 };
+    TEST_ASSERT_EQUAL(0, pq_recv_timed(receiver->queue, &m, PQ_TIMEOUT_INF));
+    __atomic_store_n(&receiver->value, data[0], __ATOMIC_RELEASE);
+    return NULL;
+}
+
+void test_pq_handoff(void) {
+    struct pq_attr attr = {.maxmsg = 0,.msgsize = Q_MSGSIZE,.order = PQ_ATTR_DELAY,.maxprio = Q_MAXPRIO };
+    struct pq_queue *q = NULL;
+    char    data[Q_MSGSIZE];
+    struct pq_msg m = {.msg = data,.size = 1,.prio = 3 };
+    struct pq_stats st;
+    pthread_t tid;
+
+    TEST_ASSERT_EQUAL(EINVAL, pq_create(&q, &attr));
+    attr.order = PQ_ATTR_FIFO;
+    attr.full = PQ_FULL_DROP_NEW;
+    TEST_ASSERT_EQUAL(EINVAL, pq_create(&q, &attr));
+    attr.full = PQ_FULL_REJECT;
+    TEST_ASSERT_EQUAL(0, pq_create(&q, &attr));
+
+    /* A rendezvous queue only passes messages to a waiting receiver. */
+    TEST_ASSERT_EQUAL(EAGAIN, pq_send_nonbl(q, &m));
+    TEST_ASSERT_EQUAL(ETIMEDOUT, pq_send_timed(q, &m, 1));
+    TEST_ASSERT_EQUAL(ETIMEDOUT, pq_recv_timed(q, &m, 1));
+    TEST_ASSERT_EQUAL(0, pthread_create(&tid, NULL, test_pq_handoff_task, q));
+    usleep(10000);
+    data[0] = 41;
+    TEST_ASSERT_EQUAL(0, pq_send_nonbl(q, &m));
+    TEST_ASSERT_EQUAL(0, pq_recv_timed(q, &m, PQ_TIMEOUT_INF));
+    TEST_ASSERT_EQUAL(42, data[0]);
+    TEST_ASSERT_EQUAL(3, m.prio);
+    TEST_ASSERT_EQUAL(0, pthread_join(tid, NULL));
+    TEST_ASSERT_EQUAL(0, pq_get_stats(q, &st));
+    TEST_ASSERT_EQUAL(2, st.handed_off);
+
+    /* A receive that does not wait takes the message of a waiting sender. */
+    struct test_sender sender = {.queue = q,.value = 5 };
+    TEST_ASSERT_EQUAL(EAGAIN, pq_recv_nonbl(q, &m));
+    TEST_ASSERT_EQUAL(0, pthread_create(&tid, NULL, test_pq_wait_lists_task, &sender));
+    while (q->waiting_to_send == 0) {
+        usleep(1000);
+    }
+    TEST_ASSERT_EQUAL(0, pq_recv_nonbl(q, &m));
+    TEST_ASSERT_EQUAL(5, data[0]);
+    TEST_ASSERT_EQUAL(0, pthread_join(tid, NULL));
+    TEST_ASSERT_EQUAL(0, q->waiting_to_send);
+    TEST_ASSERT_EQUAL(EAGAIN, pq_recv_nonbl(q, &m));
+
+    /* A receiver that got a message handed over returns without the mutex. */
+    struct test_receiver receiver = {.queue = q,.value = 0 };
+    TEST_ASSERT_EQUAL(0, pthread_create(&tid, NULL, test_pq_handoff_recv_task, &receiver));
+    while (q->waiting_to_recv == 0) {
+        usleep(1000);
+    }
+    data[0] = 9;
+    TEST_ASSERT_EQUAL(0, pq_send_nonbl(q, &m));
+    TEST_ASSERT_EQUAL(0, pthread_mutex_lock(&q->mtx));
+    for (int i = 0; (i < 2000) && (__atomic_load_n(&receiver.value, __ATOMIC_ACQUIRE) == 0); ++i) {
+        usleep(1000);
+    }
+    const char got = __atomic_load_n(&receiver.value, __ATOMIC_ACQUIRE);
+    TEST_ASSERT_EQUAL(0, pthread_mutex_unlock(&q->mtx));
+    TEST_ASSERT_EQUAL(0, pthread_join(tid, NULL));
+    TEST_ASSERT_EQUAL(9, got);
+    TEST_ASSERT_EQUAL(0, pq_get_stats(q, &st));
+    TEST_ASSERT_EQUAL(4, st.handed_off);
+    TEST_ASSERT_EQUAL(0, pq_destroy(q));
+
+    /* A buffered queue hands over while it is empty. */
+    attr.maxmsg = Q_MAXMSG;
+    attr.order = PQ_ATTR_PRIOQ;
+    TEST_ASSERT_EQUAL(0, pq_create(&q, &attr));
+    TEST_ASSERT_EQUAL(0, pthread_create(&tid, NULL, test_pq_handoff_task, q));
+    usleep(10000);
+    data[0] = 41;
+    TEST_ASSERT_EQUAL(0, pq_send_nonbl(q, &m));
+    TEST_ASSERT_EQUAL(0, pthread_join(tid, NULL));
+    TEST_ASSERT_EQUAL(1, q->fill);
+    TEST_ASSERT_EQUAL(0, pq_recv_nonbl(q, &m));
+    TEST_ASSERT_EQUAL(42, data[0]);
+    TEST_ASSERT_EQUAL(0, pq_get_stats(q, &st));
+    TEST_ASSERT_EQUAL(1, st.handed_off);
+    TEST_ASSERT_EQUAL(0, pq_destroy(q));
+}
+
+/******************************************************************************/
+
+void   *test_pq_wait_lists_task(void *aSender) {
+    const struct test_sender *const sender = aSender;
+    char    data[Q_MSGSIZE];
+    struct pq_msg m = {.msg = data,.size = 1 };
+    data[0] = sender->value;
+    TEST_ASSERT_EQUAL(0, pq_send_timed(sender->queue, &m, PQ_TIMEOUT_INF));
+    return NULL;
+}
+
+void test_pq_wait_lists(void) {
+    struct pq_attr attr = {.maxmsg = 1,.msgsize = Q_MSGSIZE,.order = PQ_ATTR_FIFO,.maxprio = Q_MAXPRIO };
+    char    data[Q_MSGSIZE];
+    struct pq_msg m = {.msg = data,.size = 1 };
+    struct pq_queue *q = NULL;
+    struct test_sender sender[3];
+    pthread_t tid[3];
+
+    TEST_ASSERT_EQUAL(0, pq_create(&q, &attr));
+    TEST_ASSERT_EQUAL(1, q->wait_lists);
+    data[0] = 0;
+    TEST_ASSERT_EQUAL(0, pq_send_nonbl(q, &m));
+
+    /* Senders blocked on a full queue get free slots in arrival order. */
+    for (int i = 0; i < 3; ++i) {
+        sender[i].queue = q;
+        sender[i].value = (char) (i + 1);
+        TEST_ASSERT_EQUAL(0, pthread_create(&tid[i], NULL, test_pq_wait_lists_task, &sender[i]));
+        usleep(10000);
+    }
+    TEST_ASSERT_EQUAL(3, q->waiting_to_send);
+    for (char i = 0; i < 4; ++i) {
+        TEST_ASSERT_EQUAL(0, pq_recv_timed(q, &m, PQ_TIMEOUT_INF));
+        TEST_ASSERT_EQUAL(i, data[0]);
+        /* Let the sender woken fill the slot before receiving again. */
+        usleep(10000);
+    }
+    for (int i = 0; i < 3; ++i) {
+        TEST_ASSERT_EQUAL(0, pthread_join(tid[i], NULL));
+    }
+    TEST_ASSERT_NULL(q->waiter_head[PQ_OP_SEND]);
+
+    /* A spurious wakeup does not let a sender jump the line. */
+    data[0] = 0;
+    TEST_ASSERT_EQUAL(0, pq_send_nonbl(q, &m));
+    for (int i = 0; i < 2; ++i) {
+        TEST_ASSERT_EQUAL(0, pthread_create(&tid[i], NULL, test_pq_wait_lists_task, &sender[i]));
+        usleep(10000);
+    }
+    TEST_ASSERT_EQUAL(0, pq_lock(q, PQ_OP_OTHER));
+    TEST_ASSERT_NOT_NULL(q->waiter_head[PQ_OP_SEND]->next);
+    TEST_ASSERT_EQUAL(0, pthread_cond_signal(&q->waiter_head[PQ_OP_SEND]->next->cond));
+    TEST_ASSERT_EQUAL(0, pq_unlock(q));
+    usleep(10000);
+    TEST_ASSERT_EQUAL(2, q->waiting_to_send);
+    for (char i = 0; i < 3; ++i) {
+        TEST_ASSERT_EQUAL(0, pq_recv_timed(q, &m, PQ_TIMEOUT_INF));
+        TEST_ASSERT_EQUAL(i, data[0]);
+        usleep(10000);
+    }
+    for (int i = 0; i < 2; ++i) {
+        TEST_ASSERT_EQUAL(0, pthread_join(tid[i], NULL));
+    }
+    TEST_ASSERT_EQUAL(0, pq_destroy(q));
+}
+
+/******************************************************************************/
+
+void   *test_pq_recv_prio_task(void *aReceiver) {
+    struct test_receiver *const receiver = aReceiver;
+    char    data[Q_MSGSIZE];
+    struct pq_msg m = {.msg = data,.size = 0 };
+    TEST_ASSERT_EQUAL(0, pq_recv_prio(receiver->queue, &m, receiver->prio, PQ_TIMEOUT_INF));
+    receiver->value = data[0];
+    return NULL;
+}
+
+void test_pq_recv_prio(void) {
+    struct pq_attr attr = {.maxmsg = Q_MAXMSG,.msgsize = Q_MSGSIZE,.order = PQ_ATTR_FIFO,.maxprio = Q_MAXPRIO };
+    char    data[Q_MSGSIZE];
+    struct pq_msg m = {.msg = data,.size = 1 };
+    struct pq_queue *q = NULL;
+    struct test_receiver receiver[4];
+    pthread_t tid[4];
+    static const msgprio_t prio[4] = { 0, 2, 1, 2 };
+
+    TEST_ASSERT_EQUAL(0, pq_create(&q, &attr));
+    TEST_ASSERT_EQUAL(EAGAIN, pq_recv_prio(q, &m, 1, PQ_TIMEOUT_ZERO));
+    TEST_ASSERT_EQUAL(ETIMEDOUT, pq_recv_prio(q, &m, 1, 1));
+
+    /* Waiting receivers get messages by priority, then arrival. */
+    for (int i = 0; i < 4; ++i) {
+        receiver[i].queue = q;
+        receiver[i].prio = prio[i];
+        receiver[i].value = 0;
+        TEST_ASSERT_EQUAL(0, pthread_create(&tid[i], NULL, test_pq_recv_prio_task, &receiver[i]));
+        usleep(10000);
+    }
+    for (char i = 1; i <= 4; ++i) {
+        data[0] = i;
+        TEST_ASSERT_EQUAL(0, pq_send_nonbl(q, &m));
+        usleep(10000);
+    }
+    for (int i = 0; i < 4; ++i) {
+        TEST_ASSERT_EQUAL(0, pthread_join(tid[i], NULL));
+    }
+    TEST_ASSERT_EQUAL(4, receiver[0].value);
+    TEST_ASSERT_EQUAL(1, receiver[1].value);
+    TEST_ASSERT_EQUAL(3, receiver[2].value);
+    TEST_ASSERT_EQUAL(2, receiver[3].value);
+    TEST_ASSERT_EQUAL(0, pq_destroy(q));
+}
+
+/******************************************************************************/
+
+void test_pq_mutex(void) {
+    struct pq_attr attr = {.maxmsg = Q_MAXMSG,.msgsize = Q_MSGSIZE,.order = PQ_ATTR_PRIFO,.maxprio = Q_MAXPRIO };
+    struct pq_queue *q = NULL;
+    char    data[Q_MSGSIZE];
+    struct pq_msg m = {.msg = data,.size = 1 };
+    int     value;
+
+    attr.mutex = 9;
+    TEST_ASSERT_EQUAL(EINVAL, pq_create(&q, &attr));
+    attr.mutex = PQ_MUTEX_ADAPTIVE;
+    TEST_ASSERT_EQUAL(0, pq_create(&q, &attr));
+    TEST_ASSERT_EQUAL(0, pq_send_nonbl(q, &m));
+    TEST_ASSERT_EQUAL(0, pq_recv_nonbl(q, &m));
+    TEST_ASSERT_EQUAL(0, pq_destroy(q));
+    attr.mutex = PQ_MUTEX_NORMAL;
+    attr.protocol = 9;
+    TEST_ASSERT_EQUAL(EINVAL, pq_create(&q, &attr));
+
+    attr.protocol = PQ_PROTO_INHERIT;
+    TEST_ASSERT_EQUAL(0, pq_create(&q, &attr));
+    TEST_ASSERT_EQUAL(0, pthread_mutexattr_gettype(&q->attr, &value));
+    TEST_ASSERT_EQUAL(PTHREAD_MUTEX_NORMAL, value);
+    TEST_ASSERT_EQUAL(0, pthread_mutexattr_getprotocol(&q->attr, &value));
+    TEST_ASSERT_EQUAL(PTHREAD_PRIO_INHERIT, value);
+    TEST_ASSERT_EQUAL(0, pq_send_nonbl(q, &m));
+    TEST_ASSERT_EQUAL(0, pq_recv_timed(q, &m, 1));
+    TEST_ASSERT_EQUAL(ETIMEDOUT, pq_recv_timed(q, &m, 1));
+    TEST_ASSERT_EQUAL(0, pq_destroy(q));
+
+    attr.mutex = PQ_MUTEX_DEFAULT;
+    attr.protocol = PQ_PROTO_PROTECT;
+    attr.ceiling = sched_get_priority_max(SCHED_FIFO);
+    TEST_ASSERT_EQUAL(0, pq_create(&q, &attr));
+    TEST_ASSERT_EQUAL(0, pthread_mutexattr_getprioceiling(&q->attr, &value));
+    TEST_ASSERT_EQUAL(attr.ceiling, value);
+    /* Locking raises the thread to the ceiling, which only a real-time
+     * thread may do, and creating one needs privileges. */
+    pthread_t thread;
+    pthread_attr_t tattr;
+    const struct sched_param param = {.sched_priority = sched_get_priority_min(SCHED_FIFO) };
+    TEST_ASSERT_EQUAL(0, pthread_attr_init(&tattr));
+    TEST_ASSERT_EQUAL(0, pthread_attr_setinheritsched(&tattr, PTHREAD_EXPLICIT_SCHED));
+    TEST_ASSERT_EQUAL(0, pthread_attr_setschedpolicy(&tattr, SCHED_FIFO));
+    TEST_ASSERT_EQUAL(0, pthread_attr_setschedparam(&tattr, &param));
+    const int sc = pthread_create(&thread, &tattr, test_pq_mutex_task, q);
+    if (sc != EPERM) {
+        TEST_ASSERT_EQUAL(0, sc);
+        TEST_ASSERT_EQUAL(0, pthread_join(thread, NULL));
+    }
+    TEST_ASSERT_EQUAL(0, pthread_attr_destroy(&tattr));
+    TEST_ASSERT_EQUAL(0, pq_destroy(q));
+}
+
+void   *test_pq_mutex_task(void *aQueue) {
+    char    data[Q_MSGSIZE];
+    struct pq_msg m = {.msg = data,.size = 1 };
+    TEST_ASSERT_EQUAL(0, pq_send_nonbl(aQueue, &m));
+    TEST_ASSERT_EQUAL(0, pq_recv_nonbl(aQueue, &m));
+    return NULL;
+}
+
+/******************************************************************************/
+
+void test_pq_layout(void) {
+    /* Regions written by different threads start on their own lines. */
+    const size_t line[] = {
+        offsetof(struct pq_queue, request_offset) / PQ_CACHELINE,
+        offsetof(struct pq_queue, fill) / PQ_CACHELINE,
+        offsetof(struct pq_queue, waiting_to_send) / PQ_CACHELINE,
+        offsetof(struct pq_queue, waiting_to_recv) / PQ_CACHELINE,
+        offsetof(struct pq_queue, mtx) / PQ_CACHELINE,
+        offsetof(struct pq_queue, message) / PQ_CACHELINE
+    };
+    for (size_t i = 1; i < ELEMENTS(line); ++i) {
+        TEST_ASSERT_TRUE(line[i] > line[i - 1]);
+    }
+    TEST_ASSERT_EQUAL(line[1], offsetof(struct pq_queue, top) / PQ_CACHELINE);
+    TEST_ASSERT_EQUAL(line[2], (offsetof(struct pq_queue, ready_to_send) + sizeof(pthread_cond_t) - 1)
+                      / PQ_CACHELINE);
+    TEST_ASSERT_EQUAL(line[3], (offsetof(struct pq_queue, ready_to_recv) + sizeof(pthread_cond_t) - 1)
+                      / PQ_CACHELINE);
+    /* Queues on the heap are aligned like those in mapped memory. */
     for (msgorder_t order = 0; order < ELEMENTS(gQueue); ++order) {
-        TEST_ASSERT_EQUAL(EPERM, pq_cond_timedwait(&gQueue[order]->ready_to_send, &gQueue[order]->mtx, 1));
+        TEST_ASSERT_EQUAL(0, (uintptr_t) gQueue[order] % PQ_CACHELINE);
     }
 }
 
 /******************************************************************************/
 
+void test_pq_numa(void) {
+    struct pq_attr attr = {.maxmsg = Q_MAXMSG,.msgsize = Q_MSGSIZE,.order = PQ_ATTR_FIFO,.maxprio = Q_MAXPRIO };
+    struct pq_queue *q = NULL;
+    char    data[Q_MSGSIZE];
+    struct pq_msg m = {.msg = data,.size = 1 };
+
+    attr.numa = 9;
+    TEST_ASSERT_EQUAL(EINVAL, pq_create(&q, &attr));
+    attr.numa = PQ_NUMA_CONSUMER;
+    attr.path = "test_pq_numa.dat";
+    TEST_ASSERT_EQUAL(EINVAL, pq_create(&q, &attr));
+    attr.path = NULL;
+#ifdef __linux__
+    /* The first receive moves the queue, whole pages, to its node. */
+    TEST_ASSERT_EQUAL(0, pq_create(&q, &attr));
+    TEST_ASSERT_EQUAL(0, (uintptr_t) q % (uintptr_t) sysconf(_SC_PAGESIZE));
+    TEST_ASSERT_EQUAL(PQ_OP_RECV + 1, q->numa_side);
+    TEST_ASSERT_EQUAL(0, pq_send_nonbl(q, &m));
+    TEST_ASSERT_EQUAL(PQ_OP_RECV + 1, q->numa_side);
+    TEST_ASSERT_EQUAL(0, pq_recv_nonbl(q, &m));
+    TEST_ASSERT_EQUAL(0, q->numa_side);
+    TEST_ASSERT_EQUAL(0, pq_destroy(q));
+
+    attr.numa = PQ_NUMA_PRODUCER;
+    TEST_ASSERT_EQUAL(0, pq_create(&q, &attr));
+    TEST_ASSERT_EQUAL(0, pq_send_nonbl(q, &m));
+    TEST_ASSERT_EQUAL(0, q->numa_side);
+    TEST_ASSERT_EQUAL(0, pq_destroy(q));
+
+    attr.numa = PQ_NUMA_INTERLEAVE;
+    TEST_ASSERT_EQUAL(0, pq_create(&q, &attr));
+    TEST_ASSERT_EQUAL(0, q->numa_side);
+    TEST_ASSERT_EQUAL(0, pq_send_nonbl(q, &m));
+    TEST_ASSERT_EQUAL(0, pq_recv_nonbl(q, &m));
+    TEST_ASSERT_EQUAL(0, pq_destroy(q));
+#else
+    attr.numa = PQ_NUMA_INTERLEAVE;
+    TEST_ASSERT_EQUAL(ENOTSUP, pq_create(&q, &attr));
+#endif
+}
+
+/******************************************************************************/
+
+void test_pq_profile(void) {
+    struct pq_profile p;
+    TEST_ASSERT_EQUAL(EINVAL, pq_get_profile(NULL, &p));
+    TEST_ASSERT_EQUAL(EINVAL, pq_get_profile(gQueue[0], NULL));
+    TEST_ASSERT_EQUAL(EINVAL, pq_reset_profile(NULL));
+#ifdef PQ_PROFILE
+    for (msgorder_t order = 0; order < ELEMENTS(gQueue); ++order) {
+        char    data[Q_MSGSIZE];
+        struct pq_msg m = {.msg = "foo",.size = 4,.prio = 1 };
+        TEST_ASSERT_EQUAL(0, pq_send_nonbl(gQueue[order], &m));
+        TEST_ASSERT_EQUAL(0, pq_send_nonbl(gQueue[order], &m));
+        m.msg = data;
+        TEST_ASSERT_EQUAL(0, pq_recv_nonbl(gQueue[order], &m));
+        TEST_ASSERT_EQUAL(0, pq_get_profile(gQueue[order], &p));
+        TEST_ASSERT_EQUAL(order, p.order);
+        TEST_ASSERT_EQUAL(2, p.op[PQ_OP_SEND].acquired);
+        TEST_ASSERT_EQUAL(1, p.op[PQ_OP_RECV].acquired);
+        TEST_ASSERT_EQUAL(0, p.op[PQ_OP_RECV].contended);
+        TEST_ASSERT_EQUAL(2, profile_holds(&p.op[PQ_OP_SEND]));
+        TEST_ASSERT_EQUAL(0, pq_reset_profile(gQueue[order]));
+        TEST_ASSERT_EQUAL(0, pq_get_profile(gQueue[order], &p));
+        TEST_ASSERT_EQUAL(0, p.op[PQ_OP_SEND].acquired);
+    }
+
+    /* A blocked receiver holds the mutex before and after its wait, while
+     * others lock it for other operations. One handed a message on a
+     * private queue does not lock it again. */
+    const struct pq_attr attr = {.maxmsg = Q_MAXMSG,.msgsize = Q_MSGSIZE,.order = PQ_ATTR_FIFO,.maxprio = Q_MAXPRIO,
+        .name = "/pq_test_profile"
+    };
+    struct pq_queue *shared = NULL;
+    TEST_ASSERT_EQUAL(0, pq_create(&shared, &attr));
+    struct pq_queue *const queues[] = { gQueue[PQ_ATTR_FIFO], shared };
+    for (size_t n = 0; n < ELEMENTS(queues); ++n) {
+        struct pq_queue *const q = queues[n];
+        struct test_receiver receiver = {.queue = q,.prio = 0 };
+        const struct pq_msg m = {.msg = "x",.size = 2 };
+        char    data[Q_MSGSIZE];
+        struct pq_msg left = {.msg = data };
+        msgindex_t fill;
+        pthread_t thread;
+        while (pq_recv_nonbl(q, &left) == 0) {
+        }
+        TEST_ASSERT_EQUAL(0, pq_reset_profile(q));
+        TEST_ASSERT_EQUAL(0, pthread_create(&thread, NULL, test_pq_recv_prio_task, &receiver));
+        while (__atomic_load_n(&q->waiting_to_recv, __ATOMIC_ACQUIRE) == 0) {
+            usleep(1000);
+        }
+        for (int i = 0; i < 3; ++i) {
+            TEST_ASSERT_EQUAL(0, pq_get_fill(q, &fill));
+        }
+        TEST_ASSERT_EQUAL(0, pq_send_nonbl(q, &m));
+        TEST_ASSERT_EQUAL(0, pthread_join(thread, NULL));
+        TEST_ASSERT_EQUAL('x', receiver.value);
+        TEST_ASSERT_EQUAL(0, pq_get_profile(q, &p));
+        TEST_ASSERT_EQUAL(q->handoff ? 1 : 2, profile_holds(&p.op[PQ_OP_RECV]));
+        TEST_ASSERT_EQUAL(1, profile_holds(&p.op[PQ_OP_SEND]));
+        /* The three pq_get_fill() calls, and the end of pq_reset_profile(). */
+        TEST_ASSERT_EQUAL(4, profile_holds(&p.op[PQ_OP_OTHER]));
+    }
+    TEST_ASSERT_EQUAL(0, pq_destroy(shared));
+#else
+    TEST_ASSERT_EQUAL(ENOTSUP, pq_get_profile(gQueue[0], &p));
+    TEST_ASSERT_EQUAL(ENOTSUP, pq_reset_profile(gQueue[0]));
+#endif
+}
+
+/******************************************************************************/
+
 int main(void) {
     UNITY_BEGIN();
     RUN_TEST(test_pq_macros);
@@ -701,6 +2333,31 @@ int main(void) {
     RUN_TEST(test_pq_swap);
     RUN_TEST(test_pq_add_time);
     RUN_TEST(test_pq_cond_timedwait);
+    RUN_TEST(test_pq_profile);
+    RUN_TEST(test_pq_until);
+    RUN_TEST(test_pq_shared);
+    RUN_TEST(test_pq_persist);
+    RUN_TEST(test_pq_delay);
+    RUN_TEST(test_pq_ttl);
+    RUN_TEST(test_pq_full_policy);
+    RUN_TEST(test_pq_conflate);
+    RUN_TEST(test_pq_handles);
+    RUN_TEST(test_pq_aging);
+    RUN_TEST(test_pq_wfq);
+    RUN_TEST(test_pq_bands);
+    RUN_TEST(test_pq_shard);
+    RUN_TEST(test_pq_multi);
+    RUN_TEST(test_pq_combine);
+    RUN_TEST(test_pq_handoff);
+    RUN_TEST(test_pq_wait_lists);
+    RUN_TEST(test_pq_recv_prio);
+    RUN_TEST(test_pq_mutex);
+    RUN_TEST(test_pq_layout);
+    RUN_TEST(test_pq_numa);
+    RUN_TEST(test_pq_peek_fill);
+    RUN_TEST(test_pq_eventfd);
+    RUN_TEST(test_pq_set);
+    RUN_TEST(test_pq_set_blocking);
     RUN_TEST(test_sequence_same_priority);
     RUN_TEST(test_sequence_incr_priority);
     RUN_TEST(test_sequence_decr_priority);